@@ -84,43 +84,24 @@ def addResourceFiles(dpath):
     shutil.copytree('../rsc/addons/examples', os.path.join(dpath,'examples'))
     shutil.copytree('../rsc/addons/fed/fed', os.path.join(dpath,'fed'))
 
-# The FED keys we are interested in
-fed_keys = ['FontName', 'FontVersion', 'FontDate', 'FontAuthor', 'Description']
-
-def parseFEDFile(fpath):
+def parseCatalogue(fpath):
+    """Returns the infos of the fonts in the catalogue fpath, as
+    written by ``fen2eps --catalogue'', one dict per page.
+    """
     f = open(fpath,'r')
-    
-    info = {}
-    PM_VOID = 0
-    PM_INFO = 1
-    PM_TAG = 2
-    parse_mode = PM_VOID
-    key = ''
-    value = []
+
+    fonts = []
     for l in f.readlines():
         l = l.rstrip('\n')
-        if parse_mode == PM_INFO:
-            if l.startswith('%BEGIN'):
-                parse_mode = PM_TAG
-                key = ' '.join(l.split()[1:])
-                value = []
-            if l.startswith('%END FontInfo'):
-                parse_mode = PM_VOID
-        elif parse_mode == PM_TAG:
-            if l.startswith('%END'):
-                # Assign current key
-                if key in fed_keys:
-                    info[key] = '\n'.join(value)
-                parse_mode = PM_INFO
-            else:
-                value.append(l)
-        else:
-            if l.startswith('%BEGIN FontInfo'):
-                parse_mode = PM_INFO
+        if l.startswith('%%Page:'):
+            fonts.append({})
+        elif l.startswith('%%F2E ') and fonts:
+            key, value = l[6:].split(':', 1)
+            fonts[-1][key] = value.strip()
 
     f.close()
 
-    return info
+    return fonts
 
 default_ext = ['.fo','.xml','.xsl','.dblite','.wiki','.eps']
 
@@ -210,20 +191,16 @@ displayed images do not show the highest quality possible.
     
 """)
     
-    # Detect FED files
-    feds = glob.glob('../../../rsc/addons/fed/fed/*.fed')
+    # The catalogue of all fonts, in a single run, gives the
+    # infos and the image of each font
+    os.system("%s --catalogue ../../../rsc/addons/fed/fed > fontlist.ps" % fen2eps)
+    os.system("gs -sDEVICE=ppm -sPAPERSIZE=a6 -q -dNOPAUSE -sOutputFile=boards/page%d.ppm -dBATCH -r300 fontlist.ps")
     
-    fdict = {}
-    for font in feds:
-        info = parseFEDFile(font)
-        fdict[info['FontName']] = [info, font]
-        
-    for k in sorted(fdict.keys()):
-        info = fdict[k][0]
-        font = fdict[k][1]
+    page = 0
+    for info in parseCatalogue('fontlist.ps'):
+        page += 1
         # get file stem
-        head, tail = os.path.split(font)
-        stem, ext = os.path.splitext(tail)
+        stem, ext = os.path.splitext(info['File'])
         
         f.write("""== %s ==
 $$%s.fed$$, by %s (%s)
@@ -233,16 +210,16 @@ Image: boards/%s.png||**docbook scale="45"** **forrest width="600" alt="%s.png"*
 Raw:
  **docbook <?hard-pagebreak?>**
 
-""" % (info['FontName'],stem,info['FontAuthor'],info['FontDate'],stem,stem))
+""" % (info['Name'],stem,info['Author'],info['Date'],stem,stem))
 
-
-        # create eps and png files
-        os.system("%s -f %s < ../../../rsc/addons/examples/test.fen > boards/%s.eps" % (fen2eps, font, stem))
-        os.system("gs -sDEVICE=ppm -sPAPERSIZE=a6 -q -dNOPAUSE -sOutputFile=boards/%s.ppm -dBATCH -r300 boards/%s.eps" % (stem, stem))
-        os.system("cat boards/%s.ppm | pnmcrop -white | pnmtopng > boards/%s.png" % (stem, stem))
-        os.remove('boards/%s.ppm' % stem)
+        # create png file
+        os.system("cat boards/page%d.ppm | pnmcrop -white | pnmtopng > boards/%s.png" % (page, stem))
+        os.remove('boards/page%d.ppm' % page)
         
     f.close()
+
+    # The printable catalogue
+    os.system("ps2pdf fontlist.ps fontlist.pdf")
     
 def createDocumentation():
     cleanDocumentation()
@@ -42,6 +42,65 @@
 #include <sstream>
 #include <cstring>
 #include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cmath>
+#include <cctype>
+#include <cerrno>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <new>
+#include <chrono>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#ifndef _WIN32
+#include "fen2eps_store.h"
+#endif
+
+#ifdef F2E_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef F2E_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define F2E_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#if defined(__has_include) && !defined(F2E_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#define F2E_HAVE_SDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#endif
+#endif
 
 
 using namespace std;
@@ -72,6 +131,54 @@ const int mtBegin = 1;
 /** Marker type ``End'' */
 const int mtEnd = 2;
 
+/** Output format ``EPS'' */
+const int ofEps = 0;
+/** Output format ``PGM'' (raster image per diagram) */
+const int ofPgm = 1;
+/** Output format ``GIF'' (animated raster image of all diagrams) */
+const int ofGif = 2;
+
+/** No preview in the EPS files */
+const int pvNone = 0;
+/** EPSI preview, as hex bitmap in the comments */
+const int pvEpsi = 1;
+/** TIFF preview, behind a DOS EPS binary header */
+const int pvTiff = 2;
+
+/** Number of pages of a Postscript document, that get counted
+in its trailer (see writeEpsHeader()) */
+const int ciPagesAtEnd = -1;
+
+/** Classes of FEN strings, for the validation (see checkFENString()).
+Only the first class gets drawn exactly, the renderer draws the
+others as well as it can, if expandFENSquares() accepts the board. */
+const int feValid = 0;
+const int feSquares = 1;
+const int feRanks = 2;
+const int feRankLength = 3;
+const int fePiece = 4;
+const int feKings = 5;
+const int fePawns = 6;
+const int feSide = 7;
+const int feCastling = 8;
+const int feEnPassant = 9;
+/** Number of FEN string classes */
+const int ciFenErrors = 10;
+/** Descriptions of the FEN string classes */
+const char *pcFenErrors[] =
+{
+  "valid",
+  "wrong number of squares",
+  "wrong number of ranks",
+  "wrong rank length",
+  "unknown piece letter",
+  "missing or extra king",
+  "pawn on first or last rank",
+  "bad side to move",
+  "bad castling field",
+  "bad en passant square"
+};
+
 /*----------------------------------------------------- Global variables */
 
 /** Struct that keeps all informations about the used
@@ -146,18 +253,127 @@ struct font_info
   double BottomNotationFrameDepth;
 } fiFontInfo;
 
+/** Struct that keeps a single section of the font definitions,
+i.e. the EPS preamble or the outlines of one symbol. */
+struct font_section
+{
+  /** Name of the section */
+  string Name;
+  /** ID of the symbol, -1 for the EPS preamble */
+  int ID;
+  /** Text of the section, ready for output */
+  string Body;
+  /** IDs of the shared subpaths, that the section calls */
+  vector<int> Shared;
+  /** Start of the glyph procedure for the Type 3 font, i.e. the
+  ``setcachedevice'' with the bounding box. It's empty if the
+  symbol gets exported as plain procedure. */
+  string Glyph;
+};
+
+/** Sections of the current font, in the order of the font file */
+vector<font_section> vFontSections;
+
+/** Subpaths that are shared by several symbols of the current
+font, each one gets exported as procedure ``F2EP<ID>'' */
+vector<string> vSharedSubpaths;
+
+/** Number of different pieces */
+const int ciPieces = 12;
+
+/** Struct that keeps a piece of the layered font mode, i.e. its
+outline without the square background. */
+struct layered_piece
+{
+  /** Is ``true'' if the piece gets drawn on top of the square
+  background, ``false'' if its square symbols are used as they are */
+  bool Layered;
+  /** Outer contour of the piece, that masks the background */
+  string Contour;
+  /** Remaining subpaths of the piece */
+  string Inner;
+  /** Fill operator of the piece, ``fill'' or ``eofill'' */
+  string FillOp;
+  /** Starts of the glyph procedures for the contour and the whole
+  piece in the Type 3 font, empty if the piece gets exported as
+  plain procedures */
+  string ContourGlyph;
+  string PieceGlyph;
+};
+
+/** Pieces of the layered font mode, in the order of the square
+symbols (WP, BP, WN...) */
+layered_piece plpLayeredPieces[ciPieces];
+
+/** Struct that keeps the metrics of the built-in font, as
+they were read from its font definition file. */
+struct builtin_font_info
+{
+  const char *FontName;
+  const char *FontVersion;
+  const char *FontDate;
+  const char *FontAuthor;
+  double LineWidth;
+  double ScaleFactor;
+  double LeftMargin;
+  double RightMargin;
+  double TopMargin;
+  double BottomMargin;
+  double BoardSize;
+  double SquareSize;
+  double SquareHeight;
+  double SquareDepth;
+  double TopFrameHeight;
+  double TopFrameDepth;
+  double LeftFrameWidth;
+  double LeftFrameHeight;
+  double LeftFrameDepth;
+  double LeftNotationFrameWidth;
+  double LeftNotationFrameHeight;
+  double LeftNotationFrameDepth;
+  double RightFrameWidth;
+  double RightFrameHeight;
+  double RightFrameDepth;
+  double BottomFrameHeight;
+  double BottomFrameDepth;
+  double BottomNotationFrameHeight;
+  double BottomNotationFrameDepth;
+};
+
+/** Struct that keeps a single section of the built-in font. */
+struct builtin_font_section
+{
+  /** Name of the section */
+  const char *Name;
+  /** ID of the symbol, -1 for the EPS preamble */
+  int ID;
+  /** Text of the section, ready for output */
+  const char *Body;
+};
+
+#ifdef F2E_BUILTIN_FONT
+/* Generated by ``fen2eps --font-header'', see the Makefile */
+#include F2E_BUILTIN_FONT
+#endif
+
 /** Current line number within the input file. */
 unsigned int lineNumber = 0;
 /** Prefix for automatically generated output files. */
 string sPrefix = "";
 /** Name of the font definition file. */
 string sFontFile = "default.fed";
+/** Is ``true'' if the font file was given on the command line,
+``false'' else. */
+bool bFontFileGiven = false;
 /** Is ``true'' if the output diagrams should be written into
 separate files, each filename having the same prefix and a unique number,
 ``false'' else. */ 
 bool bPrefixExport = false;
 /** Number of the current output file for ``prefix'' mode. */
 unsigned int fileNumber = 0;
+/** Is ``true'' if the font should be written as C++ header
+for the built-in font, ``false'' else. */
+bool bFontHeader = false;
 /** String representation of number for current output file. */
 string sFileNumber = "";
 /** Is ``true'' if the board should be exported with notation,
@@ -183,6 +399,303 @@ bool pbSymbolExport[ciFontSymbols];
 int piCurrentBoard[64];
 /** Name of the current output file */
 string sOutFile = "";
+/** Format of the output, one of ofEps, ofPgm or ofGif */
+int iOutputFormat = ofEps;
+/** Name of the output file for the animated GIF image */
+string sGifFile = "";
+/** Resolution of raster images in pixels per inch */
+double dRasterDpi = 72.0;
+/** Preview of the EPS files, one of pvNone, pvEpsi or pvTiff */
+int iPreview = pvNone;
+/** EPSI preview section of the current diagram, that
+writeEpsHeader() puts behind the comments */
+string sEpsiPreview = "";
+/** Display time of a GIF frame in 1/100 seconds */
+int iGifDelay = 100;
+/** Number of board rows per grid page, 0 if the diagrams
+aren't placed on grid pages */
+int iGridRows = 0;
+/** Number of board columns per grid page */
+int iGridColumns = 0;
+/** Is ``true'' if the output files in ``prefix'' mode get written
+asynchronously, ``false'' else. */
+bool bAsyncOutput = false;
+/** Is ``true'' if the output files in ``prefix'' mode get spread
+over a tree of subdirectories, ``false'' else. */
+bool bFanout = false;
+/** Directory of the fonts for the font catalogue, empty if no
+catalogue gets written */
+string sCatalogueDir = "";
+/** Input file that gets watched for changes, empty if the input
+gets read from ``stdin'' */
+string sWatchFile = "";
+/** Is ``true'' if the pieces get drawn on top of the square
+backgrounds (``layered'' font mode), ``false'' else. */
+bool bLayered = false;
+/** Is ``true'' if subpaths that several symbols have in common get
+exported as shared procedures (the default), ``false'' else. */
+bool bShareSubpaths = true;
+/** Is ``true'' if the saved bytes of the shared subpaths get
+reported, ``false'' else. */
+bool bShareReport = false;
+/** Is ``true'' if the symbols get exported as glyphs of a Type 3
+font, which the interpreter can cache, ``false'' else. */
+bool bType3 = false;
+/** Is ``true'' if the boards get written as string of symbol
+indices, that a procedure of the prolog draws, ``false'' else. */
+bool bCompact = false;
+/** Name of the procset resource, that defines all symbols for the
+diagrams of ``-p'' (empty if each diagram defines its own symbols) */
+string sProcset = "";
+/** Name of the procset file, that gets embedded into the EPS files
+named on ``stdin'' (option ``--embed-procset'') */
+string sEmbedProcset = "";
+/** Number of the shard (1...iShards) that this process handles */
+int iShard = 0;
+/** Number of shards the input is split into, 0 for no sharding */
+int iShards = 0;
+/** Is ``true'' if the diagrams get written to ``stdout'' as frames
+with a header (see writeFrame()), ``false'' else. */
+bool bFramed = false;
+/** Is ``true'' if the boards on grid pages get a caption from
+the EPD ``id'' opcode, ``false'' else. */
+bool bCaptions = false;
+
+/** Struct that keeps the precompiled diagram template, i.e.
+the fixed frame and layout commands for the current font and
+options, with 64 slots for the square symbols in between. */
+struct diagram_template
+{
+  /** Fixed byte segments, segment \c i precedes square \c i
+  and segment 64 closes the diagram */
+  string Segments[65];
+  /** Output tokens (``F2E'' + symbol name) for the 26 square symbols */
+  string Symbols[26];
+  /** Procedures that draw a compact board, for the prolog */
+  string Procedure;
+  /** Buffer that the diagram gets assembled in */
+  char *Buffer;
+  /** Size of the buffer, enough for the longest possible diagram */
+  string::size_type BufferSize;
+} dtDiagram;
+
+/*---------------------------------------------------------------- Trace */
+
+/** Number of events in the ring buffer of each thread */
+const unsigned int ciTraceEvents = 1 << 16;
+
+/** Struct that keeps a single span of the trace. */
+struct trace_event
+{
+  /** Name of the span */
+  const char *Name;
+  /** Start time, in nanoseconds */
+  long long Start;
+  /** Duration, in nanoseconds */
+  long long Duration;
+  /** Number of the input line */
+  unsigned int Line;
+};
+
+/** Struct that keeps the ring buffer of trace events for a
+single thread. Only its own thread writes to it, so no locking
+is needed. */
+struct trace_buffer
+{
+  /** The recorded events */
+  trace_event Events[ciTraceEvents];
+  /** Number of events recorded so far, may be larger than
+  the buffer (the oldest events got overwritten then) */
+  unsigned long Count;
+  /** ID of the thread */
+  int ThreadID;
+  /** Next buffer in the list of all buffers */
+  trace_buffer *Next;
+};
+
+/** Is ``true'' if a trace gets recorded, ``false'' else */
+bool bTrace = false;
+/** Name of the trace file */
+string sTraceFile = "";
+/** List of the ring buffers of all threads */
+atomic<trace_buffer *> ptbTraceBuffers(NULL);
+/** Number of threads that recorded a trace */
+atomic<int> iTraceThreads(0);
+/** Ring buffer of the current thread */
+thread_local trace_buffer *ptbThreadTrace = NULL;
+/** Start of the trace */
+chrono::steady_clock::time_point tpTraceStart = chrono::steady_clock::now();
+
+/** Returns the current time for the trace, in nanoseconds.
+@return The time, 0 if no trace gets recorded
+*/
+long long traceClock()
+{
+  if (bTrace == false)
+    return 0;
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() -
+                                                    tpTraceStart).count();
+}
+
+/** Returns the ring buffer of the current thread, which gets
+registered on the first call. The main thread registers first,
+so it gets the ID 1.
+@return The ring buffer
+*/
+trace_buffer *traceThreadBuffer()
+{
+  trace_buffer *ptbBuffer = ptbThreadTrace;
+  if (ptbBuffer == NULL)
+  {
+    ptbBuffer = new trace_buffer;
+    ptbBuffer->Count = 0;
+    ptbBuffer->ThreadID = ++iTraceThreads;
+    ptbBuffer->Next = ptbTraceBuffers.load();
+    while (!ptbTraceBuffers.compare_exchange_weak(ptbBuffer->Next, ptbBuffer))
+      ;
+    ptbThreadTrace = ptbBuffer;
+  }
+  return ptbBuffer;
+}
+
+/** Records the span \a pcName for the input line \a iLine,
+that started at the time \a llStart, in the ring buffer of
+the current thread.
+@param pcName Name of the span
+@param iLine Number of the input line, 0 if there is none
+@param llStart Start time, as returned by traceClock()
+*/
+void traceSpan(const char *pcName, unsigned int iLine, long long llStart)
+{
+  if (bTrace == false)
+    return;
+  long long llEnd = traceClock();
+
+  trace_buffer *ptbBuffer = traceThreadBuffer();
+  trace_event &teEvent = ptbBuffer->Events[ptbBuffer->Count % ciTraceEvents];
+  teEvent.Name = pcName;
+  teEvent.Start = llStart;
+  teEvent.Duration = llEnd - llStart;
+  teEvent.Line = iLine;
+  ptbBuffer->Count++;
+}
+
+/** Writes all recorded spans to the trace file, in the
+``Chrome trace event'' format. Gets called at exit, when all
+other threads have finished.
+*/
+void writeTrace()
+{
+  std::ofstream fOut(sTraceFile.c_str());
+  if (!fOut)
+  {
+    cerr << "Error: Could not open trace file " << sTraceFile << "!" << endl;
+    return;
+  }
+
+  fOut << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << endl;
+  fOut << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,";
+  fOut << "\"args\":{\"name\":\"fen2eps\"}}";
+  char pcTime[64];
+  unsigned long iDropped = 0;
+  for (trace_buffer *ptbBuffer = ptbTraceBuffers.load(); ptbBuffer != NULL;
+       ptbBuffer = ptbBuffer->Next)
+  {
+    fOut << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,";
+    fOut << "\"tid\":" << ptbBuffer->ThreadID << ",\"args\":{\"name\":\"";
+    if (ptbBuffer->ThreadID == 1)
+      fOut << "main";
+    else
+      fOut << "thread " << ptbBuffer->ThreadID;
+    fOut << "\"}}";
+
+    unsigned long iFirst = 0;
+    if (ptbBuffer->Count > ciTraceEvents)
+    {
+      iFirst = ptbBuffer->Count - ciTraceEvents;
+      iDropped += iFirst;
+    }
+    for (unsigned long i = iFirst; i < ptbBuffer->Count; i++)
+    {
+      const trace_event &teEvent = ptbBuffer->Events[i % ciTraceEvents];
+      // Times are given in microseconds
+      snprintf(pcTime, sizeof(pcTime), "\"ts\":%lld.%03lld,\"dur\":%lld.%03lld",
+               teEvent.Start / 1000, teEvent.Start % 1000,
+               teEvent.Duration / 1000, teEvent.Duration % 1000);
+      fOut << ",\n{\"name\":\"" << teEvent.Name << "\",\"cat\":\"fen2eps\",";
+      fOut << "\"ph\":\"X\"," << pcTime << ",\"pid\":1,\"tid\":" << ptbBuffer->ThreadID;
+      fOut << ",\"args\":{\"line\":" << teEvent.Line << "}}";
+    }
+  }
+  fOut << endl << "]}" << endl;
+
+  if (iDropped > 0)
+    cerr << "Warning: The oldest " << iDropped << " trace events were dropped!" << endl;
+}
+
+/*--------------------------------------------------------------- Probes */
+
+/* Static tracepoints (USDT) of the provider ``fen2eps'', for
+bpftrace, perf or SystemTap. A probe is a single ``nop'' as long
+as no tracer is attached to it. Without ``sys/sdt.h'', or built
+with -DF2E_NO_PROBES, the probes compile away. Each probe has a
+semaphore, that an attached tracer counts up, such that arguments
+which cost something only get computed for it (F2E_PROBE_ENABLED). */
+
+#ifdef F2E_HAVE_SDT
+#define F2E_SEMAPHORE(name) \
+  __extension__ unsigned short fen2eps_##name##_semaphore \
+  __attribute__((unused)) __attribute__((section(".probes")))
+F2E_SEMAPHORE(font_load_start);
+F2E_SEMAPHORE(font_load_end);
+F2E_SEMAPHORE(line_read);
+F2E_SEMAPHORE(fen_decode);
+F2E_SEMAPHORE(glyph_export);
+F2E_SEMAPHORE(diagram_write);
+F2E_SEMAPHORE(file_close);
+
+#define F2E_PROBE_ENABLED(name) __builtin_expect(fen2eps_##name##_semaphore, 0)
+#define F2E_PROBE1(name, a) DTRACE_PROBE1(fen2eps, name, a)
+#define F2E_PROBE2(name, a, b) DTRACE_PROBE2(fen2eps, name, a, b)
+#define F2E_PROBE3(name, a, b, c) DTRACE_PROBE3(fen2eps, name, a, b, c)
+#else
+#define F2E_PROBE1(name, a)
+#define F2E_PROBE2(name, a, b)
+#define F2E_PROBE3(name, a, b, c)
+#endif
+
+/*---------------------------------------------------------- Allocations */
+
+#ifdef F2E_COUNT_ALLOCATIONS
+/* Built with -DF2E_COUNT_ALLOCATIONS, the heap allocations of
+each input line get counted. After the first diagram, rendering
+and writing a diagram must not allocate any more, else the run
+fails with an error. */
+
+/** Number of heap allocations of the current thread */
+thread_local long long llAllocations = 0;
+
+void *operator new(size_t iSize)
+{
+  llAllocations++;
+  void *p = malloc((iSize > 0) ? iSize : 1);
+  if (p == 0)
+    throw bad_alloc();
+  return p;
+}
+
+/* Kept out of line, else GCC takes the inlined free() for a
+mismatch with operator new */
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+#endif
 
 /*------------------------------------------------------------ Functions */
 
@@ -415,13 +928,56 @@ void writeSection(std::istream &fIn, std::ostream &fOut,
 }
 
 
-/** Expands the FEN string in \a inputLine to the
-position for the board \a piCurrentBoard.
-@param inputLine Current input line
+/** Expands the board of the FEN string at the start of the input
+line \a pcLine, with the length \a iLength, to the 64 characters
+of its squares in \a pcSquares, empty squares become spaces. Ranks
+aren't checked, the slashes get skipped. Doesn't touch any globals,
+such that the validation threads may call it.
+@param pcLine Current input line
+@param iLength Length of the input line
+@param pcSquares Receives the squares, 64 characters
+@return ``true'' if the board has exactly 64 squares, ``false'' else.
+*/
+bool expandFENSquares(const char *pcLine, string::size_type iLength, char *pcSquares)
+{
+  // Number of expanded squares
+  string::size_type iSquares = 0;
+  // Step through the line up to the first space...
+  for (string::size_type pos = 0; (pos < iLength) && (pcLine[pos] != ' '); pos++)
+  {
+    char cCurrent = pcLine[pos];
+    // Skip slashes...
+    if (cCurrent == '/')
+      continue;
+
+    // Expand digits 1-8 to equivalent number of empty squares
+    int iCount = 1;
+    if ((cCurrent >= '1') && (cCurrent <= '8'))
+    {
+      iCount = cCurrent - '0';
+      cCurrent = ' ';
+    }
+    // Too many squares?
+    if (iSquares + iCount > 64)
+      return false; // Yes
+    for (; iCount > 0; iCount--)
+      pcSquares[iSquares++] = cCurrent;
+  }
+
+  // Has the string the correct length now?
+  return (iSquares == 64);
+}
+
+/** Expands the FEN string at the start of the input line
+\a pcLine, with the length \a iLength, to the position for the
+board \a piCurrentBoard. The line is decoded in place, such that
+it may point right into the input buffer.
+@param pcLine Current input line
+@param iLength Length of the input line
 @return ``true'' if the conversion was successful and
 the \a piCurrentBoard is valid, ``false'' else.
 */
-bool expandFENString(string &inputLine)
+bool expandFENString(const char *pcLine, string::size_type iLength)
 {
   // Counters
   int row, col;
@@ -430,32 +986,10 @@ bool expandFENString(string &inputLine)
   for (row = 0; row < 26; row++)
     pbSymbolExport[row] = false;
 
-  // Cut off everything after the first space...
-  string::size_type pos = inputLine.find(' ');
-  if (pos != string::npos)
-    inputLine.erase(pos, string::npos);
-  
-  // Remove slashes...
-  pos = inputLine.find('/');
-  while (pos != string::npos)
-  {
-    inputLine.erase(pos, 1);
-    pos = inputLine.find('/', pos);
-  }
-
-  // Expand digits 1-8 to equivalent number of empty squares
-  replaceAll(inputLine, "1", " ");
-  replaceAll(inputLine, "2", "  ");
-  replaceAll(inputLine, "3", "   ");
-  replaceAll(inputLine, "4", "    ");
-  replaceAll(inputLine, "5", "     ");
-  replaceAll(inputLine, "6", "      ");
-  replaceAll(inputLine, "7", "       ");
-  replaceAll(inputLine, "8", "        ");
-
-  // Has the string the correct length now?
-  if (inputLine.size() != 64)
-    return false; // No
+  // The expanded FEN string
+  char pcSquares[64];
+  if (expandFENSquares(pcLine, iLength, pcSquares) == false)
+    return false;
 
   // Current character
   char cCurrent;
@@ -472,7 +1006,7 @@ bool expandFENString(string &inputLine)
         iExport = 0;  // Black square
       
       // Get current char
-      cCurrent = inputLine.at(row*8+col);
+      cCurrent = pcSquares[row*8+col];
       switch (cCurrent)
       {
         case 'P': // White pawn
@@ -525,6 +1059,148 @@ bool expandFENString(string &inputLine)
   return true;
 }
 
+/** Expands the FEN string in \a inputLine to the
+position for the board \a piCurrentBoard.
+@param inputLine Current input line
+@return ``true'' if the conversion was successful and
+the \a piCurrentBoard is valid, ``false'' else.
+*/
+bool expandFENString(const string &inputLine)
+{
+  return expandFENString(inputLine.data(), inputLine.size());
+}
+
+/** Returns the length of the field of the FEN string \a pcLine,
+with the length \a iLength, that starts at \a pos. */
+string::size_type fenFieldLength(const char *pcLine, string::size_type iLength,
+                                 string::size_type pos)
+{
+  string::size_type iEnd = pos;
+  while ((iEnd < iLength) && (pcLine[iEnd] != ' '))
+    iEnd++;
+  return iEnd - pos;
+}
+
+/** Checks the FEN string at the start of the input line \a pcLine,
+with the length \a iLength, strictly. Besides the board, the side
+to move, the castling rights and the en passant square are checked,
+if the line has them; further fields (or EPD opcodes) are not.
+@param pcLine Current input line
+@param iLength Length of the input line
+@return The class of the FEN string, feValid if it's correct,
+and the first error found else. The rank count and the rank lengths
+come before the total, such that feSquares is only left for a board
+whose ranks can't tell what's wrong with it. Whether the line can be
+drawn is up to expandFENSquares(), not to this class.
+*/
+int checkFENString(const char *pcLine, string::size_type iLength)
+{
+  // Position within the line
+  string::size_type pos = 0;
+  // Number of squares, ranks and squares of the current rank
+  int iSquares = 0;
+  int iRanks = 1;
+  int iRankSquares = 0;
+  // Number of kings
+  int iWhiteKings = 0;
+  int iBlackKings = 0;
+  // Errors of the board, besides its size
+  bool bRankLength = false;
+  bool bPiece = false;
+  bool bPawns = false;
+
+  for (; (pos < iLength) && (pcLine[pos] != ' '); pos++)
+  {
+    char cCurrent = pcLine[pos];
+    if (cCurrent == '/')
+    {
+      bRankLength = bRankLength || (iRankSquares != 8);
+      iRanks++;
+      iRankSquares = 0;
+      continue;
+    }
+    if ((cCurrent >= '1') && (cCurrent <= '8'))
+    {
+      iSquares += cCurrent - '0';
+      iRankSquares += cCurrent - '0';
+      continue;
+    }
+    iSquares++;
+    iRankSquares++;
+
+    switch (cCurrent)
+    {
+      case 'K': iWhiteKings++;
+                break;
+      case 'k': iBlackKings++;
+                break;
+      case 'P':
+      case 'p': bPawns = bPawns || (iRanks == 1) || (iRanks == 8);
+                break;
+      case 'N': case 'B': case 'R': case 'Q':
+      case 'n': case 'b': case 'r': case 'q':
+                break;
+      default:  bPiece = true;
+                break;
+    }
+  }
+  bRankLength = bRankLength || (iRankSquares != 8);
+
+  // Errors in the order of their classes
+  if (iRanks != 8)
+    return feRanks;
+  if (bRankLength == true)
+    return feRankLength;
+  if (iSquares != 64)
+    return feSquares;
+  if (bPiece == true)
+    return fePiece;
+  if ((iWhiteKings != 1) || (iBlackKings != 1))
+    return feKings;
+  if (bPawns == true)
+    return fePawns;
+
+  // Side to move
+  while ((pos < iLength) && (pcLine[pos] == ' '))
+    pos++;
+  string::size_type iField = fenFieldLength(pcLine, iLength, pos);
+  if (iField == 0)
+    return feValid;
+  if ((iField != 1) || ((pcLine[pos] != 'w') && (pcLine[pos] != 'b')))
+    return feSide;
+
+  // Castling rights
+  pos += iField;
+  while ((pos < iLength) && (pcLine[pos] == ' '))
+    pos++;
+  iField = fenFieldLength(pcLine, iLength, pos);
+  if (iField == 0)
+    return feValid;
+  if ((iField > 4) || ((pcLine[pos] == '-') && (iField > 1)))
+    return feCastling;
+  for (string::size_type c = pos; c < pos + iField; c++)
+  {
+    if ((strchr("KQkq-", pcLine[c]) == 0) || (pcLine[c] == '\0') ||
+        (memchr(pcLine + pos, pcLine[c], c - pos) != 0))
+      return feCastling;
+  }
+
+  // En passant square
+  pos += iField;
+  while ((pos < iLength) && (pcLine[pos] == ' '))
+    pos++;
+  iField = fenFieldLength(pcLine, iLength, pos);
+  if (iField == 0)
+    return feValid;
+  if ((iField == 1) && (pcLine[pos] == '-'))
+    return feValid;
+  if ((iField != 2) || (pcLine[pos] < 'a') || (pcLine[pos] > 'h') ||
+      ((pcLine[pos+1] != '3') && (pcLine[pos+1] != '6')))
+    return feEnPassant;
+
+  return feValid;
+}
+
 /** Checks whether the correct file header is present,
 i.e. \a fIn is a Fen2eps font definition file.
 @param fIn The input file
@@ -642,10 +1318,12 @@ void readPSDimension(std::ifstream &fIn, const string &sectionName, double *n)
 
 }
 
-/** Reads the font infos from the given file \a fIn.
+/** Reads the font infos from the given file \a fIn into \a fiInfo.
 @param fIn The input file
+@param fiInfo The font infos
+@return ``false'' if no ``FontInfo'' section was found, ``true'' else
 */
-void readFontInfos(std::ifstream &fIn)
+bool readFontInfos(std::ifstream &fIn, font_info &fiInfo)
 {
   // Found mark
   string sCurrentMark;
@@ -661,10 +1339,7 @@ void readFontInfos(std::ifstream &fIn)
 
   // No infos found?
   if (fIn.eof())
-  {
-    cerr << "Error: No ``FontInfo'' section found in " << sFontFile << "!" << endl;
-    std::exit(1);
-  }
+    return false;
 
   // Read info entries until the end of the ``FontInfo'' section
   markType = getNextMark(fIn, sCurrentMark);
@@ -677,71 +1352,79 @@ void readFontInfos(std::ifstream &fIn)
     {
       // Process the found section
       if (sCurrentMark == "FontName")
-        readString(fIn, sCurrentMark, fiFontInfo.FontName); 
+        readString(fIn, sCurrentMark, fiInfo.FontName); 
       if (sCurrentMark == "FontVersion")
-        readString(fIn, sCurrentMark, fiFontInfo.FontVersion); 
+        readString(fIn, sCurrentMark, fiInfo.FontVersion); 
       if (sCurrentMark == "FontDate")
-        readString(fIn, sCurrentMark, fiFontInfo.FontDate); 
+        readString(fIn, sCurrentMark, fiInfo.FontDate); 
       if (sCurrentMark == "FontAuthor")
-        readString(fIn, sCurrentMark, fiFontInfo.FontAuthor); 
+        readString(fIn, sCurrentMark, fiInfo.FontAuthor); 
       
       if (sCurrentMark == "SquareSize")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.SquareSize)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.SquareSize)); 
       if (sCurrentMark == "SquareHeight")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.SquareHeight)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.SquareHeight)); 
       if (sCurrentMark == "SquareDepth")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.SquareDepth)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.SquareDepth)); 
       if (sCurrentMark == "TopFrameHeight")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.TopFrameHeight)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.TopFrameHeight)); 
       if (sCurrentMark == "TopFrameDepth")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.TopFrameDepth)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.TopFrameDepth)); 
       if (sCurrentMark == "LeftFrameWidth")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.LeftFrameWidth)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.LeftFrameWidth)); 
       if (sCurrentMark == "LeftFrameHeight")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.LeftFrameHeight)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.LeftFrameHeight)); 
       if (sCurrentMark == "LeftFrameDepth")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.LeftFrameDepth)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.LeftFrameDepth)); 
       if (sCurrentMark == "LeftNotationFrameWidth")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.LeftNotationFrameWidth)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.LeftNotationFrameWidth)); 
       if (sCurrentMark == "LeftNotationFrameHeight")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.LeftNotationFrameHeight)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.LeftNotationFrameHeight)); 
       if (sCurrentMark == "LeftNotationFrameDepth")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.LeftNotationFrameDepth)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.LeftNotationFrameDepth)); 
       if (sCurrentMark == "RightFrameWidth")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.RightFrameWidth)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.RightFrameWidth)); 
       if (sCurrentMark == "RightFrameHeight")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.RightFrameHeight)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.RightFrameHeight)); 
       if (sCurrentMark == "RightFrameDepth")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.RightFrameDepth)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.RightFrameDepth)); 
       if (sCurrentMark == "BottomFrameHeight")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.BottomFrameHeight)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.BottomFrameHeight)); 
       if (sCurrentMark == "BottomFrameDepth")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.BottomFrameDepth)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.BottomFrameDepth)); 
       if (sCurrentMark == "BottomNotationFrameHeight")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.BottomNotationFrameHeight)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.BottomNotationFrameHeight)); 
       if (sCurrentMark == "BottomNotationFrameDepth")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.BottomNotationFrameDepth)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.BottomNotationFrameDepth)); 
       if (sCurrentMark == "EpsScalingFactor")
-        readNumber(fIn, sCurrentMark, &(fiFontInfo.ScaleFactor)); 
+        readNumber(fIn, sCurrentMark, &(fiInfo.ScaleFactor)); 
 
       if (sCurrentMark == "EpsBoardSize")
-        readPSDimension(fIn, sCurrentMark, &(fiFontInfo.BoardSize)); 
+        readPSDimension(fIn, sCurrentMark, &(fiInfo.BoardSize)); 
       if (sCurrentMark == "EpsDefaultLineWidth")
-        readPSDimension(fIn, sCurrentMark, &(fiFontInfo.LineWidth)); 
+        readPSDimension(fIn, sCurrentMark, &(fiInfo.LineWidth)); 
       if (sCurrentMark == "EpsLeftMargin")
-        readPSDimension(fIn, sCurrentMark, &(fiFontInfo.LeftMargin)); 
+        readPSDimension(fIn, sCurrentMark, &(fiInfo.LeftMargin)); 
       if (sCurrentMark == "EpsRightMargin")
-        readPSDimension(fIn, sCurrentMark, &(fiFontInfo.RightMargin)); 
+        readPSDimension(fIn, sCurrentMark, &(fiInfo.RightMargin)); 
       if (sCurrentMark == "EpsTopMargin")
-        readPSDimension(fIn, sCurrentMark, &(fiFontInfo.TopMargin)); 
+        readPSDimension(fIn, sCurrentMark, &(fiInfo.TopMargin)); 
       if (sCurrentMark == "EpsBottomMargin")
-        readPSDimension(fIn, sCurrentMark, &(fiFontInfo.BottomMargin)); 
+        readPSDimension(fIn, sCurrentMark, &(fiInfo.BottomMargin)); 
     }
 
     // Get next mark
     markType = getNextMark(fIn, sCurrentMark);
   }
-  
+
+  return true;
+}
+
+/** Computes the bounding box, translation and scaling factor
+of the current font, depending on the selected options.
+*/
+void computeFontLayout()
+{
   // Compute bounding box, translation and scaling factor
   // Was a board size specified?
   if (fiFontInfo.BoardSize > 0.0)
@@ -823,94 +1506,583 @@ int mapNameToID(const string &sSymbol)
   return 13;
 }
 
-/** Exports the needed piece symbols to ``fOut''.
-@param fOut The output file
-@param fFont The font definition file
+/** Reads the EPS preamble and the symbol definitions from
+the font file \a fFont into the font sections \a vSections.
+@param fFont The font definition file, positioned
+behind the ``FontInfo'' section
+@param vSections The font sections
 */
-void exportPieces(std::ostream &fOut, std::ifstream &fFont)
+void readFontSections(std::istream &fFont, vector<font_section> &vSections)
 {
   // Current mark
   string sCurrentMark;
   // Type of found mark
   int markType = getNextMark(fFont, sCurrentMark);
+  // The current section
+  font_section fsSection;
+  // Output of the current section
+  ostringstream sBody;
 
+  vSections.clear();
   while (!fFont.eof())
   {
     // Skip to next ``BEGIN'' mark
     while ((!fFont.eof()) &&
            (markType != mtBegin))
       markType = getNextMark(fFont, sCurrentMark);
+    if (fFont.eof())
+      break;
 
+    sBody.str("");
+    fsSection.Name = sCurrentMark;
     // Is it the EPS preamble?
     if (sCurrentMark == "EpsPreamble")
     {
-      // Yes, so export it
-      writeSection(fFont, fOut, sCurrentMark);
+      // Yes, so keep it as it is
+      fsSection.ID = -1;
+      writeSection(fFont, sBody, sCurrentMark);
     }
     else
     {
-      // Do we have to export the found symbol?
-      if (pbSymbolExport[mapNameToID(sCurrentMark)] == true)
-      {
-        // Yes
-        fOut << "/F2E" << sCurrentMark << " {" << endl;
-        writeSection(fFont, fOut, sCurrentMark, true);
-        fOut << "} def" << endl;
-      }
+      fsSection.ID = mapNameToID(sCurrentMark);
+      writeSection(fFont, sBody, sCurrentMark, true);
     }
+    fsSection.Body = sBody.str();
+    vSections.push_back(fsSection);
+
     markType = getNextMark(fFont, sCurrentMark);
   }
+}
 
-  // Export ``space'' and ``newline'' commands...
+/** Marks the shared subpaths that the exported symbols call,
+kept between the calls of exportPieces() */
+vector<bool> vSharedExport;
 
-  // Square width
-  fOut << endl << "/F2ESW {" << fiFontInfo.SquareSize;
-  fOut << " 0 translate} def" << endl;
-  // Jump from left frame to first square in a row
-  fOut << "/F2EFTOS {";
-  if (bNotation == true)
+/** Name of the Type 3 font with the symbols */
+const char *csType3Font = "F2EGlyphs";
+/** Character code of the first layered piece in the Type 3 font,
+the codes below are the symbol IDs + 1 */
+const int ciType3PieceCode = 64;
+/** Unique ID of the Type 3 font, given by its glyphs, such that
+glyphs stay in the cache from one diagram to the next */
+unsigned int piType3Xuid[2];
+
+/** Writes the glyph procedure \a sName of the Type 3 font
+to ``fOut''.
+@param fOut The output file
+@param sName Name of the glyph
+@param sGlyph Start of the procedure, see font_section::Glyph
+@param sBody Outline of the glyph
+*/
+void writeType3Glyph(std::ostream &fOut, const string &sName,
+                     const string &sGlyph, const string &sBody)
+{
+  fOut << "/" << sName << " {" << sGlyph << endl;
+  fOut << sBody;
+  fOut << "} def" << endl;
+}
+
+/** Writes the procedure for the symbol ``F2E<sName>'', that shows
+the glyph \a iCode of the Type 3 font, to ``fOut''.
+*/
+void writeType3Procedure(std::ostream &fOut, const string &sName, int iCode)
+{
+  char pcCode[8];
+  snprintf(pcCode, sizeof(pcCode), "\\%03o", iCode);
+  fOut << "/F2E" << sName << " {F2EGF setfont newpath 0 0 moveto (";
+  fOut << pcCode << ") show} def" << endl;
+}
+
+/** Writes the Type 3 font with the symbols marked in \a pbExport
+and the layered pieces marked in \a pbPieceExport, that have
+a glyph, to ``fOut''. Each of these symbols gets a procedure that
+shows its glyph, so the interpreter renders it only once per size.
+@param fOut The output file
+@param pbExport The symbols to export
+@param pbPieceExport The layered pieces to export
+*/
+void exportType3Glyphs(std::ostream &fOut, const bool *pbExport,
+                       const bool *pbPieceExport)
+{
+  // Counter
+  int i;
+  // Number of glyphs
+  int iGlyphs = 0;
+  // Name of a layered piece
+  string sPiece;
+
+  for (vector<font_section>::const_iterator it = vFontSections.begin();
+       it != vFontSections.end(); ++it)
   {
-    fOut << fiFontInfo.LeftNotationFrameWidth;
-    fOut << " " << (fiFontInfo.SquareDepth - fiFontInfo.LeftNotationFrameDepth);
+    if ((it->ID >= 0) && (pbExport[it->ID] == true) && !it->Glyph.empty())
+      iGlyphs++;
   }
-  else
+  for (i = 0; i < ciPieces; i++)
   {
-    fOut << fiFontInfo.LeftFrameWidth;
-    fOut << " " << (fiFontInfo.SquareDepth - fiFontInfo.LeftFrameDepth);
+    if ((pbPieceExport[i] == true) && !plpLayeredPieces[i].ContourGlyph.empty())
+      iGlyphs += 2;
   }
-  fOut << " translate} def" << endl;
-  // Jump from last square in a row to the right frame
-  fOut << "/F2ESTOF {" << fiFontInfo.SquareSize;
-  fOut << " " << (fiFontInfo.RightFrameDepth - fiFontInfo.SquareDepth);
-  fOut << " translate} def" << endl;
-  // New line
-  fOut << "/F2ENL {-";
-  if (bNotation == true)
+  if (iGlyphs == 0)
+    return;
+
+  // The font dictionary...
+  fOut << "/" << csType3Font << " 10 dict begin" << endl;
+  fOut << "/FontType 3 def" << endl;
+  fOut << "/FontMatrix [1 0 0 1 0 0] def" << endl;
+  fOut << "/FontBBox [0 0 0 0] def" << endl;
+  fOut << "/XUID [1000000 " << piType3Xuid[0] << " " << piType3Xuid[1] << "] def" << endl;
+  fOut << "/Encoding 256 array def" << endl;
+  fOut << "0 1 255 {Encoding exch /.notdef put} for" << endl;
+  for (vector<font_section>::const_iterator it = vFontSections.begin();
+       it != vFontSections.end(); ++it)
   {
-    fOut << (fiFontInfo.SquareSize*8 + fiFontInfo.LeftNotationFrameWidth);
-    fOut << " -" << (fiFontInfo.SquareSize + fiFontInfo.LeftNotationFrameDepth -
-                     fiFontInfo.RightFrameDepth);
-    fOut << " translate} def" << endl;
+    if ((it->ID >= 0) && (pbExport[it->ID] == true) && !it->Glyph.empty())
+      fOut << "Encoding " << (it->ID + 1) << " /" << it->Name << " put" << endl;
   }
-  else
+  for (i = 0; i < ciPieces; i++)
   {
-    fOut << (fiFontInfo.SquareSize*8 + fiFontInfo.LeftFrameWidth);
-    fOut << " -" << (fiFontInfo.SquareSize + fiFontInfo.LeftFrameDepth -
-                     fiFontInfo.RightFrameDepth);
-    fOut << " translate} def" << endl;
+    if ((pbPieceExport[i] == true) && !plpLayeredPieces[i].ContourGlyph.empty())
+    {
+      sPiece.assign(pcSymbolNames[14 + i], 2);
+      fOut << "Encoding " << (ciType3PieceCode + 2*i) << " /" << sPiece << "C put" << endl;
+      fOut << "Encoding " << (ciType3PieceCode + 2*i + 1) << " /" << sPiece << " put" << endl;
+    }
   }
-  fOut << endl; 
 
+  //...its glyphs...
+  fOut << "/CharProcs " << (iGlyphs + 1) << " dict def" << endl;
+  fOut << "CharProcs begin" << endl;
+  fOut << "/.notdef {0 0 setcharwidth} def" << endl;
+  for (vector<font_section>::const_iterator it = vFontSections.begin();
+       it != vFontSections.end(); ++it)
+  {
+    if ((it->ID >= 0) && (pbExport[it->ID] == true) && !it->Glyph.empty())
+      writeType3Glyph(fOut, it->Name, it->Glyph, it->Body);
+  }
+  for (i = 0; i < ciPieces; i++)
+  {
+    const layered_piece &lp = plpLayeredPieces[i];
+    if ((pbPieceExport[i] == true) && !lp.ContourGlyph.empty())
+    {
+      sPiece.assign(pcSymbolNames[14 + i], 2);
+      fOut << "/" << sPiece << "C {" << lp.ContourGlyph << endl;
+      fOut << "newpath" << endl << lp.Contour << "fill" << endl;
+      fOut << "} def" << endl;
+      fOut << "/" << sPiece << " {" << lp.PieceGlyph << endl;
+      fOut << "newpath" << endl << lp.Contour << lp.Inner << lp.FillOp << endl;
+      fOut << "} def" << endl;
+    }
+  }
+  fOut << "end" << endl;
+
+  //...and the procedures that render them
+  fOut << "/BuildGlyph {exch /CharProcs get exch" << endl;
+  fOut << "  2 copy known not {pop /.notdef} if get exec} bind def" << endl;
+  fOut << "/BuildChar {1 index /Encoding get exch get" << endl;
+  fOut << "  1 index /BuildGlyph get exec} bind def" << endl;
+  fOut << "currentdict end" << endl;
+  fOut << "/" << csType3Font << " exch definefont pop" << endl;
+  fOut << "/F2EGF /" << csType3Font << " findfont def" << endl;
+
+  // The symbols show their glyphs
+  for (vector<font_section>::const_iterator it = vFontSections.begin();
+       it != vFontSections.end(); ++it)
+  {
+    if ((it->ID >= 0) && (pbExport[it->ID] == true) && !it->Glyph.empty())
+      writeType3Procedure(fOut, it->Name, it->ID + 1);
+  }
+  for (i = 0; i < ciPieces; i++)
+  {
+    if ((pbPieceExport[i] == true) && !plpLayeredPieces[i].ContourGlyph.empty())
+    {
+      char pcCodes[16];
+      snprintf(pcCodes, sizeof(pcCodes), "\\%03o) show", ciType3PieceCode + 2*i);
+      sPiece.assign(pcSymbolNames[14 + i], 2);
+      fOut << "/F2E" << sPiece << " {F2EGF setfont newpath 0 0 moveto" << endl;
+      fOut << "gsave 1 setgray (" << pcCodes << " grestore" << endl;
+      snprintf(pcCodes, sizeof(pcCodes), "\\%03o) show", ciType3PieceCode + 2*i + 1);
+      fOut << "(" << pcCodes << "} def" << endl;
+    }
+  }
 }
 
+/** Struct for a part of a diagram that gets spliced into a pipe.
+It's either text of the export cache, or bytes that were written
+freshly into the output buffer. */
+struct splice_segment
+{
+  /** Start of the cached text, 0 for fresh bytes */
+  const char *Data;
+  /** Offset of the fresh bytes in the output buffer */
+  size_t Offset;
+  /** Number of bytes */
+  size_t Size;
+};
+
+/** Is ``true'' if the diagrams get handed to the pipe on ``stdout''
+with ``vmsplice'', straight from the export cache, ``false'' else */
+bool bSpliceOutput = false;
+/** Is ``false'' if the diagrams must not be spliced, even into a pipe */
+bool bSpliceAllowed = true;
+/** The export cache, i.e. the symbol procedures, shared subpaths,
+layered pieces and the commands behind them, as they get exported.
+It's made of whole pages, that don't change anymore after
+compileExportCache(), so the pipe may keep references to them. */
+char *pcExportCache = 0;
+/** Size of the export cache, in whole pages */
+size_t iExportCacheSize = 0;
+/** Offsets of the texts in the export cache, text \c i ends where
+text \c i+1 starts. The font sections come first, then the shared
+subpaths, the layered pieces and the commands behind them. */
+vector<size_t> vExportOffsets;
+/** The parts of the current diagram, in output order */
+vector<splice_segment> vSpliceSegments;
+/** Offset of the fresh bytes in the output buffer, that don't
+belong to a segment yet */
+size_t iSpliceFresh = 0;
 
-/** Writes the current board diagram to the file \a fOut.
-@param fOut The output file
+/** Adds the text \a iText of the export cache to the spliced
+diagram, that gets written to \a fOut. The bytes written to
+\a fOut before become a segment of their own.
 */
-void writeDiagram(std::ostream &fOut)
+void spliceCachedText(std::ostream &fOut, int iText)
 {
-  // Counters
-  int row, col;
+  splice_segment ssSegment;
+  size_t iFresh = (size_t) fOut.tellp();
+  if (iFresh > iSpliceFresh)
+  {
+    ssSegment.Data = 0;
+    ssSegment.Offset = iSpliceFresh;
+    ssSegment.Size = iFresh - iSpliceFresh;
+    vSpliceSegments.push_back(ssSegment);
+    iSpliceFresh = iFresh;
+  }
+
+  ssSegment.Data = pcExportCache + vExportOffsets[iText];
+  ssSegment.Offset = 0;
+  ssSegment.Size = vExportOffsets[iText + 1] - vExportOffsets[iText];
+  if (ssSegment.Size > 0)
+    vSpliceSegments.push_back(ssSegment);
+}
+
+/** Writes the font section \a fsSection as it gets exported, i.e.
+the EPS preamble as it is and a symbol as procedure, to \a fOut.
+@param fOut The output file
+@param fsSection The font section
+*/
+void writeExportSection(std::ostream &fOut, const font_section &fsSection)
+{
+  if (fsSection.ID < 0)
+  {
+    fOut << fsSection.Body;
+    return;
+  }
+  fOut << "/F2E" << fsSection.Name << " {" << endl;
+  fOut << fsSection.Body;
+  fOut << "} def" << endl;
+}
+
+/** Writes the procedure of the shared subpath \a iShared to \a fOut.
+@param fOut The output file
+@param iShared Number of the shared subpath
+*/
+void writeSharedSubpath(std::ostream &fOut, vector<string>::size_type iShared)
+{
+  fOut << "/F2EP" << iShared << " {" << endl << vSharedSubpaths[iShared] << endl << "} def" << endl;
+}
+
+/** Writes the procedures of the layered piece \a iPiece to \a fOut,
+with the outer contour masking the background.
+@param fOut The output file
+@param iPiece Number of the piece
+*/
+void writeLayeredPiece(std::ostream &fOut, int iPiece)
+{
+  string sPiece = string(pcSymbolNames[14 + iPiece], 2);
+  fOut << "/F2E" << sPiece << "C {" << endl;
+  fOut << plpLayeredPieces[iPiece].Contour;
+  fOut << "} def" << endl;
+  fOut << "/F2E" << sPiece << " {" << endl;
+  fOut << "gsave newpath F2E" << sPiece << "C 1 setgray fill grestore" << endl;
+  fOut << "gsave newpath F2E" << sPiece << "C" << endl;
+  fOut << plpLayeredPieces[iPiece].Inner;
+  fOut << plpLayeredPieces[iPiece].FillOp << " grestore" << endl;
+  fOut << "} def" << endl;
+}
+
+/** Writes the commands that follow the symbols, i.e. the ``space''
+and ``newline'' commands and the procedures of compact boards, to
+\a fOut.
+@param fOut The output file
+*/
+void writeExportCommands(std::ostream &fOut)
+{
+  // Square width
+  fOut << endl << "/F2ESW {" << fiFontInfo.SquareSize;
+  fOut << " 0 translate} def" << endl;
+  // Jump from left frame to first square in a row
+  fOut << "/F2EFTOS {";
+  if (bNotation == true)
+  {
+    fOut << fiFontInfo.LeftNotationFrameWidth;
+    fOut << " " << (fiFontInfo.SquareDepth - fiFontInfo.LeftNotationFrameDepth);
+  }
+  else
+  {
+    fOut << fiFontInfo.LeftFrameWidth;
+    fOut << " " << (fiFontInfo.SquareDepth - fiFontInfo.LeftFrameDepth);
+  }
+  fOut << " translate} def" << endl;
+  // Jump from last square in a row to the right frame
+  fOut << "/F2ESTOF {" << fiFontInfo.SquareSize;
+  fOut << " " << (fiFontInfo.RightFrameDepth - fiFontInfo.SquareDepth);
+  fOut << " translate} def" << endl;
+  // New line
+  fOut << "/F2ENL {-";
+  if (bNotation == true)
+  {
+    fOut << (fiFontInfo.SquareSize*8 + fiFontInfo.LeftNotationFrameWidth);
+    fOut << " -" << (fiFontInfo.SquareSize + fiFontInfo.LeftNotationFrameDepth -
+                     fiFontInfo.RightFrameDepth);
+    fOut << " translate} def" << endl;
+  }
+  else
+  {
+    fOut << (fiFontInfo.SquareSize*8 + fiFontInfo.LeftFrameWidth);
+    fOut << " -" << (fiFontInfo.SquareSize + fiFontInfo.LeftFrameDepth -
+                     fiFontInfo.RightFrameDepth);
+    fOut << " translate} def" << endl;
+  }
+  fOut << endl; 
+
+  // The board procedure of compact diagrams
+  fOut << dtDiagram.Procedure;
+}
+
+/** Exports the needed piece symbols to ``fOut''.
+@param fOut The output file
+*/
+void exportPieces(std::ostream &fOut)
+{
+  long long llStart = traceClock();
+  // Counter
+  int i;
+  // The symbols to export
+  bool pbExport[ciFontSymbols];
+  // The layered pieces to export
+  bool pbPieceExport[ciPieces];
+
+  // Layered pieces get drawn on top of the background
+  memcpy(pbExport, pbSymbolExport, sizeof(pbExport));
+  for (i = 0; i < ciPieces; i++)
+  {
+    pbPieceExport[i] = false;
+    if (plpLayeredPieces[i].Layered == false)
+      continue;
+    if (pbExport[1 + i] == true)
+    {
+      pbExport[1 + i] = false;
+      pbExport[0] = true;
+      pbPieceExport[i] = true;
+    }
+    if (pbExport[14 + i] == true)
+    {
+      pbExport[14 + i] = false;
+      pbExport[13] = true;
+      pbPieceExport[i] = true;
+    }
+  }
+
+  // Loop through all sections of the font
+  for (vector<font_section>::const_iterator it = vFontSections.begin();
+       it != vFontSections.end(); ++it)
+  {
+    // Is it the EPS preamble, or do we have to export the
+    // found symbol (as procedure)?
+    if ((it->ID < 0) || ((pbExport[it->ID] == true) && it->Glyph.empty()))
+    {
+      // Yes
+      if (bSpliceOutput == true)
+        spliceCachedText(fOut, it - vFontSections.begin());
+      else
+        writeExportSection(fOut, *it);
+    }
+  }
+
+  // Export the shared subpaths, that the exported symbols call
+  vSharedExport.assign(vSharedSubpaths.size(), false);
+  for (vector<font_section>::const_iterator it = vFontSections.begin();
+       it != vFontSections.end(); ++it)
+  {
+    if ((it->ID >= 0) && (pbExport[it->ID] == true))
+    {
+      for (vector<int>::const_iterator sh = it->Shared.begin();
+           sh != it->Shared.end(); ++sh)
+        vSharedExport[*sh] = true;
+    }
+  }
+  for (vector<string>::size_type s = 0; s < vSharedSubpaths.size(); s++)
+  {
+    if (vSharedExport[s] == false)
+      continue;
+    if (bSpliceOutput == true)
+      spliceCachedText(fOut, vFontSections.size() + s);
+    else
+      writeSharedSubpath(fOut, s);
+  }
+
+  // Export the symbols that are glyphs of the Type 3 font
+  exportType3Glyphs(fOut, pbExport, pbPieceExport);
+
+  // Export the layered pieces
+  for (i = 0; i < ciPieces; i++)
+  {
+    if ((pbPieceExport[i] == false) || !plpLayeredPieces[i].ContourGlyph.empty())
+      continue;
+    if (bSpliceOutput == true)
+      spliceCachedText(fOut, vFontSections.size() + vSharedSubpaths.size() + i);
+    else
+      writeLayeredPiece(fOut, i);
+  }
+
+#ifdef F2E_HAVE_SDT
+  // Only counted for an attached tracer
+  if (F2E_PROBE_ENABLED(glyph_export))
+  {
+    int iSymbols = 0;
+    for (i = 0; i < ciFontSymbols; i++)
+      iSymbols += (pbSymbolExport[i] == true) ? 1 : 0;
+    F2E_PROBE2(glyph_export, lineNumber, iSymbols);
+  }
+#endif
+
+  // Export ``space'' and ``newline'' commands...
+  if (bSpliceOutput == true)
+    spliceCachedText(fOut, vFontSections.size() + vSharedSubpaths.size() + ciPieces);
+  else
+    writeExportCommands(fOut);
+
+  traceSpan("glyph export", lineNumber, llStart);
+}
+
+
+/** Writes all texts that exportPieces() may export, i.e. all
+symbols, shared subpaths and layered pieces, and the commands
+behind them, to \a fOut.
+@param fOut The output file
+@param pvOffsets Receives the offset of each text in \a fOut, and
+the end of the last text (may be 0)
+*/
+void writeExportTexts(std::ostream &fOut, vector<size_t> *pvOffsets)
+{
+  for (vector<font_section>::const_iterator it = vFontSections.begin();
+       it != vFontSections.end(); ++it)
+  {
+    if (pvOffsets != 0)
+      pvOffsets->push_back((size_t) fOut.tellp());
+    writeExportSection(fOut, *it);
+  }
+  for (vector<string>::size_type s = 0; s < vSharedSubpaths.size(); s++)
+  {
+    if (pvOffsets != 0)
+      pvOffsets->push_back((size_t) fOut.tellp());
+    writeSharedSubpath(fOut, s);
+  }
+  for (int i = 0; i < ciPieces; i++)
+  {
+    if (pvOffsets != 0)
+      pvOffsets->push_back((size_t) fOut.tellp());
+    if (plpLayeredPieces[i].Layered == true)
+      writeLayeredPiece(fOut, i);
+  }
+  if (pvOffsets != 0)
+    pvOffsets->push_back((size_t) fOut.tellp());
+  writeExportCommands(fOut);
+  if (pvOffsets != 0)
+    pvOffsets->push_back((size_t) fOut.tellp());
+}
+
+/** Compiles the export cache (see pcExportCache) for the current
+font and options. The pages of the previous cache aren't unmapped,
+the pipe may still refer to them.
+*/
+void compileExportCache()
+{
+#ifdef __linux__
+  // The texts, as they get exported
+  ostringstream sCache;
+  vExportOffsets.clear();
+  writeExportTexts(sCache, &vExportOffsets);
+
+  // Copy them to pages of their own, that get read-only
+  string sTexts = sCache.str();
+  size_t iPage = sysconf(_SC_PAGESIZE);
+  iExportCacheSize = (sTexts.size() + iPage - 1) / iPage * iPage;
+  void *pCache = mmap(0, iExportCacheSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pCache == MAP_FAILED)
+  {
+    bSpliceOutput = false;
+    return;
+  }
+  pcExportCache = (char *) pCache;
+  memcpy(pcExportCache, sTexts.data(), sTexts.size());
+  mprotect(pcExportCache, iExportCacheSize, PROT_READ);
+
+  // Room for all texts, with fresh bytes in between
+  vSpliceSegments.reserve(2*vExportOffsets.size() + 2);
+#endif
+}
+
+/** Selects the frame symbols for export, depending on
+whether the board gets displayed with notation.
+*/
+void selectFrameSymbols()
+{
+  // Counter
+  int i;
+
+  for (i = 26; i < 34; i++)
+    pbSymbolExport[i] = true;
+  // Do we export with notation?
+  if (bNotation == true)
+  {
+    // Yes, so kick out the simple left and bottom frame...
+    pbSymbolExport[27] = false;
+    pbSymbolExport[29] = false;
+    //...and include the frames with notation
+    for (i = 34; i < 50; i++)
+      pbSymbolExport[i] = true;
+  }
+  else
+  {
+    // No, so set frames with notation to ``false''...
+    for (i = 34; i < 50; i++)
+      pbSymbolExport[i] = false;
+  }
+}
+
+/** Closes the currently open byte segment \a iSegment of the
+diagram template, i.e. moves the text collected in \a sSegment
+into the template and starts a new, empty segment.
+@param sSegment Stream that collects the fixed diagram text
+@param iSegment Number of the segment that gets closed
+*/
+void closeTemplateSegment(ostringstream &sSegment, int iSegment)
+{
+  dtDiagram.Segments[iSegment] = sSegment.str();
+  sSegment.str("");
+}
+
+/** Writes the fixed commands of a diagram up to its first rank,
+i.e. the scaling, the top frame and the jump to the first rank,
+to \a fOut.
+@param fOut The output file
+*/
+void writeTemplateTop(std::ostream &fOut)
+{
+  // Counter
+  int col;
 
   fOut << fiFontInfo.LineWidth << " setlinewidth" << endl;
   fOut << fiFontInfo.TranslateX;
@@ -922,7 +2094,7 @@ void writeDiagram(std::ostream &fOut)
   fOut << "F2ELFUC" << endl;
   // Jump to first top frame
   fOut << fiFontInfo.LeftFrameWidth << " 0 translate" << endl;
-  for (row = 0; row < 8; row++)
+  for (col = 0; col < 8; col++)
     fOut << "F2ETF F2ESW ";
   fOut << "F2ERFUC" << endl;
 
@@ -941,45 +2113,42 @@ void writeDiagram(std::ostream &fOut)
                      fiFontInfo.TopFrameDepth);
   }
   fOut << " translate" << endl;
+}
 
-  // Chess board
-  for (row = 0; row < 8; row++)
+/** Writes the left frame symbol of the rank \a row (0 is the top
+rank) to \a fOut.
+@param fOut The output file
+@param row The rank
+*/
+void writeLeftFrame(std::ostream &fOut, int row)
+{
+  if (bNotation == true)
   {
-    // Left frame
-    if (bNotation == true)
-    {
-      if (bReverse == true)
-        fOut << "F2ELFN" << char('A' + row);
-      else
-        fOut << "F2ELFN" << char('A' + (7-row));
-    }
+    if (bReverse == true)
+      fOut << "F2ELFN" << char('A' + row);
     else
-      fOut << "F2ELF";
-    fOut << " F2EFTOS ";
-  
-    // Board rank
-    for (col = 0; col < 7; col++)
-    {
-      fOut << "F2E" << pcSymbolNames[piCurrentBoard[row*8+col]];
-      fOut << " F2ESW ";
-    }
-    fOut << "F2E" << pcSymbolNames[piCurrentBoard[row*8+col]];
-    fOut << " F2ESTOF ";
-
-    // Right frame
-    fOut << "F2ERF";
-    if (row < 7)
-      fOut << " F2ENL" << endl;
-    else
-    {
-      // Jump to left lower corner
-      fOut << endl << "-";
-      fOut << (fiFontInfo.SquareSize*8 + fiFontInfo.LeftFrameWidth);
-      fOut << " -" << (fiFontInfo.BottomFrameHeight +
-                       fiFontInfo.RightFrameDepth);
-      fOut << " translate" << endl;
-    }
+      fOut << "F2ELFN" << char('A' + (7-row));
   }
+  else
+    fOut << "F2ELF";
+}
+
+/** Writes the fixed commands of a diagram after its last rank,
+i.e. the jump to the lower left corner and the bottom frame, to
+\a fOut.
+@param fOut The output file
+*/
+void writeTemplateBottom(std::ostream &fOut)
+{
+  // Counter
+  int col;
+
+  // Jump to left lower corner
+  fOut << "-";
+  fOut << (fiFontInfo.SquareSize*8 + fiFontInfo.LeftFrameWidth);
+  fOut << " -" << (fiFontInfo.BottomFrameHeight +
+                   fiFontInfo.RightFrameDepth);
+  fOut << " translate" << endl;
 
   // Bottom frame
   fOut << "F2ELFLC" << endl;
@@ -991,18 +2160,18 @@ void writeDiagram(std::ostream &fOut)
     fOut << "0";
   fOut << " translate" << endl;
 
-  for (row = 0; row < 8; row++)
+  for (col = 0; col < 8; col++)
   {
     if (bNotation == true)
     {
       if (bReverse == true)
-        fOut << "F2EBFN" << char('A' + (7-row));
+        fOut << "F2EBFN" << char('A' + (7-col));
       else
-        fOut << "F2EBFN" << char('A' + row);
+        fOut << "F2EBFN" << char('A' + col);
     }
     else
       fOut << "F2EBF";
-    if (row < 7)
+    if (col < 7)
       fOut << " F2ESW ";
     else
     {
@@ -1016,56 +2185,5874 @@ void writeDiagram(std::ostream &fOut)
     }
   }
   fOut << "F2ERFLC" << endl << endl;
-
 }
 
-/** Writes the EPS header to ``fOut''.
-@param fOut The output file
+/** Compiles the procedures of compact diagrams into the
+prolog text of the diagram template. A compact board is a string
+of 64 letters, ``A'' for symbol 0 up to ``Z'' for symbol 25, that
+``F2EDG'' draws rank by rank with ``forall'', looking up the
+procedure of each square symbol in the array ``F2ESY''.
 */
-void writeEpsHeader(std::ostream &fOut)
+void compileCompactProcedure()
 {
-  // Get the current time for creation date
-  time_t currentTime = time(0);
+  // Counter
+  int i;
+  // Text of the procedures
+  ostringstream fOut;
 
-  fOut << "%!PS-Adobe-2.0 EPSF-2.0" << endl;
-  fOut << "%%Title: ";
-  if (bPrefixExport == true)
-    fOut << sOutFile << endl; 
-  else
-    fOut << "none" << endl;
-  fOut << "%%Creator: fen2eps v1.0" << endl;
-  
-  fOut << "%%CreationDate: " << ctime(&currentTime) << endl;
-  
-  fOut << "%%For: " << endl;
-  fOut << "%%Orientation: Portrait" << endl;
-  fOut << "%%BoundingBox: 0 0 ";
-  fOut << fiFontInfo.BoundingBoxSizeX << " ";
-  fOut << fiFontInfo.BoundingBoxSizeY << endl;
-  fOut << "%%Pages: 0" << endl;
+  // The square symbols...
+  fOut << "/F2ESY [";
+  for (i = 0; i < 26; i++)
+  {
+    fOut << "{" << dtDiagram.Symbols[i] << "}";
+    if (i < 25)
+      fOut << ((i % 6 == 5) ? "\n" : " ");
+  }
+  fOut << "] def" << endl;
+  //...and the left frames, by rank
+  fOut << "/F2ELFS [";
+  for (i = 0; i < 8; i++)
+  {
+    fOut << "{";
+    writeLeftFrame(fOut, i);
+    fOut << "}" << ((i < 7) ? " " : "");
+  }
+  fOut << "] def" << endl;
 
-  fOut << "%%BeginSetup" << endl;
-  fOut << "%%EndSetup" << endl;
-  fOut << "%%BeginFen2epsFontInfo" << endl;
-  fOut << "%%F2E Name: " << fiFontInfo.FontName << endl;
-  fOut << "%%F2E Author: " << fiFontInfo.FontAuthor << endl;
-  fOut << "%%F2E Version: " << fiFontInfo.FontVersion << endl;
-  fOut << "%%F2E Date: " << fiFontInfo.FontDate << endl;
-  fOut << "%%EndFen2epsFontInfo" << endl;
-  /* Magnification is set to 1 */
-  fOut << "%%Magnification: 1.0000" << endl;
-  fOut << "%%EndComments" << endl << endl;
+  // The diagram, with the board string as argument
+  fOut << "/F2EDG {/F2EBD exch def" << endl;
+  writeTemplateTop(fOut);
+  fOut << "0 1 7 {/F2ER exch def F2ELFS F2ER get exec F2EFTOS" << endl;
+  fOut << "F2EBD F2ER 8 mul 8 getinterval {65 sub F2ESY exch get exec F2ESW} forall" << endl;
+  // The last square of a rank moves on to the right frame
+  fOut << "0 " << (fiFontInfo.RightFrameDepth - fiFontInfo.SquareDepth);
+  fOut << " translate F2ERF F2ER 7 lt {F2ENL} if} for" << endl;
+  writeTemplateBottom(fOut);
+  fOut << "} bind def" << endl << endl;
 
-  fOut << "save" << endl;
+  dtDiagram.Procedure = fOut.str();
 }
 
-/** Writes the EPS trailer to ``fOut''.
-@param fOut The output file
+/** Compiles the diagram template for the current font and
+options, i.e. all the frame and translation commands that
+are the same for every board. Only the 64 square symbols
+are left open as ``slots'', they get filled in by
+writeDiagram(). Compact diagrams (option ``--compact'') keep
+the commands in the procedure ``F2EDG'' of the prolog instead,
+their slots get filled with single letters.
 */
-void writeEpsTrailer(std::ostream &fOut)
+void compileDiagramTemplate()
 {
+  // Counters
+  int row, col;
+  // Text of the current segment
+  ostringstream fOut;
+
+  // Prepare the tokens for the square symbols...
+  string::size_type maxToken = 0;
+  for (row = 0; row < 26; row++)
+  {
+    dtDiagram.Symbols[row] = string("F2E") + pcSymbolNames[row];
+    // Layered pieces get drawn on top of the background
+    if ((row != 0) && (row != 13) && (plpLayeredPieces[(row - 1) % 13].Layered == true))
+    {
+      if (row < 13)
+        dtDiagram.Symbols[row] = string("F2EBS F2E") + string(pcSymbolNames[row], 2);
+      else
+        dtDiagram.Symbols[row] = string("F2EWS F2E") + string(pcSymbolNames[row], 2);
+    }
+  }
+
+  dtDiagram.Procedure.clear();
+  if (bCompact == true)
+  {
+    // The board as string, that the procedure draws
+    compileCompactProcedure();
+    for (row = 0; row < 26; row++)
+      dtDiagram.Symbols[row].assign(1, char('A' + row));
+    for (row = 0; row < 64; row++)
+      dtDiagram.Segments[row].clear();
+    dtDiagram.Segments[0] = "(";
+    dtDiagram.Segments[64] = ") F2EDG\n\n";
+  }
+  else
+  {
+    writeTemplateTop(fOut);
+
+    // Chess board
+    for (row = 0; row < 8; row++)
+    {
+      // Left frame
+      writeLeftFrame(fOut, row);
+      fOut << " F2EFTOS ";
+  
+      // Board rank, leaving a slot for each square
+      for (col = 0; col < 7; col++)
+      {
+        closeTemplateSegment(fOut, row*8+col);
+        fOut << " F2ESW ";
+      }
+      closeTemplateSegment(fOut, row*8+col);
+      fOut << " F2ESTOF ";
+
+      // Right frame
+      fOut << "F2ERF";
+      if (row < 7)
+        fOut << " F2ENL" << endl;
+      else
+      {
+        fOut << endl;
+        writeTemplateBottom(fOut);
+      }
+    }
+    closeTemplateSegment(fOut, 64);
+  }
+
+  //...and the output buffer, large enough for the longest board
+  for (row = 0; row < 26; row++)
+  {
+    if (dtDiagram.Symbols[row].size() > maxToken)
+      maxToken = dtDiagram.Symbols[row].size();
+  }
+  dtDiagram.BufferSize = 64*maxToken;
+  for (row = 0; row < 65; row++)
+    dtDiagram.BufferSize += dtDiagram.Segments[row].size();
+  delete [] dtDiagram.Buffer;
+  dtDiagram.Buffer = new char[dtDiagram.BufferSize];
+}
+
+/** Writes the current board diagram to the file \a fOut,
+by filling the slots of the precompiled diagram template
+(see compileDiagramTemplate()).
+@param fOut The output file
+*/
+void writeDiagram(std::ostream &fOut)
+{
+  long long llStart = traceClock();
+  // Write position within the buffer
+  char *pcPos = dtDiagram.Buffer;
+  // Current string to copy
+  const string *pCopy;
+  // Counter
+  int i;
+
+  for (i = 0; i < 64; i++)
+  {
+    pCopy = &dtDiagram.Segments[i];
+    memcpy(pcPos, pCopy->data(), pCopy->size());
+    pcPos += pCopy->size();
+    pCopy = &dtDiagram.Symbols[piCurrentBoard[i]];
+    memcpy(pcPos, pCopy->data(), pCopy->size());
+    pcPos += pCopy->size();
+  }
+  pCopy = &dtDiagram.Segments[64];
+  memcpy(pcPos, pCopy->data(), pCopy->size());
+  pcPos += pCopy->size();
+
+  fOut.write(dtDiagram.Buffer, pcPos - dtDiagram.Buffer);
+  F2E_PROBE2(diagram_write, lineNumber, pcPos - dtDiagram.Buffer);
+  traceSpan("diagram write", lineNumber, llStart);
+}
+
+/** Writes the infos of the current font as DSC comments to
+``fOut''.
+@param fOut The output file
+*/
+void writeFontInfoComments(std::ostream &fOut)
+{
+  fOut << "%%BeginFen2epsFontInfo" << endl;
+  fOut << "%%F2E Name: " << fiFontInfo.FontName << endl;
+  fOut << "%%F2E Author: " << fiFontInfo.FontAuthor << endl;
+  fOut << "%%F2E Version: " << fiFontInfo.FontVersion << endl;
+  fOut << "%%F2E Date: " << fiFontInfo.FontDate << endl;
+  fOut << "%%EndFen2epsFontInfo" << endl;
+}
+
+/** Writes the header of a Postscript file with the bounding
+box \a dWidth x \a dHeight to ``fOut''. For \a iPages = 0 this
+is the header of a single EPS diagram, else of a document with
+\a iPages pages, or with the number of pages in the trailer for
+ciPagesAtEnd.
+@param fOut The output file
+@param dWidth Width of the bounding box
+@param dHeight Height of the bounding box
+@param iPages Number of pages, 0 for an EPS file
+*/
+void writeEpsHeader(std::ostream &fOut, double dWidth, double dHeight,
+                    int iPages)
+{
+  // Get the current time for creation date
+  time_t currentTime = time(0);
+
+  if (iPages == 0)
+    fOut << "%!PS-Adobe-2.0 EPSF-2.0" << endl;
+  else
+    fOut << "%!PS-Adobe-2.0" << endl;
+  fOut << "%%Title: ";
+  if (bPrefixExport == true)
+    fOut << sOutFile << endl; 
+  else
+    fOut << "none" << endl;
+  fOut << "%%Creator: fen2eps v1.0" << endl;
+  
+  fOut << "%%CreationDate: " << ctime(&currentTime) << endl;
+  
+  fOut << "%%For: " << endl;
+  fOut << "%%Orientation: Portrait" << endl;
+  fOut << "%%BoundingBox: 0 0 ";
+  fOut << dWidth << " ";
+  fOut << dHeight << endl;
+  if (iPages == ciPagesAtEnd)
+    fOut << "%%Pages: (atend)" << endl;
+  else
+    fOut << "%%Pages: " << iPages << endl;
+
+  fOut << "%%BeginSetup" << endl;
+  fOut << "%%EndSetup" << endl;
+  writeFontInfoComments(fOut);
+  /* Magnification is set to 1 */
+  fOut << "%%Magnification: 1.0000" << endl;
+  if ((iPages == 0) && (sProcset.size() > 0))
+    fOut << "%%DocumentNeededResources: procset " << sProcset << " 1.0 0" << endl;
+  fOut << "%%EndComments" << endl << endl;
+
+  if (iPages == 0)
+  {
+    fOut << sEpsiPreview;
+    fOut << "save" << endl;
+  }
+}
+
+/** Writes the EPS header to ``fOut''.
+@param fOut The output file
+*/
+void writeEpsHeader(std::ostream &fOut)
+{
+  writeEpsHeader(fOut, fiFontInfo.BoundingBoxSizeX,
+                 fiFontInfo.BoundingBoxSizeY, 0);
+}
+
+/** Writes the EPS trailer to ``fOut''.
+@param fOut The output file
+*/
+void writeEpsTrailer(std::ostream &fOut)
+{
+
+  fOut << "restore" << endl << endl;
+}
+
+/** Writes the string \a s as a C++ string literal to \a fOut,
+one literal per line of text.
+@param fOut The output file
+@param s The string to be written
+*/
+void writeStringLiteral(std::ostream &fOut, const string &s)
+{
+  // Counter
+  string::size_type i;
+  // Current character
+  unsigned char c;
+  // Octal representation of special characters
+  char pcOctal[5];
+
+  fOut << "\"";
+  for (i = 0; i < s.size(); i++)
+  {
+    c = s[i];
+    if ((c == '\\') || (c == '"'))
+      fOut << '\\' << c;
+    else if (c == '\n')
+    {
+      fOut << "\\n\"";
+      if (i + 1 < s.size())
+        fOut << endl << "    \"";
+      continue;
+    }
+    else if ((c < 32) || (c > 126))
+    {
+      snprintf(pcOctal, sizeof(pcOctal), "\\%03o", c);
+      fOut << pcOctal;
+    }
+    else
+      fOut << c;
+  }
+  if ((s.size() == 0) || (s[s.size() - 1] != '\n'))
+    fOut << "\"";
+}
+
+/** Writes the current font as C++ header to ``fOut'', such
+that it can be compiled into the executable as built-in font.
+@param fOut The output file
+*/
+void writeFontHeader(std::ostream &fOut)
+{
+  fOut.precision(17);
+  fOut << "/* Built-in font for Fen2eps, generated by ``fen2eps --font-header''" << endl;
+  fOut << "*  from the font definition file " << sFontFile << "." << endl;
+  fOut << "*  Don't edit this file, your changes will get lost!" << endl;
+  fOut << "*/" << endl << endl;
+
+  fOut << "/** Metrics of the built-in font */" << endl;
+  fOut << "constexpr builtin_font_info bfiBuiltinFont =" << endl << "{" << endl;
+  fOut << "  "; writeStringLiteral(fOut, fiFontInfo.FontName); fOut << "," << endl;
+  fOut << "  "; writeStringLiteral(fOut, fiFontInfo.FontVersion); fOut << "," << endl;
+  fOut << "  "; writeStringLiteral(fOut, fiFontInfo.FontDate); fOut << "," << endl;
+  fOut << "  "; writeStringLiteral(fOut, fiFontInfo.FontAuthor); fOut << "," << endl;
+  fOut << "  " << fiFontInfo.LineWidth << "," << endl;
+  fOut << "  " << fiFontInfo.ScaleFactor << "," << endl;
+  fOut << "  " << fiFontInfo.LeftMargin << "," << endl;
+  fOut << "  " << fiFontInfo.RightMargin << "," << endl;
+  fOut << "  " << fiFontInfo.TopMargin << "," << endl;
+  fOut << "  " << fiFontInfo.BottomMargin << "," << endl;
+  fOut << "  " << fiFontInfo.BoardSize << "," << endl;
+  fOut << "  " << fiFontInfo.SquareSize << "," << endl;
+  fOut << "  " << fiFontInfo.SquareHeight << "," << endl;
+  fOut << "  " << fiFontInfo.SquareDepth << "," << endl;
+  fOut << "  " << fiFontInfo.TopFrameHeight << "," << endl;
+  fOut << "  " << fiFontInfo.TopFrameDepth << "," << endl;
+  fOut << "  " << fiFontInfo.LeftFrameWidth << "," << endl;
+  fOut << "  " << fiFontInfo.LeftFrameHeight << "," << endl;
+  fOut << "  " << fiFontInfo.LeftFrameDepth << "," << endl;
+  fOut << "  " << fiFontInfo.LeftNotationFrameWidth << "," << endl;
+  fOut << "  " << fiFontInfo.LeftNotationFrameHeight << "," << endl;
+  fOut << "  " << fiFontInfo.LeftNotationFrameDepth << "," << endl;
+  fOut << "  " << fiFontInfo.RightFrameWidth << "," << endl;
+  fOut << "  " << fiFontInfo.RightFrameHeight << "," << endl;
+  fOut << "  " << fiFontInfo.RightFrameDepth << "," << endl;
+  fOut << "  " << fiFontInfo.BottomFrameHeight << "," << endl;
+  fOut << "  " << fiFontInfo.BottomFrameDepth << "," << endl;
+  fOut << "  " << fiFontInfo.BottomNotationFrameHeight << "," << endl;
+  fOut << "  " << fiFontInfo.BottomNotationFrameDepth << endl;
+  fOut << "};" << endl << endl;
+
+  fOut << "/** Number of sections in the built-in font */" << endl;
+  fOut << "constexpr int ciBuiltinFontSections = " << vFontSections.size() << ";" << endl << endl;
+  fOut << "/** Sections of the built-in font */" << endl;
+  fOut << "constexpr builtin_font_section pbfsBuiltinFont[] =" << endl << "{" << endl;
+  for (vector<font_section>::size_type i = 0; i < vFontSections.size(); i++)
+  {
+    fOut << "  { ";
+    writeStringLiteral(fOut, vFontSections[i].Name);
+    fOut << ", " << vFontSections[i].ID << "," << endl << "    ";
+    writeStringLiteral(fOut, vFontSections[i].Body);
+    fOut << " }";
+    if (i + 1 < vFontSections.size())
+      fOut << ",";
+    fOut << endl;
+  }
+  fOut << "};" << endl;
+}
+
+#ifdef F2E_BUILTIN_FONT
+/** Sets the built-in font as current font.
+*/
+void loadBuiltinFont()
+{
+  fiFontInfo.FontName = bfiBuiltinFont.FontName;
+  fiFontInfo.FontVersion = bfiBuiltinFont.FontVersion;
+  fiFontInfo.FontDate = bfiBuiltinFont.FontDate;
+  fiFontInfo.FontAuthor = bfiBuiltinFont.FontAuthor;
+  fiFontInfo.LineWidth = bfiBuiltinFont.LineWidth;
+  fiFontInfo.ScaleFactor = bfiBuiltinFont.ScaleFactor;
+  fiFontInfo.LeftMargin = bfiBuiltinFont.LeftMargin;
+  fiFontInfo.RightMargin = bfiBuiltinFont.RightMargin;
+  fiFontInfo.TopMargin = bfiBuiltinFont.TopMargin;
+  fiFontInfo.BottomMargin = bfiBuiltinFont.BottomMargin;
+  fiFontInfo.BoardSize = bfiBuiltinFont.BoardSize;
+  fiFontInfo.SquareSize = bfiBuiltinFont.SquareSize;
+  fiFontInfo.SquareHeight = bfiBuiltinFont.SquareHeight;
+  fiFontInfo.SquareDepth = bfiBuiltinFont.SquareDepth;
+  fiFontInfo.TopFrameHeight = bfiBuiltinFont.TopFrameHeight;
+  fiFontInfo.TopFrameDepth = bfiBuiltinFont.TopFrameDepth;
+  fiFontInfo.LeftFrameWidth = bfiBuiltinFont.LeftFrameWidth;
+  fiFontInfo.LeftFrameHeight = bfiBuiltinFont.LeftFrameHeight;
+  fiFontInfo.LeftFrameDepth = bfiBuiltinFont.LeftFrameDepth;
+  fiFontInfo.LeftNotationFrameWidth = bfiBuiltinFont.LeftNotationFrameWidth;
+  fiFontInfo.LeftNotationFrameHeight = bfiBuiltinFont.LeftNotationFrameHeight;
+  fiFontInfo.LeftNotationFrameDepth = bfiBuiltinFont.LeftNotationFrameDepth;
+  fiFontInfo.RightFrameWidth = bfiBuiltinFont.RightFrameWidth;
+  fiFontInfo.RightFrameHeight = bfiBuiltinFont.RightFrameHeight;
+  fiFontInfo.RightFrameDepth = bfiBuiltinFont.RightFrameDepth;
+  fiFontInfo.BottomFrameHeight = bfiBuiltinFont.BottomFrameHeight;
+  fiFontInfo.BottomFrameDepth = bfiBuiltinFont.BottomFrameDepth;
+  fiFontInfo.BottomNotationFrameHeight = bfiBuiltinFont.BottomNotationFrameHeight;
+  fiFontInfo.BottomNotationFrameDepth = bfiBuiltinFont.BottomNotationFrameDepth;
+
+  vFontSections.resize(ciBuiltinFontSections);
+  for (int i = 0; i < ciBuiltinFontSections; i++)
+  {
+    vFontSections[i].Name = pbfsBuiltinFont[i].Name;
+    vFontSections[i].ID = pbfsBuiltinFont[i].ID;
+    vFontSections[i].Body = pbfsBuiltinFont[i].Body;
+  }
+}
+#endif
+
+/** Loads the current font, either from the font definition
+file or, if no font file was given and ``default.fed'' can't be
+found, the built-in font.
+@return ``true'' if the font could be loaded, ``false'' else
+*/
+bool readFont()
+{
+  // Try to open the file
+  std::ifstream fFont(sFontFile.c_str());
+  if (!fFont)
+  {
+#ifdef F2E_BUILTIN_FONT
+    if (bFontFileGiven == false)
+    {
+      loadBuiltinFont();
+      return true;
+    }
+#endif
+    cerr << "Error: Could not open font definition file " << sFontFile << "!" << endl;
+    return false;
+  }
+
+  // Check file header...
+  if (!checkFileHeader(fFont))
+  {
+    cerr << "Error: Wrong file header in Postscript font definition file " << sFontFile << "!" << endl;
+    return false;
+  }
+
+  // Read font infos and symbols from *.fed file...
+  if (!readFontInfos(fFont, fiFontInfo))
+  {
+    cerr << "Error: No ``FontInfo'' section found in " << sFontFile << "!" << endl;
+    return false;
+  }
+  readFontSections(fFont, vFontSections);
+  fFont.close();
+
+  return true;
+}
+
+/** Loads the current font (see readFont()), between the probes
+``font_load_start'' and ``font_load_end''.
+@return ``true'' if the font could be loaded, ``false'' else
+*/
+bool loadFont()
+{
+  F2E_PROBE1(font_load_start, sFontFile.c_str());
+  bool bOk = readFont();
+  F2E_PROBE3(font_load_end, sFontFile.c_str(), (int) bOk, vFontSections.size());
+  return bOk;
+}
+
+/*--------------------------------------------------------------- Output */
+
+/** Struct that keeps an output file that waits to be written
+by the asynchronous writer. */
+struct output_job
+{
+  /** Name of the file */
+  string Path;
+  /** Contents of the file */
+  string Data;
+  /** Number of bytes written so far */
+  string::size_type Written;
+  /** File descriptor, while the file is open */
+  int Fd;
+  /** State of the job, one of jsFree, jsOpening, jsWriting or jsClosing */
+  int State;
+  /** Number of the input line, for the trace */
+  unsigned int Line;
+  /** Time when the job was submitted, for the trace */
+  long long Start;
+};
+
+/** Job state ``Free'' */
+const int jsFree = 0;
+/** Job state ``Opening'' */
+const int jsOpening = 1;
+/** Job state ``Writing'' */
+const int jsWriting = 2;
+/** Job state ``Closing'' */
+const int jsClosing = 3;
+
+/** Maximum number of output files in flight */
+const int ciMaxOutputJobs = 64;
+/** Maximum number of queued output files for the thread pool */
+const string::size_type ciMaxQueuedJobs = 256;
+
+/** Is ``true'' if writing an output file failed, ``false'' else */
+bool bOutputError = false;
+
+/** Stream buffer that collects an output file in a string. The
+string keeps its capacity, such that the next file gets written
+into it without any allocation. */
+struct output_buffer : public std::streambuf
+{
+  /** Contents of the file */
+  string Data;
+
+protected:
+  virtual int overflow(int c)
+  {
+    if (c != EOF)
+      Data.push_back((char) c);
+    return c;
+  }
+
+  virtual streamsize xsputn(const char *pcData, streamsize iSize)
+  {
+    Data.append(pcData, iSize);
+    return iSize;
+  }
+
+  /** Only reports the write position, for ``tellp'' */
+  virtual pos_type seekoff(off_type iOffset, ios_base::seekdir sdDir,
+                           ios_base::openmode omMode)
+  {
+    if ((iOffset != 0) || (sdDir != ios_base::cur) || !(omMode & ios_base::out))
+      return pos_type(off_type(-1));
+    return pos_type(off_type(Data.size()));
+  }
+};
+
+/** Buffer for the output file that gets written next */
+output_buffer obFileBuffer;
+/** Stream that writes into obFileBuffer */
+std::ostream osFileStream(&obFileBuffer);
+
+/** Returns ``true'' if the output files are binary, i.e. raster
+images or EPS files with a TIFF preview, ``false'' else. */
+bool binaryOutput()
+{
+  return (iOutputFormat == ofPgm) || (iPreview == pvTiff);
+}
+
+#ifndef _WIN32
+/** Writes \a iSize bytes from \a pcData to the file \a iFd, a
+write that got interrupted by a signal is repeated. Used for all
+output that doesn't go through a stream.
+@param iFd The file descriptor
+@param pcData The data
+@param iSize Number of bytes
+@return ``true'' if all bytes were written, ``false'' else
+*/
+bool writeFileData(int iFd, const char *pcData, size_t iSize)
+{
+  while (iSize > 0)
+  {
+    ssize_t iResult = write(iFd, pcData, iSize);
+    if ((iResult < 0) && (errno == EINTR))
+      continue;
+    if (iResult <= 0)
+      return false;
+    pcData += iResult;
+    iSize -= iResult;
+  }
+  return true;
+}
+#endif
+
+/** Writes the file \a sPath with the contents \a sData, straight
+from the buffer (without a file stream and its allocations).
+@param sPath Name of the file
+@param sData Contents of the file
+@param bBinary ``true'' for a binary file, ``false'' for text (only Windows
+tells them apart)
+@param iLine Number of the input line, for the trace
+@return ``true'' if the file could be written, ``false'' else
+*/
+bool writeOutputFile(const string &sPath, const string &sData, bool bBinary,
+                     unsigned int iLine)
+{
+  long long llStart = traceClock();
+#ifdef _WIN32
+  FILE *pFile = fopen(sPath.c_str(), (bBinary == true) ? "wb" : "w");
+  if (pFile == 0)
+  {
+    cerr << "Error: Could not open output file " << sPath << "!" << endl;
+    return false;
+  }
+  traceSpan("file open", iLine, llStart);
+
+  llStart = traceClock();
+  bool bOk = (fwrite(sData.data(), 1, sData.size(), pFile) == sData.size());
+  bOk = (fclose(pFile) == 0) && bOk;
+#else
+  // Text and binary files are written the same way here
+  (void) bBinary;
+  int iFd = open(sPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (iFd < 0)
+  {
+    cerr << "Error: Could not open output file " << sPath << "!" << endl;
+    return false;
+  }
+  traceSpan("file open", iLine, llStart);
+
+  llStart = traceClock();
+  bool bOk = writeFileData(iFd, sData.data(), sData.size());
+  bOk = (close(iFd) == 0) && bOk;
+#endif
+  F2E_PROBE3(file_close, iLine, sData.size(), (int) bOk);
+  traceSpan("file close", iLine, llStart);
+  if (bOk == false)
+    cerr << "Error: Could not write output file " << sPath << "!" << endl;
+  return bOk;
+}
+
+/** Writes a frame of the ``framed'' output to \a fOut, i.e. the
+header line ``<line> <status> <length>'' followed by exactly
+<length> bytes of data, such that a pipeline can split the stream
+without looking into the diagrams.
+@param fOut The output stream
+@param iLine Number of the input line
+@param pcStatus Status of the line, ``ok'' for a diagram, ``error''
+for an invalid FEN string
+@param pcData The data of the frame
+@param iSize Number of bytes of data
+*/
+void writeFrame(std::ostream &fOut, unsigned int iLine, const char *pcStatus,
+                const char *pcData, string::size_type iSize)
+{
+  long long llStart = traceClock();
+  char pcHeader[64];
+  int iHeader = snprintf(pcHeader, sizeof(pcHeader), "%u %s %lu\n",
+                         iLine, pcStatus, (unsigned long) iSize);
+  fOut.write(pcHeader, iHeader);
+  fOut.write(pcData, iSize);
+  traceSpan("frame write", iLine, llStart);
+}
+
+#ifdef __linux__
+/** Number of cached segments that get spliced with one call */
+const int ciSpliceVectors = 64;
+
+/** Writes the current diagram, that was written to obFileBuffer in
+splice mode, to the pipe on ``stdout''. The fresh bytes get copied
+into the pipe, the texts of the export cache get spliced by
+reference. For the ``framed'' output, the diagram gets the
+header of input line \a iLine (see writeFrame()).
+@param bFrame ``true'' for a frame, ``false'' else
+@param iLine Number of the input line
+@return ``false'' if the diagram couldn't be written, ``true'' else
+*/
+bool writeSplicedDiagram(bool bFrame, unsigned int iLine)
+{
+  long long llStart = traceClock();
+  splice_segment ssSegment;
+  struct iovec pioVectors[ciSpliceVectors];
+
+  // The bytes behind the last cached text
+  if (obFileBuffer.Data.size() > iSpliceFresh)
+  {
+    ssSegment.Data = 0;
+    ssSegment.Offset = iSpliceFresh;
+    ssSegment.Size = obFileBuffer.Data.size() - iSpliceFresh;
+    vSpliceSegments.push_back(ssSegment);
+  }
+
+  // Anything written through ``cout'' goes first
+  cout.flush();
+  bool bOk = true;
+  if (bFrame == true)
+  {
+    size_t iSize = 0;
+    for (vector<splice_segment>::size_type i = 0; i < vSpliceSegments.size(); i++)
+      iSize += vSpliceSegments[i].Size;
+    char pcHeader[64];
+    int iHeader = snprintf(pcHeader, sizeof(pcHeader), "%u ok %lu\n",
+                           iLine, (unsigned long) iSize);
+    bOk = writeFileData(1, pcHeader, iHeader);
+  }
+
+  vector<splice_segment>::size_type i = 0;
+  while (bOk && (i < vSpliceSegments.size()))
+  {
+    if (vSpliceSegments[i].Data == 0)
+    {
+      // Copy the fresh bytes
+      bOk = writeFileData(1, obFileBuffer.Data.data() + vSpliceSegments[i].Offset,
+                          vSpliceSegments[i].Size);
+      i++;
+      continue;
+    }
+
+    // Splice the following cached texts with one call
+    int iVectors = 0;
+    while ((i < vSpliceSegments.size()) && (vSpliceSegments[i].Data != 0) &&
+           (iVectors < ciSpliceVectors))
+    {
+      pioVectors[iVectors].iov_base = (void *) vSpliceSegments[i].Data;
+      pioVectors[iVectors].iov_len = vSpliceSegments[i].Size;
+      iVectors++;
+      i++;
+    }
+    struct iovec *pioNext = pioVectors;
+    while (bOk && (iVectors > 0))
+    {
+      long long iResult = -1;
+      if (bSpliceOutput == true)
+      {
+        iResult = vmsplice(1, pioNext, iVectors, 0);
+        if ((iResult < 0) && (errno == EINTR))
+          continue;
+      }
+      if (iResult < 0)
+      {
+        // Copy the texts, if the pipe doesn't take them
+        bSpliceOutput = false;
+        for (; iVectors > 0; iVectors--, pioNext++)
+          bOk = bOk && writeFileData(1, (const char *) pioNext->iov_base, pioNext->iov_len);
+        break;
+      }
+      // Skip the spliced bytes
+      while ((iVectors > 0) && ((size_t) iResult >= pioNext->iov_len))
+      {
+        iResult -= pioNext->iov_len;
+        pioNext++;
+        iVectors--;
+      }
+      if (iVectors > 0)
+      {
+        pioNext->iov_base = (char *) pioNext->iov_base + iResult;
+        pioNext->iov_len -= iResult;
+      }
+    }
+  }
+
+  vSpliceSegments.clear();
+  iSpliceFresh = 0;
+  traceSpan("diagram splice", iLine, llStart);
+  if (bOk == false)
+    cerr << "Error: Could not write to `stdout'!" << endl;
+  return bOk;
+}
+#endif
+
+/** Marks the directories that have been created for the
+``fanout'' layout, by the first byte of the hash... */
+bool pbCreatedDirs[256];
+/** ...and by its first two bytes, for the subdirectories */
+bool pbCreatedSubDirs[65536];
+
+/** Creates the directory \a sDir, if it hasn't been created
+before.
+@param sDir Name of the directory
+@param bCreated Marks the directory as created
+*/
+void ensureDirectory(const string &sDir, bool &bCreated)
+{
+  if (bCreated == true)
+    return;
+  bCreated = true;
+#ifdef _WIN32
+  _mkdir(sDir.c_str());
+#else
+  mkdir(sDir.c_str(), 0777);
+#endif
+}
+
+/** Sets the name of the next output file with the extension
+\a sExtension (and the number \c fileNumber) in \c sOutFile.
+In ``fanout'' mode the file gets put into a two-level tree of
+subdirectories, given by a hash of its number, e.g.
+``diag/00/17/dg1234.eps'' for the prefix ``diag/dg''. The
+subdirectories are created as needed.
+@param sExtension Extension of the file name
+*/
+void makeOutFileName(const char *sExtension)
+{
+  // The strings get assigned in place, with room for the
+  // longest possible name, so they don't have to grow later on
+  char pcNumber[16];
+  snprintf(pcNumber, sizeof(pcNumber), "%u", fileNumber);
+  sFileNumber.assign(pcNumber);
+  sOutFile.reserve(sPrefix.size() + 32);
+
+  if (bFanout == false)
+  {
+    sOutFile.assign(sPrefix).append(pcNumber).append(sExtension);
+    return;
+  }
+
+  // Split the prefix into directory and file name
+  string::size_type iDirLength = sPrefix.find_last_of("/\\");
+  if (iDirLength == string::npos)
+    iDirLength = 0;
+  else
+    iDirLength++;
+
+  // Hash of the file number, for an even spreading
+  unsigned int iHash = fileNumber * 2654435761u;
+  char pcSubDirs[8];
+  snprintf(pcSubDirs, sizeof(pcSubDirs), "%02x/%02x/",
+           (iHash >> 24) & 0xff, (iHash >> 16) & 0xff);
+
+  sOutFile.assign(sPrefix, 0, iDirLength).append(pcSubDirs, 2);
+  ensureDirectory(sOutFile, pbCreatedDirs[iHash >> 24]);
+  sOutFile.append(pcSubDirs + 2, 3);
+  ensureDirectory(sOutFile, pbCreatedSubDirs[iHash >> 16]);
+  sOutFile.append("/").append(sPrefix, iDirLength, string::npos);
+  sOutFile.append(pcNumber).append(sExtension);
+}
+
+#ifdef F2E_HAVE_IO_URING
+/** Struct that keeps the state of the io_uring instance. */
+struct uring_state
+{
+  /** File descriptor of the ring, -1 if there is none */
+  int Fd;
+  /** Submission queue */
+  unsigned *SqHead;
+  unsigned *SqTail;
+  unsigned SqMask;
+  unsigned SqEntries;
+  unsigned *SqArray;
+  struct io_uring_sqe *Sqes;
+  /** Completion queue */
+  unsigned *CqHead;
+  unsigned *CqTail;
+  unsigned CqMask;
+  struct io_uring_cqe *Cqes;
+  /** Mapped memory of the rings */
+  void *SqRing;
+  size_t SqRingSize;
+  void *CqRing;
+  size_t CqRingSize;
+  size_t SqesSize;
+  /** Number of queue entries, not submitted yet */
+  unsigned ToSubmit;
+} usRing = { -1 };
+
+/** The output files in flight */
+output_job pojUringJobs[ciMaxOutputJobs];
+/** Number of output files in flight */
+int iUringJobs = 0;
+/** Job to try first for the next output file. The jobs get used
+round robin, such that all of their buffers are in use (and have
+grown) after the first few files. */
+int iUringNextJob = 0;
+
+/** Sets up the io_uring instance and checks that the needed
+operations are supported.
+@return ``true'' if io_uring can be used, ``false'' else
+*/
+bool setupUring()
+{
+  struct io_uring_params iupParams;
+  memset(&iupParams, 0, sizeof(iupParams));
+
+  int fd = (int) syscall(__NR_io_uring_setup, 2*ciMaxOutputJobs, &iupParams);
+  if (fd < 0)
+    return false;
+
+  // Are opening, writing and closing files supported?
+  size_t probeSize = sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op);
+  vector<char> vProbe(probeSize, 0);
+  struct io_uring_probe *iupProbe = (struct io_uring_probe *) &vProbe[0];
+  if ((syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, iupProbe, 256) < 0) ||
+      (iupProbe->last_op < IORING_OP_CLOSE) ||
+      !(iupProbe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) ||
+      !(iupProbe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) ||
+      !(iupProbe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED))
+  {
+    close(fd);
+    return false;
+  }
+
+  usRing.SqRingSize = iupParams.sq_off.array + iupParams.sq_entries*sizeof(unsigned);
+  usRing.CqRingSize = iupParams.cq_off.cqes + iupParams.cq_entries*sizeof(struct io_uring_cqe);
+  if (iupParams.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (usRing.CqRingSize > usRing.SqRingSize)
+      usRing.SqRingSize = usRing.CqRingSize;
+    usRing.CqRingSize = usRing.SqRingSize;
+  }
+  usRing.SqRing = mmap(0, usRing.SqRingSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (usRing.SqRing == MAP_FAILED)
+  {
+    close(fd);
+    return false;
+  }
+  if (iupParams.features & IORING_FEAT_SINGLE_MMAP)
+    usRing.CqRing = usRing.SqRing;
+  else
+  {
+    usRing.CqRing = mmap(0, usRing.CqRingSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (usRing.CqRing == MAP_FAILED)
+    {
+      munmap(usRing.SqRing, usRing.SqRingSize);
+      close(fd);
+      return false;
+    }
+  }
+  usRing.SqesSize = iupParams.sq_entries*sizeof(struct io_uring_sqe);
+  usRing.Sqes = (struct io_uring_sqe *) mmap(0, usRing.SqesSize, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (usRing.Sqes == MAP_FAILED)
+  {
+    if (usRing.CqRing != usRing.SqRing)
+      munmap(usRing.CqRing, usRing.CqRingSize);
+    munmap(usRing.SqRing, usRing.SqRingSize);
+    close(fd);
+    return false;
+  }
+
+  char *pcSq = (char *) usRing.SqRing;
+  usRing.SqHead = (unsigned *) (pcSq + iupParams.sq_off.head);
+  usRing.SqTail = (unsigned *) (pcSq + iupParams.sq_off.tail);
+  usRing.SqMask = *(unsigned *) (pcSq + iupParams.sq_off.ring_mask);
+  usRing.SqEntries = *(unsigned *) (pcSq + iupParams.sq_off.ring_entries);
+  usRing.SqArray = (unsigned *) (pcSq + iupParams.sq_off.array);
+  char *pcCq = (char *) usRing.CqRing;
+  usRing.CqHead = (unsigned *) (pcCq + iupParams.cq_off.head);
+  usRing.CqTail = (unsigned *) (pcCq + iupParams.cq_off.tail);
+  usRing.CqMask = *(unsigned *) (pcCq + iupParams.cq_off.ring_mask);
+  usRing.Cqes = (struct io_uring_cqe *) (pcCq + iupParams.cq_off.cqes);
+  usRing.ToSubmit = 0;
+  usRing.Fd = fd;
+
+  for (int i = 0; i < ciMaxOutputJobs; i++)
+    pojUringJobs[i].State = jsFree;
+
+  return true;
+}
+
+/** Submits the queued entries to the kernel and waits for at
+least \a iWait completions.
+*/
+void enterUring(unsigned iWait)
+{
+  int ret = (int) syscall(__NR_io_uring_enter, usRing.Fd, usRing.ToSubmit, iWait,
+                          iWait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if (ret > 0)
+    usRing.ToSubmit -= ret;
+}
+
+/** Returns the next free submission queue entry, submitting
+the queued ones first if the queue is full.
+*/
+struct io_uring_sqe *nextUringEntry()
+{
+  unsigned tail = *usRing.SqTail;
+  while (tail - __atomic_load_n(usRing.SqHead, __ATOMIC_ACQUIRE) >= usRing.SqEntries)
+    enterUring(0);
+
+  struct io_uring_sqe *sqe = &usRing.Sqes[tail & usRing.SqMask];
+  memset(sqe, 0, sizeof(*sqe));
+  usRing.SqArray[tail & usRing.SqMask] = tail & usRing.SqMask;
+  return sqe;
+}
+
+/** Makes the submission queue entry, returned by nextUringEntry(),
+visible to the kernel. */
+void queueUringEntry()
+{
+  __atomic_store_n(usRing.SqTail, *usRing.SqTail + 1, __ATOMIC_RELEASE);
+  usRing.ToSubmit++;
+}
+
+/** Queues the next operation (write or close) for the job
+\a iJob, that is in the state ``Writing''.
+*/
+void queueUringWrite(int iJob)
+{
+  output_job &oj = pojUringJobs[iJob];
+  struct io_uring_sqe *sqe = nextUringEntry();
+
+  if (oj.Written < oj.Data.size())
+  {
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = oj.Fd;
+    sqe->addr = (unsigned long) (oj.Data.data() + oj.Written);
+    sqe->len = oj.Data.size() - oj.Written;
+    sqe->off = oj.Written;
+  }
+  else
+  {
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = oj.Fd;
+    oj.State = jsClosing;
+  }
+  sqe->user_data = iJob;
+  queueUringEntry();
+}
+
+/** Processes all available completions of the io_uring instance.
+*/
+void reapUring()
+{
+  unsigned head = *usRing.CqHead;
+  unsigned tail = __atomic_load_n(usRing.CqTail, __ATOMIC_ACQUIRE);
+
+  while (head != tail)
+  {
+    struct io_uring_cqe *cqe = &usRing.Cqes[head & usRing.CqMask];
+    int iJob = (int) cqe->user_data;
+    int res = cqe->res;
+    head++;
+
+    output_job &oj = pojUringJobs[iJob];
+    switch (oj.State)
+    {
+      case jsOpening:
+        if (res < 0)
+        {
+          cerr << "Error: Could not open output file " << oj.Path << "!" << endl;
+          bOutputError = true;
+          oj.State = jsFree;
+          iUringJobs--;
+          break;
+        }
+        oj.Fd = res;
+        oj.State = jsWriting;
+        queueUringWrite(iJob);
+        break;
+      case jsWriting:
+        // An interrupted write gets queued again, like in writeFileData()
+        if (res == -EINTR)
+        {
+          queueUringWrite(iJob);
+          break;
+        }
+        if (res <= 0)
+        {
+          cerr << "Error: Could not write output file " << oj.Path << "!" << endl;
+          bOutputError = true;
+          oj.Written = oj.Data.size();
+        }
+        else
+          oj.Written += res;
+        queueUringWrite(iJob);
+        break;
+      case jsClosing:
+        // Delayed write errors (e.g. on NFS) show up when closing
+        if (res < 0)
+        {
+          cerr << "Error: Could not write output file " << oj.Path << "!" << endl;
+          bOutputError = true;
+        }
+        F2E_PROBE3(file_close, oj.Line, oj.Data.size(), (int) (res == 0));
+        traceSpan("file write", oj.Line, oj.Start);
+        oj.State = jsFree;
+        oj.Data.clear();
+        iUringJobs--;
+        break;
+    }
+  }
+
+  __atomic_store_n(usRing.CqHead, head, __ATOMIC_RELEASE);
+}
+
+/** Hands the file \a sPath with the contents \a sData over to
+the io_uring instance. Both strings get swapped into the job.
+*/
+void submitUringFile(string &sPath, string &sData)
+{
+  // Wait for a free job
+  if (iUringJobs == ciMaxOutputJobs)
+  {
+    long long llStart = traceClock();
+    while (iUringJobs == ciMaxOutputJobs)
+    {
+      enterUring(1);
+      reapUring();
+    }
+    traceSpan("queue wait", lineNumber, llStart);
+  }
+  int iJob = iUringNextJob;
+  while (pojUringJobs[iJob].State != jsFree)
+    iJob = (iJob + 1) % ciMaxOutputJobs;
+  iUringNextJob = (iJob + 1) % ciMaxOutputJobs;
+
+  output_job &oj = pojUringJobs[iJob];
+  oj.Path.swap(sPath);
+  oj.Data.swap(sData);
+  oj.Written = 0;
+  oj.State = jsOpening;
+  oj.Line = lineNumber;
+  oj.Start = traceClock();
+  iUringJobs++;
+
+  struct io_uring_sqe *sqe = nextUringEntry();
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (unsigned long) oj.Path.c_str();
+  sqe->len = 0666;
+  sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+  sqe->user_data = iJob;
+  queueUringEntry();
+
+  // Submit in batches
+  if (usRing.ToSubmit >= 16)
+  {
+    enterUring(0);
+    reapUring();
+  }
+}
+
+/** Waits until all files are written and closes the io_uring
+instance. */
+void finishUring()
+{
+  while (iUringJobs > 0)
+  {
+    enterUring(1);
+    reapUring();
+  }
+
+  munmap(usRing.Sqes, usRing.SqesSize);
+  if (usRing.CqRing != usRing.SqRing)
+    munmap(usRing.CqRing, usRing.CqRingSize);
+  munmap(usRing.SqRing, usRing.SqRingSize);
+  close(usRing.Fd);
+  usRing.Fd = -1;
+}
+#endif
+
+/** Struct that keeps the state of the writer thread pool,
+the fallback for systems without io_uring. */
+struct writer_pool
+{
+  /** Protects all members */
+  mutex Lock;
+  /** Signals new jobs or the end of the output */
+  condition_variable Filled;
+  /** Signals free space in the queue */
+  condition_variable Drained;
+  /** The queued output files, a ring buffer that starts at
+  First. Its strings get swapped with those of the submitted and
+  written files, so they keep their capacity. */
+  output_job Jobs[ciMaxQueuedJobs];
+  /** Index of the first queued file */
+  string::size_type First;
+  /** Number of queued files */
+  string::size_type Count;
+  /** The writer threads */
+  vector<thread> Threads;
+  /** Is ``true'' when all files have been queued */
+  bool Done;
+} wpWriterPool;
+
+/** Main routine of a writer thread, writes queued files until
+the output is finished.
+*/
+void writerThread()
+{
+  output_job oj;
+
+  while (true)
+  {
+    {
+      unique_lock<mutex> lock(wpWriterPool.Lock);
+      while ((wpWriterPool.Count == 0) && !wpWriterPool.Done)
+        wpWriterPool.Filled.wait(lock);
+      if (wpWriterPool.Count == 0)
+        return;
+      output_job &ojFirst = wpWriterPool.Jobs[wpWriterPool.First];
+      oj.Path.swap(ojFirst.Path);
+      oj.Data.swap(ojFirst.Data);
+      oj.Line = ojFirst.Line;
+      wpWriterPool.First = (wpWriterPool.First + 1) % ciMaxQueuedJobs;
+      wpWriterPool.Count--;
+    }
+    wpWriterPool.Drained.notify_one();
+
+    if (writeOutputFile(oj.Path, oj.Data, binaryOutput(), oj.Line) == false)
+    {
+      unique_lock<mutex> lock(wpWriterPool.Lock);
+      bOutputError = true;
+    }
+  }
+}
+
+/** Starts the asynchronous output, via io_uring if available,
+else with a pool of writer threads.
+*/
+void startAsyncOutput()
+{
+#ifdef F2E_HAVE_IO_URING
+  if (setupUring() == true)
+    return;
+#endif
+  unsigned int iThreads = thread::hardware_concurrency();
+  if (iThreads < 4)
+    iThreads = 4;
+  wpWriterPool.Done = false;
+  wpWriterPool.First = 0;
+  wpWriterPool.Count = 0;
+  for (unsigned int i = 0; i < iThreads; i++)
+    wpWriterPool.Threads.push_back(thread(writerThread));
+}
+
+/** Hands the output file \a sPath with the contents \a sData
+over to the asynchronous writer. Both strings get swapped with
+those of an already written job, so they come back with their
+capacity for the next file, but with undefined contents.
+@return ``false'' if writing a previous file failed, ``true'' else
+*/
+bool submitOutputFile(string &sPath, string &sData)
+{
+#ifdef F2E_HAVE_IO_URING
+  if (usRing.Fd >= 0)
+  {
+    submitUringFile(sPath, sData);
+    return !bOutputError;
+  }
+#endif
+  {
+    unique_lock<mutex> lock(wpWriterPool.Lock);
+    if (wpWriterPool.Count >= ciMaxQueuedJobs)
+    {
+      long long llStart = traceClock();
+      while (wpWriterPool.Count >= ciMaxQueuedJobs)
+        wpWriterPool.Drained.wait(lock);
+      traceSpan("queue wait", lineNumber, llStart);
+    }
+    output_job &ojLast = wpWriterPool.Jobs[(wpWriterPool.First + wpWriterPool.Count) %
+                                           ciMaxQueuedJobs];
+    ojLast.Path.swap(sPath);
+    ojLast.Data.swap(sData);
+    ojLast.Line = lineNumber;
+    wpWriterPool.Count++;
+  }
+  wpWriterPool.Filled.notify_one();
+
+  return !bOutputError;
+}
+
+/** Waits until the asynchronous writer has written all files.
+@return ``false'' if writing a file failed, ``true'' else
+*/
+bool finishAsyncOutput()
+{
+#ifdef F2E_HAVE_IO_URING
+  if (usRing.Fd >= 0)
+  {
+    finishUring();
+    return !bOutputError;
+  }
+#endif
+  {
+    unique_lock<mutex> lock(wpWriterPool.Lock);
+    wpWriterPool.Done = true;
+  }
+  wpWriterPool.Filled.notify_all();
+  for (vector<thread>::iterator it = wpWriterPool.Threads.begin();
+       it != wpWriterPool.Threads.end(); ++it)
+    it->join();
+  wpWriterPool.Threads.clear();
+
+  return !bOutputError;
+}
+
+/*---------------------------------------------------------------- Dedup */
+
+/** Struct that keeps a position of the dedup table, i.e. a board
+that got rendered already. */
+struct dedup_entry
+{
+  /** Zobrist key of the board, 0 for an empty entry */
+  unsigned long long Key;
+  /** The board, one square symbol per square */
+  unsigned char Board[64];
+  /** Number of the file that shows the board (``-p'') */
+  unsigned int FileNumber;
+  /** Number of the diagram that used the entry last, 0 for an
+  empty entry */
+  unsigned long long Used;
+  /** Size of the rendered diagram in its slot of the slab
+  (``stdout'') */
+  string::size_type Size;
+};
+
+/** Default number of entries of the dedup table, for the files
+of ``-p'' */
+const unsigned int ciDedupFileEntries = 1 << 16;
+/** Memory for the diagrams of the default dedup table on
+``stdout'', that limits the number of its entries */
+const string::size_type ciDedupStdoutBytes = 32 << 20;
+/** Number of entries in a bucket of the dedup table */
+const unsigned int ciDedupWays = 4;
+
+/** Is ``true'' if repeated positions don't get rendered again,
+``false'' else */
+bool bDedup = false;
+/** Number of entries of the dedup table, 0 for the default */
+unsigned int iDedupTableSize = 0;
+/** The dedup table, a board replaces the least recently used one
+in the bucket of its index */
+vector<dedup_entry> vDedupTable;
+/** Number of entries in a bucket, ciDedupWays for all but the
+smallest tables */
+unsigned int iDedupWays = ciDedupWays;
+/** Random keys for each square symbol on each square */
+unsigned long long pllZobrist[64][26];
+/** The slab with the diagrams of the dedup table on ``stdout'',
+one slot for each entry. It's allocated once, pages that never get
+a diagram don't take memory. */
+char *pcDedupSlab = 0;
+/** Size of a slot of the slab */
+string::size_type iDedupSlot = 0;
+/** Key of the options, that gets mixed into each board */
+unsigned long long llDedupOptions = 0;
+/** Key of the current board */
+unsigned long long llDedupKey = 0;
+/** Entry of the current board */
+dedup_entry *pdeDedupEntry = 0;
+/** Name of the file that gets linked to */
+string sDedupTarget;
+/** Number of diagrams so far */
+unsigned long long llDedupDiagrams = 0;
+/** Number of diagrams that repeated a previous position */
+unsigned long long llDedupRepeated = 0;
+
+/** Returns the next number of the ``splitmix64'' sequence
+with the state \a llState.
+@param llState State of the sequence
+@return The next random number
+*/
+unsigned long long splitMix64(unsigned long long &llState)
+{
+  unsigned long long z = (llState += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/** Sets up the dedup table and the Zobrist keys, with the
+key of the options.
+@param iSlotSize Maximum size of a diagram, see maxDiagramFileSize()
+*/
+void setupDedup(string::size_type iSlotSize)
+{
+  unsigned int iEntries = iDedupTableSize;
+  if (iEntries == 0)
+    iEntries = ciDedupFileEntries;
+  // Round up to a power of two
+  unsigned int iSize = 1;
+  while ((iSize < iEntries) && (iSize < (1u << 30)))
+    iSize <<= 1;
+  // On ``stdout'', the diagrams of all entries have to fit into
+  // the slab. The default table gets as many entries as fit into
+  // ciDedupStdoutBytes, a size given with ``--dedup-table'' only
+  // shrinks if its slab can't be allocated.
+  if (bPrefixExport == false)
+  {
+    if (iDedupTableSize == 0)
+    {
+      while ((iSize > 1) && (iSize * iSlotSize > ciDedupStdoutBytes))
+        iSize >>= 1;
+    }
+    iDedupSlot = iSlotSize;
+    while ((pcDedupSlab = new (nothrow) char[iSize * iDedupSlot]) == 0)
+      iSize >>= 1;
+    if ((iDedupTableSize > 0) && (iSize < iEntries))
+    {
+      cerr << "Warning: The dedup table on `stdout' keeps only " << iSize;
+      cerr << " diagrams, that fit into memory!" << endl;
+    }
+  }
+  iDedupWays = (iSize < ciDedupWays) ? iSize : ciDedupWays;
+  vDedupTable.resize(iSize);
+  for (unsigned int i = 0; i < iSize; i++)
+  {
+    vDedupTable[i].Key = 0;
+    vDedupTable[i].Used = 0;
+  }
+  sDedupTarget.reserve(sPrefix.size() + 32);
+
+  unsigned long long llState = 0x46454e32455053ULL;
+  for (int i = 0; i < 64; i++)
+    for (int j = 0; j < 26; j++)
+      pllZobrist[i][j] = splitMix64(llState);
+
+  // The same board looks different with other options
+  llState = (bNotation ? 1 : 0) | (bReverse ? 2 : 0) | (iOutputFormat << 2) | (iPreview << 4);
+  for (string::size_type i = 0; i < fiFontInfo.FontName.size(); i++)
+    llState = llState*131 + (unsigned char) fiFontInfo.FontName[i];
+  llDedupOptions = splitMix64(llState);
+}
+
+/** Looks up the current board in the dedup table, and sets
+pdeDedupEntry to its entry.
+@return ``true'' if the board got rendered before, ``false'' else
+*/
+bool findDuplicate()
+{
+  unsigned long long llKey = llDedupOptions;
+  for (int i = 0; i < 64; i++)
+    llKey ^= pllZobrist[i][piCurrentBoard[i]];
+  if (llKey == 0)
+    llKey = 1;
+
+  llDedupDiagrams++;
+  llDedupKey = llKey;
+  // Search the bucket, and keep its least recently used entry for
+  // a new board
+  unsigned long long llBuckets = vDedupTable.size() / iDedupWays;
+  dedup_entry *pdeBucket = &vDedupTable[(llKey & (llBuckets - 1)) * iDedupWays];
+  pdeDedupEntry = pdeBucket;
+  for (unsigned int w = 0; w < iDedupWays; w++)
+  {
+    dedup_entry *pdeEntry = pdeBucket + w;
+    if (pdeEntry->Key == llKey)
+    {
+      int i = 0;
+      while ((i < 64) && (pdeEntry->Board[i] == piCurrentBoard[i]))
+        i++;
+      if (i == 64)
+      {
+        pdeEntry->Used = llDedupDiagrams;
+        pdeDedupEntry = pdeEntry;
+        return true;
+      }
+    }
+    if (pdeEntry->Used < pdeDedupEntry->Used)
+      pdeDedupEntry = pdeEntry;
+  }
+  return false;
+}
+
+/** Returns the slot of the current entry in the slab.
+*/
+char *dedupSlot()
+{
+  return pcDedupSlab + (pdeDedupEntry - vDedupTable.data()) * iDedupSlot;
+}
+
+/** Stores the current board in the entry of the dedup table that
+findDuplicate() chose, replacing the board that was there.
+@param pData The rendered diagram, 0 for a file of ``-p''
+*/
+void rememberDiagram(const string *pData)
+{
+  pdeDedupEntry->Key = llDedupKey;
+  pdeDedupEntry->Used = llDedupDiagrams;
+  for (int i = 0; i < 64; i++)
+    pdeDedupEntry->Board[i] = (unsigned char) piCurrentBoard[i];
+  pdeDedupEntry->FileNumber = fileNumber;
+  if (pData != 0)
+  {
+    // A diagram that doesn't fit into its slot can't be kept
+    if (pData->size() > iDedupSlot)
+    {
+      pdeDedupEntry->Key = 0;
+      pdeDedupEntry->Used = 0;
+      return;
+    }
+    memcpy(dedupSlot(), pData->data(), pData->size());
+    pdeDedupEntry->Size = pData->size();
+  }
+}
+
+/** Creates the file ``sOutFile'' as hardlink, or else as reflink,
+to the first file of the repeated position in pdeDedupEntry.
+@param sExtension Extension of the files
+@return ``true'' if the file could be linked, ``false'' else
+*/
+bool linkDuplicate(const char *sExtension)
+{
+#ifdef _WIN32
+  return false;
+#else
+  long long llStart = traceClock();
+  unsigned int iFileNumber = fileNumber;
+  fileNumber = pdeDedupEntry->FileNumber;
+  makeOutFileName(sExtension);
+  sDedupTarget.assign(sOutFile);
+  fileNumber = iFileNumber;
+  makeOutFileName(sExtension);
+
+  unlink(sOutFile.c_str());
+  bool bOk = (link(sDedupTarget.c_str(), sOutFile.c_str()) == 0);
+#ifdef FICLONE
+  if (bOk == false)
+  {
+    // Without hardlinks, the file system may share the data at least
+    int iSource = open(sDedupTarget.c_str(), O_RDONLY);
+    if (iSource >= 0)
+    {
+      int iFd = open(sOutFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (iFd >= 0)
+      {
+        bOk = (ioctl(iFd, FICLONE, iSource) == 0);
+        close(iFd);
+        if (bOk == false)
+          unlink(sOutFile.c_str());
+      }
+      close(iSource);
+    }
+  }
+#endif
+  traceSpan("dedup link", lineNumber, llStart);
+  return bOk;
+#endif
+}
+
+/** Links the file ``sOutFile'' of the current board to the first
+file of the same position, if there is one.
+@param sExtension Extension of the files
+@return ``true'' if the file got linked, ``false'' if it has to be
+written (also if the background writer hasn't written the first
+file yet)
+*/
+bool linkOutputFile(const char *sExtension)
+{
+  if (findDuplicate() == true)
+  {
+    if (linkDuplicate(sExtension) == true)
+    {
+      llDedupRepeated++;
+      return true;
+    }
+  }
+  else
+    rememberDiagram(0);
+
+#ifndef _WIN32
+  // Don't write through a link of a previous run
+  unlink(sOutFile.c_str());
+#endif
+  return false;
+}
+
+/** Reports the number of repeated positions to ``stderr''.
+*/
+void reportDedup()
+{
+  cerr << "Dedup: " << llDedupRepeated << " of " << llDedupDiagrams;
+  cerr << " diagrams were repeated positions";
+  if (llDedupDiagrams > 0)
+  {
+    char pcRatio[16];
+    snprintf(pcRatio, sizeof(pcRatio), "%.1f", 100.0 * llDedupRepeated / llDedupDiagrams);
+    cerr << " (" << pcRatio << "%)";
+  }
+  cerr << "." << endl;
+}
+
+/*---------------------------------------------------------------- Store */
+
+/** Number of index entries that get collected, before they're
+written to the temporary index file */
+const int ciStoreIndexEntries = 4096;
+
+/** Name of the store that all diagrams get appended to (option
+``--store''), empty for none */
+string sStoreFile = "";
+/** Name of the store to extract a diagram from (option
+``--extract''), empty for none */
+string sExtractStore = "";
+/** Number of the input line, whose diagram gets extracted */
+unsigned long long llExtractLine = 0;
+
+#ifndef _WIN32
+/** File descriptor of the store, -1 if it isn't open (anymore) */
+int iStoreFd = -1;
+/** Temporary file, that the index gets collected in */
+FILE *pfStoreIndex = 0;
+/** Offset of the next diagram in the store */
+unsigned long long llStoreOffset = F2E_STORE_HEADER_SIZE;
+/** Number of index entries so far */
+unsigned long long llStoreEntries = 0;
+/** Index entries that aren't written yet */
+unsigned char pucStoreIndex[ciStoreIndexEntries * F2E_STORE_ENTRY_SIZE];
+/** Number of bytes in pucStoreIndex */
+size_t iStoreIndexFill = 0;
+
+/** Stores \a llValue as little endian number of \a iBytes bytes
+at \a p.
+@param p Start of the number
+@param llValue The number
+@param iBytes Number of bytes
+*/
+void putStoreNumber(unsigned char *p, unsigned long long llValue, int iBytes)
+{
+  for (int i = 0; i < iBytes; i++)
+  {
+    p[i] = (unsigned char) (llValue & 0xff);
+    llValue >>= 8;
+  }
+}
+
+/** Writes the header of the store, with the index at
+\a llIndex (0 while the store isn't finished).
+@param llIndex Offset of the index
+@return ``true'' if the header was written, ``false'' else
+*/
+bool writeStoreHeader(unsigned long long llIndex)
+{
+  unsigned char pucHeader[F2E_STORE_HEADER_SIZE];
+  unsigned int iFormat = F2E_STORE_EPS;
+  if (iOutputFormat == ofPgm)
+    iFormat = F2E_STORE_PGM;
+  else if (iPreview == pvTiff)
+    iFormat = F2E_STORE_DOS_EPS;
+
+  memcpy(pucHeader, F2E_STORE_MAGIC, 8);
+  putStoreNumber(pucHeader + 8, F2E_STORE_VERSION, 4);
+  putStoreNumber(pucHeader + 12, iFormat, 4);
+  putStoreNumber(pucHeader + 16, llStoreEntries, 8);
+  putStoreNumber(pucHeader + 24, llIndex, 8);
+  return pwrite(iStoreFd, pucHeader, sizeof(pucHeader), 0) == (ssize_t) sizeof(pucHeader);
+}
+
+/** Opens the store ``sStoreFile'' and the temporary index file.
+@return ``true'' if both could be opened, ``false'' else
+*/
+bool openStore()
+{
+  iStoreFd = open(sStoreFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (iStoreFd < 0)
+  {
+    cerr << "Error: Could not open store file " << sStoreFile << "!" << endl;
+    return false;
+  }
+  // The diagrams follow the header, that gets written in place
+  pfStoreIndex = tmpfile();
+  if ((pfStoreIndex == 0) || (writeStoreHeader(0) == false) ||
+      (lseek(iStoreFd, F2E_STORE_HEADER_SIZE, SEEK_SET) < 0))
+  {
+    cerr << "Error: Could not write store file " << sStoreFile << "!" << endl;
+    return false;
+  }
+  return true;
+}
+
+/** Adds the entry for the next input line to the index.
+@param llOffset Offset of the diagram
+@param llSize Size of the diagram, 0 for none
+@return ``true'' if the entry could be added, ``false'' else
+*/
+bool addStoreEntry(unsigned long long llOffset, unsigned long long llSize)
+{
+  if (iStoreIndexFill == sizeof(pucStoreIndex))
+  {
+    if (fwrite(pucStoreIndex, 1, iStoreIndexFill, pfStoreIndex) != iStoreIndexFill)
+      return false;
+    iStoreIndexFill = 0;
+  }
+  putStoreNumber(pucStoreIndex + iStoreIndexFill, llOffset, 8);
+  putStoreNumber(pucStoreIndex + iStoreIndexFill + 8, llSize, 8);
+  iStoreIndexFill += F2E_STORE_ENTRY_SIZE;
+  llStoreEntries++;
+  return true;
+}
+
+/** Appends the diagram \a sData of the input line \a iLine to the
+store. The lines before, that have no entry yet, get empty ones.
+@param iLine Number of the input line
+@param sData The diagram
+@return ``true'' if the diagram could be stored, ``false'' else
+*/
+bool storeDiagram(unsigned int iLine, const string &sData)
+{
+  long long llStart = traceClock();
+  bool bOk = (iStoreFd >= 0);
+  while (bOk && (llStoreEntries + 1 < iLine))
+    bOk = addStoreEntry(0, 0);
+  bOk = bOk && writeFileData(iStoreFd, sData.data(), sData.size()) &&
+        addStoreEntry(llStoreOffset, sData.size());
+  llStoreOffset += sData.size();
+  traceSpan("store write", iLine, llStart);
+  if (bOk == false)
+  {
+    cerr << "Error: Could not write store file " << sStoreFile << "!" << endl;
+    close(iStoreFd);
+    iStoreFd = -1;
+  }
+  return bOk;
+}
+
+/** Finishes the store, i.e. appends the index with an entry for
+each of the \a iLines input lines and completes the header.
+@param iLines Number of input lines
+@return ``true'' if the store is complete, ``false'' else
+*/
+bool finishStore(unsigned int iLines)
+{
+  if (iStoreFd < 0)
+    return false;
+  bool bOk = true;
+  while (bOk && (llStoreEntries < iLines))
+    bOk = addStoreEntry(0, 0);
+
+  // Copy the index behind the diagrams
+  bOk = bOk && (fwrite(pucStoreIndex, 1, iStoreIndexFill, pfStoreIndex) == iStoreIndexFill);
+  bOk = bOk && (fflush(pfStoreIndex) == 0);
+  rewind(pfStoreIndex);
+  size_t iRead;
+  while (bOk && ((iRead = fread(pucStoreIndex, 1, sizeof(pucStoreIndex), pfStoreIndex)) > 0))
+    bOk = writeFileData(iStoreFd, (const char *) pucStoreIndex, iRead);
+  fclose(pfStoreIndex);
+
+  bOk = bOk && writeStoreHeader(llStoreOffset);
+  bOk = (close(iStoreFd) == 0) && bOk;
+  iStoreFd = -1;
+  if (bOk == false)
+    cerr << "Error: Could not write store file " << sStoreFile << "!" << endl;
+  return bOk;
+}
+
+/** Writes the diagram of the line ``llExtractLine'' of the store
+``sExtractStore'' to ``stdout'', straight from the mapped file.
+@return ``true'' if the diagram was written, ``false'' else
+*/
+bool extractDiagram()
+{
+  f2e_store sStore;
+  if (f2eOpenStore(&sStore, sExtractStore.c_str()) != 0)
+  {
+    cerr << "Error: Could not open store file " << sExtractStore << "!" << endl;
+    return false;
+  }
+  const char *pcData;
+  size_t iSize;
+  bool bOk = (f2eStoreDiagram(&sStore, llExtractLine, &pcData, &iSize) == 1);
+  if (bOk == false)
+    cerr << "Error: Line " << llExtractLine << " has no diagram in " << sExtractStore << "!" << endl;
+  else
+    bOk = writeFileData(1, pcData, iSize);
+  f2eCloseStore(&sStore);
+  return bOk;
+}
+#endif
+
+/*----------------------------------------------------------------- Grid */
+
+/** Size of the captions below the boards of a grid page, in points */
+const double cdCaptionSize = 10.0;
+/** Space between the boards of a grid page, in points */
+const double cdGridGutter = 14.0;
+
+/** Struct that keeps a single board of a grid page. */
+struct grid_cell
+{
+  /** The board position */
+  int Board[64];
+  /** Caption, taken from the EPD ``id'' opcode */
+  string Caption;
+};
+
+/** Boards of the current grid page, the cells are reused from
+page to page */
+vector<grid_cell> vGridCells;
+/** Number of boards on the current grid page */
+int iGridCells = 0;
+/** Symbols that the current grid page (``-p'' mode) or the
+whole document needs */
+bool pbGridExport[ciFontSymbols];
+/** Number of grid pages written so far */
+int iGridPages = 0;
+
+/** Extracts the value of the EPD ``id'' opcode from the input
+line \a pcLine, with the length \a iLength, into \a sCaption.
+@param pcLine The input line
+@param iLength Length of the input line
+@param sCaption The caption, empty if there is no ``id''
+*/
+void readEpdId(const char *pcLine, string::size_type iLength, string &sCaption)
+{
+  sCaption.clear();
+
+  const char *pcEnd = pcLine + iLength;
+  const char *pcOpcode = " id \"";
+  const char *pcPos = search(pcLine, pcEnd, pcOpcode, pcOpcode + 5);
+  if (pcPos == pcEnd)
+  {
+    pcOpcode = ";id \"";
+    pcPos = search(pcLine, pcEnd, pcOpcode, pcOpcode + 5);
+  }
+  if (pcPos == pcEnd)
+    return;
+  pcPos += 5;
+  const char *pcQuote = find(pcPos, pcEnd, '"');
+  if (pcQuote == pcEnd)
+    return;
+  sCaption.assign(pcPos, pcQuote - pcPos);
+}
+
+/** Returns the width of a cell on a grid page. */
+double gridCellWidth()
+{
+  return fiFontInfo.BoundingBoxSizeX + cdGridGutter;
+}
+
+/** Returns the height of a cell on a grid page. */
+double gridCellHeight()
+{
+  double dHeight = fiFontInfo.BoundingBoxSizeY + cdGridGutter;
+  if (bCaptions == true)
+    dHeight += 1.5 * cdCaptionSize;
+  return dHeight;
+}
+
+/** Adds the current board with the caption \a sCaption to
+the current grid page.
+@param sCaption Caption of the board
+*/
+void addGridCell(const string &sCaption)
+{
+  if ((int) vGridCells.size() == iGridCells)
+    vGridCells.push_back(grid_cell());
+  grid_cell &gcCell = vGridCells[iGridCells++];
+
+  memcpy(gcCell.Board, piCurrentBoard, sizeof(piCurrentBoard));
+  gcCell.Caption.assign(sCaption);
+
+  // Remember the needed symbols
+  for (int i = 0; i < ciFontSymbols; i++)
+  {
+    if (pbSymbolExport[i] == true)
+      pbGridExport[i] = true;
+  }
+}
+
+/** Writes the string \a s as Postscript string to \a fOut.
+@param fOut The output file
+@param s The string to be written
+*/
+void writePostscriptString(std::ostream &fOut, const string &s)
+{
+  fOut << "(";
+  for (string::size_type c = 0; c < s.size(); c++)
+  {
+    char ch = s[c];
+    if ((ch == '(') || (ch == ')') || (ch == '\\'))
+      fOut << '\\';
+    fOut << ch;
+  }
+  fOut << ")";
+}
+
+/** Writes the boards of the current grid page to \a fOut, each
+one translated to its cell.
+@param fOut The output file
+*/
+void writeGridCells(std::ostream &fOut)
+{
+  double dCellWidth = gridCellWidth();
+  double dCellHeight = gridCellHeight();
+
+  if (bCaptions == true)
+    fOut << "/Helvetica findfont " << cdCaptionSize << " scalefont setfont" << endl;
+
+  for (int i = 0; i < iGridCells; i++)
+  {
+    int iRow = i / iGridColumns;
+    int iColumn = i % iGridColumns;
+    double x = iColumn * dCellWidth + cdGridGutter / 2.0;
+    double y = (iGridRows - 1 - iRow) * dCellHeight + cdGridGutter / 2.0;
+    if (bCaptions == true)
+      y += 1.5 * cdCaptionSize;
+
+    fOut << "gsave" << endl;
+    fOut << x << " " << y << " translate" << endl;
+    memcpy(piCurrentBoard, vGridCells[i].Board, sizeof(piCurrentBoard));
+    writeDiagram(fOut);
+    fOut << "grestore" << endl;
+
+    if ((bCaptions == true) && (vGridCells[i].Caption.size() > 0))
+    {
+      // Centered caption below the board
+      fOut << (x + fiFontInfo.BoundingBoxSizeX / 2.0) << " ";
+      fOut << (y - 1.1 * cdCaptionSize) << " moveto ";
+      writePostscriptString(fOut, vGridCells[i].Caption);
+      fOut << " dup stringwidth pop 2 div neg 0 rmoveto show" << endl;
+    }
+  }
+  fOut << endl;
+}
+
+/** Writes the header and the prolog of the grid document to
+\a fOut. The prolog defines all symbols, because the boards of the
+following pages aren't known yet.
+@param fOut The output file
+*/
+void writeGridProlog(std::ostream &fOut)
+{
+  writeEpsHeader(fOut, iGridColumns * gridCellWidth(),
+                 iGridRows * gridCellHeight(), ciPagesAtEnd);
+  fOut << "%%BeginProlog" << endl;
+  for (int i = 0; i < ciFontSymbols; i++)
+    pbSymbolExport[i] = (i < 26) || pbGridExport[i];
+  exportPieces(fOut);
+  fOut << "%%EndProlog" << endl;
+}
+
+/** Finishes the current grid page. In ``-p'' mode it gets
+written to a new EPS file, with the symbols that this page needs,
+else it gets written to ``stdout'' right away, as page of the grid
+document (see writeGridProlog()).
+@return ``false'' if the output file couldn't be written, ``true'' else
+*/
+bool finishGridPage()
+{
+  // Counter
+  int i;
+
+  if (iGridCells == 0)
+    return true;
+
+  iGridPages++;
+  if (bPrefixExport == false)
+  {
+    if (iGridPages == 1)
+      writeGridProlog(cout);
+    cout << "%%Page: " << iGridPages << " " << iGridPages << endl;
+    cout << "save" << endl;
+    writeGridCells(cout);
+    cout << "restore" << endl;
+    cout << "showpage" << endl;
+    iGridCells = 0;
+    return true;
+  }
+
+  fileNumber++;
+  makeOutFileName(".eps");
+
+  obFileBuffer.Data.clear();
+  writeEpsHeader(osFileStream, iGridColumns * gridCellWidth(),
+                 iGridRows * gridCellHeight(), 0);
+  for (i = 0; i < ciFontSymbols; i++)
+    pbSymbolExport[i] = pbGridExport[i];
+  exportPieces(osFileStream);
+  writeGridCells(osFileStream);
+  writeEpsTrailer(osFileStream);
+
+  // Start the next page with the frames only
+  for (i = 0; i < 26; i++)
+    pbGridExport[i] = false;
+  iGridCells = 0;
+
+  return writeOutputFile(sOutFile, obFileBuffer.Data, false, lineNumber);
+}
+
+/** Writes the trailer of the grid document, with the number of
+its pages, to \a fOut.
+@param fOut The output file
+*/
+void writeGridTrailer(std::ostream &fOut)
+{
+  if (iGridPages == 0)
+    return;
+
+  fOut << "%%Trailer" << endl;
+  fOut << "%%Pages: " << iGridPages << endl;
+  fOut << "%%EOF" << endl;
+}
+
+/*------------------------------------------------------------ Catalogue */
+
+/** Sample position, shown for each font of the catalogue */
+const char *csCatalogueSample =
+  "1r5r/3b1pk1/3p1np1/p1qPp3/p1N1PbP1/2P2PN1/1PB1Q1K1/R3R3 b - - bm Nxg4; id \"ECM.011\";";
+/** Height of the font description above the board, in points */
+const double cdCatalogueHeading = 3.5 * cdCaptionSize;
+
+/** Struct that keeps a font of the catalogue. */
+struct catalogue_font
+{
+  /** Name of the font definition file */
+  string File;
+  /** Infos of the font */
+  font_info Info;
+  /** Sections of the font */
+  vector<font_section> Sections;
+  /** Error message, empty if the font was loaded successfully */
+  string Error;
+};
+
+/** The fonts of the catalogue */
+vector<catalogue_font> vCatalogueFonts;
+/** Index of the next catalogue font that gets loaded */
+atomic<unsigned int> iNextCatalogueFont(0);
+
+/** Compares two catalogue fonts by their names, for sorting. */
+bool lessCatalogueFont(const catalogue_font &cfA, const catalogue_font &cfB)
+{
+  if (cfA.Info.FontName != cfB.Info.FontName)
+    return cfA.Info.FontName < cfB.Info.FontName;
+  return cfA.File < cfB.File;
+}
+
+/** Loads the font \a cfFont from its font definition file.
+@param cfFont The catalogue font
+*/
+void loadCatalogueFont(catalogue_font &cfFont)
+{
+  long long llStart = traceClock();
+  std::ifstream fFont(cfFont.File.c_str());
+  if (!fFont)
+  {
+    cfFont.Error = "Could not open font definition file " + cfFont.File;
+    return;
+  }
+  if (!checkFileHeader(fFont))
+  {
+    cfFont.Error = "Wrong file header in Postscript font definition file " + cfFont.File;
+    return;
+  }
+  if (!readFontInfos(fFont, cfFont.Info))
+  {
+    cfFont.Error = "No ``FontInfo'' section found in " + cfFont.File;
+    return;
+  }
+  readFontSections(fFont, cfFont.Sections);
+  traceSpan("font load", 0, llStart);
+}
+
+/** Main routine of a catalogue thread, loads fonts until all
+of them are done.
+*/
+void catalogueThread()
+{
+  unsigned int iFont;
+
+  while ((iFont = iNextCatalogueFont++) < vCatalogueFonts.size())
+    loadCatalogueFont(vCatalogueFonts[iFont]);
+}
+
+/** Writes a catalogue of all fonts in the directory \a sDir to
+\a fOut, i.e. a Postscript document with one page per font,
+showing its infos and the sample position. The fonts are loaded
+concurrently.
+@param fOut The output file
+@param sDir Directory with the font definition files
+@return ``false'' if a font couldn't be loaded, ``true'' else
+*/
+bool writeCatalogue(std::ostream &fOut, const string &sDir)
+{
+  // Collect the font definition files
+  DIR *pDir = opendir(sDir.c_str());
+  if (pDir == NULL)
+  {
+    cerr << "Error: Could not open font directory " << sDir << "!" << endl;
+    return false;
+  }
+  struct dirent *pEntry;
+  while ((pEntry = readdir(pDir)) != NULL)
+  {
+    string sName = pEntry->d_name;
+    if ((sName.size() > 4) && (sName.compare(sName.size() - 4, 4, ".fed") == 0))
+    {
+      vCatalogueFonts.push_back(catalogue_font());
+      vCatalogueFonts.back().File = sDir + "/" + sName;
+    }
+  }
+  closedir(pDir);
+  if (vCatalogueFonts.empty())
+  {
+    cerr << "Error: No font definition files found in " << sDir << "!" << endl;
+    return false;
+  }
+
+  // Load the fonts
+  unsigned int iThreads = thread::hardware_concurrency();
+  if (iThreads < 2)
+    iThreads = 2;
+  if (iThreads > vCatalogueFonts.size())
+    iThreads = vCatalogueFonts.size();
+  vector<thread> vThreads;
+  for (unsigned int i = 0; i < iThreads; i++)
+    vThreads.push_back(thread(catalogueThread));
+  for (vector<thread>::iterator it = vThreads.begin(); it != vThreads.end(); ++it)
+    it->join();
+
+  vector<catalogue_font>::iterator it;
+  for (it = vCatalogueFonts.begin(); it != vCatalogueFonts.end(); ++it)
+  {
+    if (it->Error.size() > 0)
+    {
+      cerr << "Error: " << it->Error << "!" << endl;
+      return false;
+    }
+  }
+  sort(vCatalogueFonts.begin(), vCatalogueFonts.end(), lessCatalogueFont);
+
+  // Render the pages, and find the largest bounding box
+  string sSample = csCatalogueSample;
+  expandFENString(sSample);
+  selectFrameSymbols();
+  double dWidth = 0.0;
+  double dHeight = 0.0;
+  ostringstream sPages;
+  int iPage = 0;
+  for (it = vCatalogueFonts.begin(); it != vCatalogueFonts.end(); ++it)
+  {
+    fiFontInfo = it->Info;
+    vFontSections.swap(it->Sections);
+    computeFontLayout();
+    compileDiagramTemplate();
+    if (fiFontInfo.BoundingBoxSizeX > dWidth)
+      dWidth = fiFontInfo.BoundingBoxSizeX;
+    if (fiFontInfo.BoundingBoxSizeY + cdCatalogueHeading > dHeight)
+      dHeight = fiFontInfo.BoundingBoxSizeY + cdCatalogueHeading;
+
+    // The font of the page, for scripts that take the catalogue apart
+    string::size_type pos = it->File.find_last_of("/\\");
+    iPage++;
+    sPages << "%%Page: " << iPage << " " << iPage << endl;
+    sPages << "%%F2E File: " << it->File.substr(pos + 1) << endl;
+    writeFontInfoComments(sPages);
+    sPages << "save" << endl;
+
+    // Font infos above the board
+    double y = fiFontInfo.BoundingBoxSizeY + cdCatalogueHeading;
+    sPages << "/Helvetica-Bold findfont " << 1.4 * cdCaptionSize << " scalefont setfont" << endl;
+    sPages << "0 " << (y - 1.4 * cdCaptionSize) << " moveto ";
+    writePostscriptString(sPages, fiFontInfo.FontName);
+    sPages << " show" << endl;
+    sPages << "/Helvetica findfont " << cdCaptionSize << " scalefont setfont" << endl;
+    sPages << "0 " << (y - 2.7 * cdCaptionSize) << " moveto ";
+    writePostscriptString(sPages, it->File.substr(pos + 1) + ", by " +
+                          fiFontInfo.FontAuthor + " (" + fiFontInfo.FontDate +
+                          "), version " + fiFontInfo.FontVersion);
+    sPages << " show" << endl << endl;
+
+    exportPieces(sPages);
+    writeDiagram(sPages);
+    sPages << "restore" << endl;
+    sPages << "showpage" << endl;
+
+    vFontSections.swap(it->Sections);
+  }
+
+  // The document itself has no single font
+  fiFontInfo = font_info();
+  writeEpsHeader(fOut, dWidth, dHeight, iPage);
+  fOut << sPages.str();
+  fOut << "%%Trailer" << endl;
+  fOut << "%%EOF" << endl;
+
+  return true;
+}
+
+/*--------------------------------------------------------------- Raster */
+
+/** Returns the section of the current font for the symbol
+with the ID \a iSymbol.
+@param iSymbol ID of the symbol, -1 for the EPS preamble
+@return Pointer to the section, 0 if the font doesn't define it
+*/
+const font_section *findFontSection(int iSymbol)
+{
+  for (vector<font_section>::const_iterator it = vFontSections.begin();
+       it != vFontSections.end(); ++it)
+  {
+    if (it->ID == iSymbol)
+      return &(*it);
+  }
+
+  return 0;
+}
+
+/** Splits the Postscript code \a sCode into single tokens,
+i.e. numbers, names and braces.
+@param sCode The Postscript code
+@param vTokens The list of tokens, new tokens get appended
+@param pvOffsets If given, the offsets of the tokens within
+\a sCode get appended to this list
+*/
+void tokenizePostscript(const string &sCode, vector<string> &vTokens,
+                        vector<string::size_type> *pvOffsets = 0)
+{
+  string::size_type pos = 0;
+  string::size_type end;
+
+  while (pos < sCode.size())
+  {
+    // Skip whitespace
+    if (isspace((unsigned char) sCode[pos]))
+    {
+      pos++;
+      continue;
+    }
+    // Skip comments
+    if (sCode[pos] == '%')
+    {
+      pos = sCode.find('\n', pos);
+      continue;
+    }
+    // Braces are tokens of their own
+    if ((sCode[pos] == '{') || (sCode[pos] == '}'))
+    {
+      vTokens.push_back(sCode.substr(pos, 1));
+      if (pvOffsets != 0)
+        pvOffsets->push_back(pos);
+      pos++;
+      continue;
+    }
+    end = pos;
+    while ((end < sCode.size()) &&
+           !isspace((unsigned char) sCode[end]) &&
+           (sCode[end] != '{') && (sCode[end] != '}') &&
+           (sCode[end] != '%'))
+      end++;
+    vTokens.push_back(sCode.substr(pos, end - pos));
+    if (pvOffsets != 0)
+      pvOffsets->push_back(pos);
+    pos = end;
+  }
+}
+
+/** Reads the procedures that the EPS preamble of the current
+font defines (``/name {...} def'') into \a mProcs, such that
+glyph outlines that use them can be interpreted.
+@param mProcs Names of the procedures and their tokens
+*/
+void readPreambleProcs(map<string, vector<string> > &mProcs)
+{
+  const font_section *pfsPreamble = findFontSection(-1);
+  if (pfsPreamble == 0)
+    return;
+
+  vector<string> vTokens;
+  tokenizePostscript(pfsPreamble->Body, vTokens);
+
+  vector<string>::size_type i = 0;
+  while (i + 1 < vTokens.size())
+  {
+    if ((vTokens[i][0] == '/') && (vTokens[i+1] == "{"))
+    {
+      string sName = vTokens[i].substr(1);
+      vector<string> vBody;
+      int iDepth = 1;
+      i += 2;
+      while ((i < vTokens.size()) && (iDepth > 0))
+      {
+        if (vTokens[i] == "{")
+          iDepth++;
+        if (vTokens[i] == "}")
+          iDepth--;
+        if (iDepth > 0)
+          vBody.push_back(vTokens[i]);
+        i++;
+      }
+      mProcs[sName] = vBody;
+    }
+    else
+      i++;
+  }
+}
+
+/** Struct for a point of a (flattened) glyph path. */
+struct path_point
+{
+  double X;
+  double Y;
+};
+
+/** Struct that keeps a single ``fill'' of a glyph, i.e. a
+list of closed subpaths in font units and the gray value
+they get painted with. */
+struct glyph_fill
+{
+  /** Closed and flattened subpaths */
+  vector<vector<path_point> > Subpaths;
+  /** Gray value, from 0.0 (black) to 1.0 (white) */
+  double Gray;
+  /** Is ``true'' for the even-odd rule, ``false'' for non-zero winding */
+  bool EvenOdd;
+};
+
+/** Struct that keeps the graphics state while a glyph gets
+interpreted. */
+struct glyph_state
+{
+  /** Current path */
+  vector<vector<path_point> > Path;
+  /** Current point */
+  path_point Current;
+  /** Current gray value */
+  double Gray;
+};
+
+/** Interprets the tokens \a vTokens of a glyph outline and
+appends each ``fill'' to \a vFills. Only the path construction,
+painting and color operators are supported, everything else is
+ignored.
+@param vTokens The tokens of the outline
+@param mProcs Procedures of the EPS preamble
+@param gsState The current graphics state
+@param vStack The operand stack
+@param vSaved The states saved with ``gsave''
+@param vFills The list of fills
+@param dFlatness Maximum length of a flattened curve segment, in font units
+*/
+void interpretGlyph(const vector<string> &vTokens,
+                    map<string, vector<string> > &mProcs,
+                    glyph_state &gsState,
+                    vector<double> &vStack,
+                    vector<glyph_state> &vSaved,
+                    vector<glyph_fill> &vFills,
+                    double dFlatness)
+{
+  for (vector<string>::const_iterator it = vTokens.begin();
+       it != vTokens.end(); ++it)
+  {
+    const string &t = *it;
+    char *pcEnd;
+    double dNumber = strtod(t.c_str(), &pcEnd);
+    // Is it a number?
+    if ((pcEnd != t.c_str()) && (*pcEnd == '\0'))
+    {
+      vStack.push_back(dNumber);
+      continue;
+    }
+
+    // Number of operands
+    vector<double>::size_type n = vStack.size();
+    if ((t == "moveto") || (t == "rmoveto"))
+    {
+      if (n < 2)
+        continue;
+      path_point ppNew;
+      ppNew.X = vStack[n-2];
+      ppNew.Y = vStack[n-1];
+      if (t[0] == 'r')
+      {
+        ppNew.X += gsState.Current.X;
+        ppNew.Y += gsState.Current.Y;
+      }
+      gsState.Path.push_back(vector<path_point>(1, ppNew));
+      gsState.Current = ppNew;
+      vStack.resize(n - 2);
+    }
+    else if ((t == "lineto") || (t == "rlineto"))
+    {
+      if ((n < 2) || gsState.Path.empty())
+        continue;
+      path_point ppNew;
+      ppNew.X = vStack[n-2];
+      ppNew.Y = vStack[n-1];
+      if (t[0] == 'r')
+      {
+        ppNew.X += gsState.Current.X;
+        ppNew.Y += gsState.Current.Y;
+      }
+      gsState.Path.back().push_back(ppNew);
+      gsState.Current = ppNew;
+      vStack.resize(n - 2);
+    }
+    else if ((t == "curveto") || (t == "rcurveto"))
+    {
+      if ((n < 6) || gsState.Path.empty())
+        continue;
+      double x0 = gsState.Current.X;
+      double y0 = gsState.Current.Y;
+      double dx = 0.0, dy = 0.0;
+      if (t[0] == 'r')
+      {
+        dx = x0;
+        dy = y0;
+      }
+      double x1 = vStack[n-6] + dx, y1 = vStack[n-5] + dy;
+      double x2 = vStack[n-4] + dx, y2 = vStack[n-3] + dy;
+      double x3 = vStack[n-2] + dx, y3 = vStack[n-1] + dy;
+      // Flatten the curve, depending on the length of its control polygon
+      double dLength = hypot(x1 - x0, y1 - y0) + hypot(x2 - x1, y2 - y1) +
+                       hypot(x3 - x2, y3 - y2);
+      int iSteps = (int) (dLength / dFlatness) + 1;
+      if (iSteps > 64)
+        iSteps = 64;
+      for (int s = 1; s <= iSteps; s++)
+      {
+        double u = (double) s / iSteps;
+        double v = 1.0 - u;
+        path_point ppNew;
+        ppNew.X = v*v*v*x0 + 3*v*v*u*x1 + 3*v*u*u*x2 + u*u*u*x3;
+        ppNew.Y = v*v*v*y0 + 3*v*v*u*y1 + 3*v*u*u*y2 + u*u*u*y3;
+        gsState.Path.back().push_back(ppNew);
+      }
+      gsState.Current.X = x3;
+      gsState.Current.Y = y3;
+      vStack.resize(n - 6);
+    }
+    else if (t == "closepath")
+    {
+      if (!gsState.Path.empty())
+        gsState.Current = gsState.Path.back().front();
+    }
+    else if (t == "newpath")
+    {
+      gsState.Path.clear();
+    }
+    else if ((t == "fill") || (t == "eofill"))
+    {
+      glyph_fill gfFill;
+      gfFill.Subpaths.swap(gsState.Path);
+      gfFill.Gray = gsState.Gray;
+      gfFill.EvenOdd = (t == "eofill");
+      vFills.push_back(gfFill);
+    }
+    else if (t == "gsave")
+    {
+      vSaved.push_back(gsState);
+    }
+    else if (t == "grestore")
+    {
+      if (!vSaved.empty())
+      {
+        gsState = vSaved.back();
+        vSaved.pop_back();
+      }
+    }
+    else if (t == "setgray")
+    {
+      if (n < 1)
+        continue;
+      gsState.Gray = vStack[n-1];
+      vStack.resize(n - 1);
+    }
+    else if (t == "setrgbcolor")
+    {
+      if (n < 3)
+        continue;
+      gsState.Gray = 0.3*vStack[n-3] + 0.59*vStack[n-2] + 0.11*vStack[n-1];
+      vStack.resize(n - 3);
+    }
+    else if (mProcs.find(t) != mProcs.end())
+    {
+      // Procedure of the EPS preamble
+      interpretGlyph(mProcs[t], mProcs, gsState, vStack, vSaved, vFills, dFlatness);
+    }
+  }
+}
+
+/** Struct that keeps a rendered glyph, a ``tile'' of pixels
+that can be copied onto the canvas. */
+struct glyph_tile
+{
+  /** Is ``true'' if the tile has been rendered already */
+  bool Rendered;
+  /** Offset of the tile's left edge to the glyph origin, in pixels */
+  int Left;
+  /** Offset of the tile's top edge to the glyph origin, in pixels */
+  int Top;
+  /** Width in pixels */
+  int Width;
+  /** Height in pixels */
+  int Height;
+  /** Coverage of each pixel (0-255) */
+  vector<unsigned char> Alpha;
+  /** Painted brightness of each pixel, premultiplied with the coverage */
+  vector<unsigned char> Value;
+};
+
+/** Struct for an edge of a subpath, in tile pixels. */
+struct raster_edge
+{
+  double X0, Y0, X1, Y1;
+  /** Direction, +1 for downwards and -1 for upwards edges */
+  int Dir;
+};
+
+/** Struct for the crossing of a scanline with an edge. */
+struct raster_crossing
+{
+  double X;
+  int Dir;
+  bool operator<(const raster_crossing &rc) const
+  {
+    return X < rc.X;
+  }
+};
+
+/** Number of subsamples per pixel row, for anti-aliasing */
+const int ciRasterSubsamples = 4;
+
+/** Adds the coverage \a dWeight for the span from \a x0
+to \a x1 to the row \a pfRow of width \a iWidth.
+*/
+void addRasterSpan(vector<float> &vRow, int iWidth, double x0, double x1,
+                   float dWeight)
+{
+  if (x0 < 0.0)
+    x0 = 0.0;
+  if (x1 > iWidth)
+    x1 = iWidth;
+  if (x1 <= x0)
+    return;
+
+  int i0 = (int) x0;
+  int i1 = (int) x1;
+  if (i0 == i1)
+  {
+    vRow[i0] += (x1 - x0) * dWeight;
+    return;
+  }
+  vRow[i0] += (i0 + 1 - x0) * dWeight;
+  for (int i = i0 + 1; i < i1; i++)
+    vRow[i] += dWeight;
+  if (i1 < iWidth)
+    vRow[i1] += (x1 - i1) * dWeight;
+}
+
+/** Paints the fill \a gfFill into the tile \a gtTile.
+@param gfFill The fill, with subpaths in tile pixels
+@param gtTile The tile
+*/
+void rasterizeFill(const glyph_fill &gfFill, glyph_tile &gtTile)
+{
+  // Collect the edges of all (implicitly closed) subpaths
+  vector<raster_edge> vEdges;
+  double dMinY = gtTile.Height;
+  double dMaxY = 0.0;
+  for (vector<vector<path_point> >::const_iterator sp = gfFill.Subpaths.begin();
+       sp != gfFill.Subpaths.end(); ++sp)
+  {
+    for (vector<path_point>::size_type i = 0; i < sp->size(); i++)
+    {
+      const path_point &p0 = (*sp)[i];
+      const path_point &p1 = (*sp)[(i + 1) % sp->size()];
+      if (p0.Y == p1.Y)
+        continue;
+      raster_edge reEdge;
+      reEdge.X0 = p0.X; reEdge.Y0 = p0.Y;
+      reEdge.X1 = p1.X; reEdge.Y1 = p1.Y;
+      reEdge.Dir = 1;
+      if (p0.Y > p1.Y)
+      {
+        reEdge.X0 = p1.X; reEdge.Y0 = p1.Y;
+        reEdge.X1 = p0.X; reEdge.Y1 = p0.Y;
+        reEdge.Dir = -1;
+      }
+      if (reEdge.Y0 < dMinY)
+        dMinY = reEdge.Y0;
+      if (reEdge.Y1 > dMaxY)
+        dMaxY = reEdge.Y1;
+      vEdges.push_back(reEdge);
+    }
+  }
+  if (vEdges.empty())
+    return;
+
+  int iFirstRow = (int) floor(dMinY);
+  int iLastRow = (int) ceil(dMaxY);
+  if (iFirstRow < 0)
+    iFirstRow = 0;
+  if (iLastRow > gtTile.Height)
+    iLastRow = gtTile.Height;
+
+  vector<float> vRow(gtTile.Width + 1);
+  vector<raster_crossing> vCrossings;
+  float fWeight = 1.0f / ciRasterSubsamples;
+  for (int row = iFirstRow; row < iLastRow; row++)
+  {
+    fill(vRow.begin(), vRow.end(), 0.0f);
+    for (int s = 0; s < ciRasterSubsamples; s++)
+    {
+      double y = row + (s + 0.5) / ciRasterSubsamples;
+      vCrossings.clear();
+      for (vector<raster_edge>::const_iterator e = vEdges.begin();
+           e != vEdges.end(); ++e)
+      {
+        if ((y < e->Y0) || (y >= e->Y1))
+          continue;
+        raster_crossing rcNew;
+        rcNew.X = e->X0 + (y - e->Y0) * (e->X1 - e->X0) / (e->Y1 - e->Y0);
+        rcNew.Dir = e->Dir;
+        vCrossings.push_back(rcNew);
+      }
+      sort(vCrossings.begin(), vCrossings.end());
+
+      // Find the spans that are ``inside''
+      int iWinding = 0;
+      for (vector<raster_crossing>::size_type c = 0; c + 1 < vCrossings.size(); c++)
+      {
+        iWinding += vCrossings[c].Dir;
+        bool bInside = gfFill.EvenOdd ? ((c % 2) == 0) : (iWinding != 0);
+        if (bInside)
+          addRasterSpan(vRow, gtTile.Width, vCrossings[c].X, vCrossings[c+1].X, fWeight);
+      }
+    }
+
+    // Paint the row into the tile
+    int iGray = (int) (gfFill.Gray * 255.0 + 0.5);
+    for (int col = 0; col < gtTile.Width; col++)
+    {
+      float a = vRow[col];
+      if (a <= 0.0f)
+        continue;
+      if (a > 1.0f)
+        a = 1.0f;
+      int idx = row*gtTile.Width + col;
+      gtTile.Alpha[idx] = (unsigned char) (gtTile.Alpha[idx]*(1.0f - a) + 255.0f*a + 0.5f);
+      gtTile.Value[idx] = (unsigned char) (gtTile.Value[idx]*(1.0f - a) + iGray*a + 0.5f);
+    }
+  }
+}
+
+/** Renders the glyph outline \a sBody into the tile \a gtTile,
+at \a dPixelScale pixels per font unit.
+@param sBody The glyph outline
+@param dPixelScale Pixels per font unit
+@param gtTile The tile
+*/
+void renderGlyphBody(const string &sBody, double dPixelScale, glyph_tile &gtTile)
+{
+  gtTile.Rendered = true;
+  gtTile.Left = gtTile.Top = 0;
+  gtTile.Width = gtTile.Height = 0;
+  gtTile.Alpha.clear();
+  gtTile.Value.clear();
+
+  // Interpret the outlines
+  map<string, vector<string> > mProcs;
+  readPreambleProcs(mProcs);
+  vector<string> vTokens;
+  tokenizePostscript(sBody, vTokens);
+  glyph_state gsState;
+  gsState.Current.X = gsState.Current.Y = 0.0;
+  gsState.Gray = 0.0;
+  vector<double> vStack;
+  vector<glyph_state> vSaved;
+  vector<glyph_fill> vFills;
+  interpretGlyph(vTokens, mProcs, gsState, vStack, vSaved, vFills,
+                 0.5 / dPixelScale);
+
+  // Compute the bounding box in pixels
+  double dMinX = 1e30, dMinY = 1e30, dMaxX = -1e30, dMaxY = -1e30;
+  vector<glyph_fill>::iterator gf;
+  for (gf = vFills.begin(); gf != vFills.end(); ++gf)
+  {
+    for (vector<vector<path_point> >::iterator sp = gf->Subpaths.begin();
+         sp != gf->Subpaths.end(); ++sp)
+    {
+      for (vector<path_point>::iterator pp = sp->begin(); pp != sp->end(); ++pp)
+      {
+        // Font coordinates point upwards, pixels downwards
+        pp->X *= dPixelScale;
+        pp->Y *= -dPixelScale;
+        dMinX = min(dMinX, pp->X);
+        dMaxX = max(dMaxX, pp->X);
+        dMinY = min(dMinY, pp->Y);
+        dMaxY = max(dMaxY, pp->Y);
+      }
+    }
+  }
+  if (dMinX > dMaxX)
+    return; // Nothing painted
+
+  gtTile.Left = (int) floor(dMinX);
+  gtTile.Top = (int) floor(dMinY);
+  gtTile.Width = (int) ceil(dMaxX) - gtTile.Left;
+  gtTile.Height = (int) ceil(dMaxY) - gtTile.Top;
+  gtTile.Alpha.assign(gtTile.Width*gtTile.Height, 0);
+  gtTile.Value.assign(gtTile.Width*gtTile.Height, 0);
+
+  // Paint all fills, in tile coordinates
+  for (gf = vFills.begin(); gf != vFills.end(); ++gf)
+  {
+    for (vector<vector<path_point> >::iterator sp = gf->Subpaths.begin();
+         sp != gf->Subpaths.end(); ++sp)
+    {
+      for (vector<path_point>::iterator pp = sp->begin(); pp != sp->end(); ++pp)
+      {
+        pp->X -= gtTile.Left;
+        pp->Y -= gtTile.Top;
+      }
+    }
+    rasterizeFill(*gf, gtTile);
+  }
+}
+
+/** Renders the symbol \a iSymbol of the current font into
+the tile \a gtTile, at \a dPixelScale pixels per font unit.
+@param iSymbol ID of the symbol
+@param dPixelScale Pixels per font unit
+@param gtTile The tile
+*/
+void renderGlyphTile(int iSymbol, double dPixelScale, glyph_tile &gtTile)
+{
+  const font_section *pfsGlyph = findFontSection(iSymbol);
+  renderGlyphBody((pfsGlyph == 0) ? string() : pfsGlyph->Body, dPixelScale, gtTile);
+}
+
+/** Struct for the position of a glyph on the canvas. */
+struct glyph_placement
+{
+  /** ID of the symbol */
+  int ID;
+  /** Position of the glyph origin, in pixels */
+  int X;
+  int Y;
+};
+
+/** Struct that keeps the raster image of the current diagram,
+together with everything needed for updating it. */
+struct raster_canvas
+{
+  /** Pixels per font unit */
+  double PixelScale;
+  /** Width of the image in pixels */
+  int Width;
+  /** Height of the image in pixels */
+  int Height;
+  /** Gray values of the image (0 = black, 255 = white) */
+  vector<unsigned char> Pixels;
+  /** Positions of the frame symbols */
+  vector<glyph_placement> Frames;
+  /** Glyph origins of the squares */
+  glyph_placement Squares[64];
+  /** Size of a square in pixels */
+  int SquareWidth;
+  /** Height of a square above the glyph origin, in pixels */
+  int SquareHeight;
+  /** Depth of a square below the glyph origin, in pixels */
+  int SquareDepth;
+  /** Rendered glyphs, one for each symbol */
+  glyph_tile Tiles[ciFontSymbols];
+  /** Board of the previous image */
+  int PreviousBoard[64];
+  /** Is ``true'' if the canvas holds a complete image */
+  bool Valid;
+  /** Bounding box of the squares that changed with the last update */
+  int ChangedLeft, ChangedTop, ChangedRight, ChangedBottom;
+  /** Marks the squares that changed with the last update */
+  bool Changed[64];
+  /** Palette indices of the current GIF frame, kept for reuse */
+  vector<unsigned char> Indices;
+} rcCanvas;
+
+/** Helper for computeRasterLayout(), moves the current position
+\a ppPos by the given offset in font units. */
+void moveRasterPosition(path_point &ppPos, double dx, double dy)
+{
+  ppPos.X += dx;
+  ppPos.Y += dy;
+}
+
+/** Helper for computeRasterLayout(), places the symbol
+\a iSymbol at the current position \a ppPos.
+@return The placement in pixels
+*/
+glyph_placement placeRasterGlyph(int iSymbol, const path_point &ppPos,
+                                 double dOriginX, double dOriginY)
+{
+  glyph_placement gpNew;
+  gpNew.ID = iSymbol;
+  gpNew.X = (int) floor(dOriginX + ppPos.X*rcCanvas.PixelScale + 0.5);
+  gpNew.Y = (int) floor(dOriginY - ppPos.Y*rcCanvas.PixelScale + 0.5);
+  return gpNew;
+}
+
+/** Computes the size of the raster image and the positions of
+all frames and squares for the current font and options, at
+\a dDpi pixels per inch. The resolution gets adjusted slightly,
+such that a square is a whole number of pixels wide. The glyph
+positions follow the same translations as writeDiagram().
+@param dDpi The resolution in pixels per inch
+*/
+void computeRasterLayout(double dDpi)
+{
+  const font_info &fi = fiFontInfo;
+  // Counters
+  int row, col;
+  // Width and depth of the left frame
+  double dLeftWidth = bNotation ? fi.LeftNotationFrameWidth : fi.LeftFrameWidth;
+  double dLeftDepth = bNotation ? fi.LeftNotationFrameDepth : fi.LeftFrameDepth;
+
+  // Pixels per font unit
+  double dSquarePixels = floor(fi.SquareSize * fi.ScaleFactor * dDpi / 72.0 + 0.5);
+  if (dSquarePixels < 1.0)
+    dSquarePixels = 1.0;
+  rcCanvas.PixelScale = dSquarePixels / fi.SquareSize;
+  rcCanvas.Width = (int) ceil(fi.BoundingBoxSizeX / fi.ScaleFactor * rcCanvas.PixelScale);
+  rcCanvas.Height = (int) ceil(fi.BoundingBoxSizeY / fi.ScaleFactor * rcCanvas.PixelScale);
+  rcCanvas.SquareWidth = (int) dSquarePixels;
+  rcCanvas.SquareHeight = (int) floor(fi.SquareHeight * rcCanvas.PixelScale + 0.5);
+  rcCanvas.SquareDepth = (int) floor(fi.SquareDepth * rcCanvas.PixelScale + 0.5);
+
+  // Position of the origin in pixels
+  double dOriginX = fi.TranslateX / fi.ScaleFactor * rcCanvas.PixelScale;
+  double dOriginY = (fi.BoundingBoxSizeY - fi.TranslateY) / fi.ScaleFactor *
+                    rcCanvas.PixelScale;
+
+  rcCanvas.Frames.clear();
+  path_point ppPos;
+  ppPos.X = ppPos.Y = 0.0;
+
+  // Top frame
+  rcCanvas.Frames.push_back(placeRasterGlyph(30, ppPos, dOriginX, dOriginY));
+  moveRasterPosition(ppPos, fi.LeftFrameWidth, 0.0);
+  for (col = 0; col < 8; col++)
+  {
+    rcCanvas.Frames.push_back(placeRasterGlyph(26, ppPos, dOriginX, dOriginY));
+    moveRasterPosition(ppPos, fi.SquareSize, 0.0);
+  }
+  rcCanvas.Frames.push_back(placeRasterGlyph(31, ppPos, dOriginX, dOriginY));
+  moveRasterPosition(ppPos, -(fi.SquareSize*8 + dLeftWidth),
+                     -(fi.SquareSize - dLeftDepth + fi.TopFrameDepth));
+
+  // Chess board
+  for (row = 0; row < 8; row++)
+  {
+    // Left frame
+    int iLeft = 27;
+    if (bNotation == true)
+      iLeft = bReverse ? 34 + row : 34 + (7-row);
+    rcCanvas.Frames.push_back(placeRasterGlyph(iLeft, ppPos, dOriginX, dOriginY));
+    moveRasterPosition(ppPos, dLeftWidth, fi.SquareDepth - dLeftDepth);
+
+    // Board rank
+    for (col = 0; col < 8; col++)
+    {
+      rcCanvas.Squares[row*8+col] = placeRasterGlyph(0, ppPos, dOriginX, dOriginY);
+      if (col < 7)
+        moveRasterPosition(ppPos, fi.SquareSize, 0.0);
+    }
+    moveRasterPosition(ppPos, fi.SquareSize, fi.RightFrameDepth - fi.SquareDepth);
+
+    // Right frame
+    rcCanvas.Frames.push_back(placeRasterGlyph(28, ppPos, dOriginX, dOriginY));
+    if (row < 7)
+      moveRasterPosition(ppPos, -(fi.SquareSize*8 + dLeftWidth),
+                         -(fi.SquareSize + dLeftDepth - fi.RightFrameDepth));
+    else
+      moveRasterPosition(ppPos, -(fi.SquareSize*8 + fi.LeftFrameWidth),
+                         -(fi.BottomFrameHeight + fi.RightFrameDepth));
+  }
+
+  // Bottom frame
+  rcCanvas.Frames.push_back(placeRasterGlyph(32, ppPos, dOriginX, dOriginY));
+  moveRasterPosition(ppPos, fi.LeftFrameWidth,
+                     bNotation ? fi.BottomFrameHeight - fi.BottomNotationFrameHeight : 0.0);
+  for (col = 0; col < 8; col++)
+  {
+    int iBottom = 29;
+    if (bNotation == true)
+      iBottom = bReverse ? 42 + (7-col) : 42 + col;
+    rcCanvas.Frames.push_back(placeRasterGlyph(iBottom, ppPos, dOriginX, dOriginY));
+    if (col < 7)
+      moveRasterPosition(ppPos, fi.SquareSize, 0.0);
+  }
+  moveRasterPosition(ppPos, fi.SquareSize,
+                     bNotation ? fi.BottomNotationFrameHeight - fi.BottomFrameHeight : 0.0);
+  rcCanvas.Frames.push_back(placeRasterGlyph(33, ppPos, dOriginX, dOriginY));
+
+  rcCanvas.Pixels.assign(rcCanvas.Width*rcCanvas.Height, 255);
+  rcCanvas.Indices.reserve(rcCanvas.Width*rcCanvas.Height);
+  for (col = 0; col < ciFontSymbols; col++)
+    rcCanvas.Tiles[col].Rendered = false;
+  // Render the square symbols up front, such that updating the
+  // board doesn't allocate any tiles later on
+  for (col = 0; col < 26; col++)
+    renderGlyphTile(col, rcCanvas.PixelScale, rcCanvas.Tiles[col]);
+  rcCanvas.Valid = false;
+}
+
+/** Copies the tile of symbol \a iSymbol onto the canvas, with
+its origin at the pixel \a x, \a y. Only the pixels within the
+clip rectangle get painted.
+*/
+void blitGlyphTile(int iSymbol, int x, int y,
+                   int iClipLeft, int iClipTop, int iClipRight, int iClipBottom)
+{
+  glyph_tile &gtTile = rcCanvas.Tiles[iSymbol];
+  if (gtTile.Rendered == false)
+    renderGlyphTile(iSymbol, rcCanvas.PixelScale, gtTile);
+
+  int iLeft = max(x + gtTile.Left, max(iClipLeft, 0));
+  int iTop = max(y + gtTile.Top, max(iClipTop, 0));
+  int iRight = min(x + gtTile.Left + gtTile.Width, min(iClipRight, rcCanvas.Width));
+  int iBottom = min(y + gtTile.Top + gtTile.Height, min(iClipBottom, rcCanvas.Height));
+
+  for (int row = iTop; row < iBottom; row++)
+  {
+    unsigned char *pucDest = &rcCanvas.Pixels[row*rcCanvas.Width];
+    int iTileRow = (row - y - gtTile.Top)*gtTile.Width - x - gtTile.Left;
+    for (int col = iLeft; col < iRight; col++)
+    {
+      int a = gtTile.Alpha[iTileRow + col];
+      if (a == 0)
+        continue;
+      pucDest[col] = (unsigned char) ((pucDest[col]*(255 - a) + 127) / 255 +
+                                      gtTile.Value[iTileRow + col]);
+    }
+  }
+}
+
+/** Redraws the square \a iSquare of the canvas with the symbol
+of the current board.
+*/
+void drawRasterSquare(int iSquare)
+{
+  const glyph_placement &gp = rcCanvas.Squares[iSquare];
+  int iLeft = max(gp.X, 0);
+  int iTop = max(gp.Y - rcCanvas.SquareHeight, 0);
+  int iRight = min(gp.X + rcCanvas.SquareWidth, rcCanvas.Width);
+  int iBottom = min(gp.Y + rcCanvas.SquareDepth, rcCanvas.Height);
+
+  // Clear the square...
+  for (int row = iTop; row < iBottom; row++)
+    memset(&rcCanvas.Pixels[row*rcCanvas.Width + iLeft], 255, max(iRight - iLeft, 0));
+  //...and draw the new symbol
+  blitGlyphTile(piCurrentBoard[iSquare], gp.X, gp.Y, iLeft, iTop, iRight, iBottom);
+
+  rcCanvas.Changed[iSquare] = true;
+  rcCanvas.ChangedLeft = min(rcCanvas.ChangedLeft, iLeft);
+  rcCanvas.ChangedTop = min(rcCanvas.ChangedTop, iTop);
+  rcCanvas.ChangedRight = max(rcCanvas.ChangedRight, iRight);
+  rcCanvas.ChangedBottom = max(rcCanvas.ChangedBottom, iBottom);
+}
+
+/** Updates the canvas to the current board. The first image
+gets drawn completely, afterwards only the squares that differ
+from the previous board are redrawn.
+*/
+void renderRasterDiagram()
+{
+  // Counter
+  int i;
+
+  rcCanvas.ChangedLeft = rcCanvas.Width;
+  rcCanvas.ChangedTop = rcCanvas.Height;
+  rcCanvas.ChangedRight = rcCanvas.ChangedBottom = 0;
+  for (i = 0; i < 64; i++)
+    rcCanvas.Changed[i] = false;
+
+  if (rcCanvas.Valid == false)
+  {
+    // Draw everything
+    fill(rcCanvas.Pixels.begin(), rcCanvas.Pixels.end(), 255);
+    for (vector<glyph_placement>::const_iterator gp = rcCanvas.Frames.begin();
+         gp != rcCanvas.Frames.end(); ++gp)
+      blitGlyphTile(gp->ID, gp->X, gp->Y, 0, 0, rcCanvas.Width, rcCanvas.Height);
+    for (i = 0; i < 64; i++)
+      drawRasterSquare(i);
+    rcCanvas.Valid = true;
+  }
+  else
+  {
+    // Redraw changed squares only
+    for (i = 0; i < 64; i++)
+    {
+      if (rcCanvas.PreviousBoard[i] != piCurrentBoard[i])
+        drawRasterSquare(i);
+    }
+  }
+
+  memcpy(rcCanvas.PreviousBoard, piCurrentBoard, sizeof(piCurrentBoard));
+}
+
+/** Writes the canvas as binary PGM image to \a fOut.
+@param fOut The output file
+*/
+void writePgmImage(std::ostream &fOut)
+{
+  fOut << "P5" << endl;
+  fOut << rcCanvas.Width << " " << rcCanvas.Height << endl;
+  fOut << "255" << endl;
+  fOut.write((const char *) &rcCanvas.Pixels[0], rcCanvas.Pixels.size());
+}
+
+/** Palette index for transparent pixels in GIF images */
+const int ciGifTransparent = 255;
+
+/** Struct that keeps the state of the LZW encoder for GIF
+images. */
+struct gif_encoder
+{
+  /** Bit buffer */
+  unsigned long Bits;
+  /** Number of bits in the buffer */
+  int BitCount;
+  /** Current data sub-block */
+  unsigned char Block[256];
+  /** Number of bytes in the current sub-block */
+  int BlockSize;
+  /** Hash table of the string codes */
+  int HashKey[5003];
+  short HashCode[5003];
+} geGifEncoder;
+
+/** Writes the code \a iCode with \a iCodeSize bits. */
+void writeGifCode(std::ostream &fOut, int iCode, int iCodeSize)
+{
+  gif_encoder &ge = geGifEncoder;
+
+  ge.Bits |= ((unsigned long) iCode) << ge.BitCount;
+  ge.BitCount += iCodeSize;
+  while (ge.BitCount >= 8)
+  {
+    ge.Block[ge.BlockSize++] = (unsigned char) (ge.Bits & 0xff);
+    ge.Bits >>= 8;
+    ge.BitCount -= 8;
+    if (ge.BlockSize == 255)
+    {
+      fOut.put((char) 255);
+      fOut.write((const char *) ge.Block, 255);
+      ge.BlockSize = 0;
+    }
+  }
+}
+
+/** Writes the pixels \a pucPixels (palette indices) of an
+image with \a iCount pixels as LZW-compressed GIF data.
+*/
+void writeGifImageData(std::ostream &fOut, const unsigned char *pucPixels, int iCount)
+{
+  gif_encoder &ge = geGifEncoder;
+  const int ciClear = 256;
+  const int ciEnd = 257;
+  const int ciHashSize = 5003;
+
+  ge.Bits = 0;
+  ge.BitCount = 0;
+  ge.BlockSize = 0;
+  fOut.put((char) 8); // Minimum code size
+
+  int iCodeSize = 9;
+  int iNextCode = 258;
+  for (int h = 0; h < ciHashSize; h++)
+    ge.HashKey[h] = -1;
+  writeGifCode(fOut, ciClear, iCodeSize);
+
+  int iPrefix = (iCount > 0) ? pucPixels[0] : 0;
+  for (int i = 1; i < iCount; i++)
+  {
+    int c = pucPixels[i];
+    int iKey = (iPrefix << 8) | c;
+    int h = ((c << 4) ^ iPrefix) % ciHashSize;
+    bool bFound = false;
+    while (ge.HashKey[h] >= 0)
+    {
+      if (ge.HashKey[h] == iKey)
+      {
+        iPrefix = ge.HashCode[h];
+        bFound = true;
+        break;
+      }
+      h = (h + 1) % ciHashSize;
+    }
+    if (bFound)
+      continue;
+
+    writeGifCode(fOut, iPrefix, iCodeSize);
+    if (iNextCode < 4096)
+    {
+      ge.HashKey[h] = iKey;
+      ge.HashCode[h] = (short) iNextCode;
+      if (iNextCode == (1 << iCodeSize))
+        iCodeSize++;
+      iNextCode++;
+    }
+    else
+    {
+      // Table full, start over
+      writeGifCode(fOut, ciClear, iCodeSize);
+      for (h = 0; h < ciHashSize; h++)
+        ge.HashKey[h] = -1;
+      iCodeSize = 9;
+      iNextCode = 258;
+    }
+    iPrefix = c;
+  }
+  if (iCount > 0)
+    writeGifCode(fOut, iPrefix, iCodeSize);
+  writeGifCode(fOut, ciEnd, iCodeSize);
+  if (ge.BitCount > 0)
+    writeGifCode(fOut, 0, 8 - ge.BitCount);
+  if (ge.BlockSize > 0)
+  {
+    fOut.put((char) ge.BlockSize);
+    fOut.write((const char *) ge.Block, ge.BlockSize);
+  }
+  fOut.put((char) 0); // Block terminator
+}
+
+/** Writes a 16 bit value in little endian byte order. */
+void writeGifWord(std::ostream &fOut, int iValue)
+{
+  fOut.put((char) (iValue & 0xff));
+  fOut.put((char) ((iValue >> 8) & 0xff));
+}
+
+/** Writes the header of an animated GIF image with the size
+of the canvas and a gray palette to \a fOut.
+@param fOut The output file
+*/
+void writeGifHeader(std::ostream &fOut)
+{
+  fOut << "GIF89a";
+  writeGifWord(fOut, rcCanvas.Width);
+  writeGifWord(fOut, rcCanvas.Height);
+  fOut.put((char) 0xf7); // Global color table with 256 entries
+  fOut.put((char) 0);    // Background color
+  fOut.put((char) 0);    // Aspect ratio
+  for (int i = 0; i < 256; i++)
+  {
+    char c = (char) (i * 255 / 254);
+    if (i > 254)
+      c = (char) 255;
+    fOut.put(c); fOut.put(c); fOut.put(c);
+  }
+  // Loop forever
+  fOut.put((char) 0x21); fOut.put((char) 0xff); fOut.put((char) 11);
+  fOut << "NETSCAPE2.0";
+  fOut.put((char) 3); fOut.put((char) 1);
+  writeGifWord(fOut, 0);
+  fOut.put((char) 0);
+}
+
+/** Writes the last update of the canvas as frame of an
+animated GIF image to \a fOut. The first frame contains the
+complete image, the following ones only the rectangle around
+the changed squares, with all unchanged pixels transparent.
+@param fOut The output file
+@param iDelay Display time of the frame in 1/100 seconds
+*/
+void writeGifFrame(std::ostream &fOut, int iDelay)
+{
+  int iLeft = rcCanvas.ChangedLeft;
+  int iTop = rcCanvas.ChangedTop;
+  int iWidth = rcCanvas.ChangedRight - iLeft;
+  int iHeight = rcCanvas.ChangedBottom - iTop;
+  bool bComplete = (iLeft == 0) && (iTop == 0) &&
+                   (iWidth == rcCanvas.Width) && (iHeight == rcCanvas.Height);
+
+  // Was the whole canvas (including the frames) redrawn?
+  bool bAllChanged = true;
+  for (int i = 0; i < 64; i++)
+    bAllChanged = bAllChanged && rcCanvas.Changed[i];
+  if (bAllChanged)
+  {
+    iLeft = iTop = 0;
+    iWidth = rcCanvas.Width;
+    iHeight = rcCanvas.Height;
+    bComplete = true;
+  }
+  // Nothing changed at all?
+  if ((iWidth <= 0) || (iHeight <= 0))
+  {
+    iLeft = iTop = 0;
+    iWidth = iHeight = 1;
+  }
+
+  // Collect the palette indices
+  vector<unsigned char> &vIndices = rcCanvas.Indices;
+  vIndices.assign(iWidth*iHeight, ciGifTransparent);
+  for (int row = 0; row < iHeight; row++)
+  {
+    const unsigned char *pucSrc = &rcCanvas.Pixels[(iTop + row)*rcCanvas.Width + iLeft];
+    unsigned char *pucDest = &vIndices[row*iWidth];
+    if (bComplete)
+    {
+      for (int col = 0; col < iWidth; col++)
+        pucDest[col] = (unsigned char) (pucSrc[col] * 254 / 255);
+    }
+  }
+  if (!bComplete)
+  {
+    for (int i = 0; i < 64; i++)
+    {
+      if (rcCanvas.Changed[i] == false)
+        continue;
+      const glyph_placement &gp = rcCanvas.Squares[i];
+      int iSquareTop = max(gp.Y - rcCanvas.SquareHeight, 0);
+      int iSquareBottom = min(gp.Y + rcCanvas.SquareDepth, rcCanvas.Height);
+      int iSquareLeft = max(gp.X, 0);
+      int iSquareRight = min(gp.X + rcCanvas.SquareWidth, rcCanvas.Width);
+      for (int row = iSquareTop; row < iSquareBottom; row++)
+      {
+        for (int col = iSquareLeft; col < iSquareRight; col++)
+          vIndices[(row - iTop)*iWidth + col - iLeft] =
+            (unsigned char) (rcCanvas.Pixels[row*rcCanvas.Width + col] * 254 / 255);
+      }
+    }
+  }
+
+  // Graphic control extension: keep previous frame, transparency
+  fOut.put((char) 0x21); fOut.put((char) 0xf9); fOut.put((char) 4);
+  fOut.put((char) 0x05);
+  writeGifWord(fOut, iDelay);
+  fOut.put((char) ciGifTransparent);
+  fOut.put((char) 0);
+
+  // Image descriptor
+  fOut.put((char) 0x2c);
+  writeGifWord(fOut, iLeft);
+  writeGifWord(fOut, iTop);
+  writeGifWord(fOut, iWidth);
+  writeGifWord(fOut, iHeight);
+  fOut.put((char) 0);
+
+  writeGifImageData(fOut, &vIndices[0], iWidth*iHeight);
+}
+
+/** Writes the trailer of a GIF image to \a fOut.
+@param fOut The output file
+*/
+void writeGifTrailer(std::ostream &fOut)
+{
+  fOut.put((char) 0x3b);
+}
+
+/*-------------------------------------------------------------- Procset */
+
+/** Writes the procset resource ``sProcset'', that defines all
+symbols of the current font and the commands of the diagrams, to
+\a fOut.
+@param fOut The output file
+*/
+void writeProcset(std::ostream &fOut)
+{
+  fOut << "%!PS-Adobe-3.0 Resource-ProcSet" << endl;
+  fOut << "%%Title: " << sProcset << endl;
+  fOut << "%%Creator: fen2eps v1.0" << endl;
+  fOut << "%%Version: 1.0 0" << endl;
+  fOut << "%%BeginFen2epsFontInfo" << endl;
+  fOut << "%%F2E Name: " << fiFontInfo.FontName << endl;
+  fOut << "%%F2E Author: " << fiFontInfo.FontAuthor << endl;
+  fOut << "%%F2E Version: " << fiFontInfo.FontVersion << endl;
+  fOut << "%%F2E Date: " << fiFontInfo.FontDate << endl;
+  fOut << "%%EndFen2epsFontInfo" << endl;
+  fOut << "%%EndComments" << endl << endl;
+
+  fOut << "%%BeginResource: procset " << sProcset << " 1.0 0" << endl;
+  fOut << "/" << sProcset << " ";
+  fOut << (vFontSections.size() + vSharedSubpaths.size() + 2*ciPieces + 8);
+  fOut << " dict dup begin" << endl;
+  writeExportTexts(fOut, 0);
+  fOut << "end /ProcSet defineresource pop" << endl;
+  fOut << "%%EndResource" << endl;
+  fOut << "%%EOF" << endl;
+}
+
+/** Returns the name of the procset file, ``<sProcset>.ps'' in the
+directory of the diagrams.
+*/
+string procsetFileName()
+{
+  string::size_type iSlash = sPrefix.rfind('/');
+  if (iSlash == string::npos)
+    return sProcset + ".ps";
+  return sPrefix.substr(0, iSlash + 1) + sProcset + ".ps";
+}
+
+/** Writes the procset file for the diagrams of ``-p''.
+@return ``true'' if the file could be written, ``false'' else
+*/
+bool writeProcsetFile()
+{
+  obFileBuffer.Data.clear();
+  writeProcset(osFileStream);
+  return writeOutputFile(procsetFileName(), obFileBuffer.Data, false, 0);
+}
+
+/** Writes the commands that make the symbols of the procset
+available to the diagram, to \a fOut. The diagram gets a small
+dictionary of its own on top, for the variables of compact boards.
+@param fOut The output file
+*/
+void includeProcset(std::ostream &fOut)
+{
+  fOut << "%%IncludeResource: procset " << sProcset << " 1.0 0" << endl;
+  fOut << "/" << sProcset << " /ProcSet findresource begin 4 dict begin" << endl;
+}
+
+/** Embeds the procset of the file \a sResourceFile into the EPS
+files, whose names are read from ``stdin'', one per line. This
+replaces their ``%%IncludeResource'' comment with the resource, such
+that each file can be used on its own.
+@param sResourceFile Name of the procset file
+@return ``true'' if all files could be rewritten, ``false'' else
+*/
+bool embedProcset(const string &sResourceFile)
+{
+  // The resource, without the comments of the procset file
+  std::ifstream fResource(sResourceFile.c_str(), ios::in | ios::binary);
+  if (!fResource)
+  {
+    cerr << "Error: Could not open procset file " << sResourceFile << "!" << endl;
+    return false;
+  }
+  ostringstream sText;
+  sText << fResource.rdbuf();
+  string sResource = sText.str();
+  string::size_type iBegin = sResource.find("%%BeginResource: procset ");
+  string::size_type iEnd = sResource.find("%%EndResource\n");
+  if ((iBegin == string::npos) || (iEnd == string::npos) || (iEnd < iBegin))
+  {
+    cerr << "Error: No procset resource in " << sResourceFile << "!" << endl;
+    return false;
+  }
+  sResource = sResource.substr(iBegin, iEnd + 14 - iBegin);
+
+  // The EPS files
+  string sFile;
+  string sEps;
+  int iFiles = 0;
+  while (getline(cin, sFile))
+  {
+    if (sFile.size() == 0)
+      continue;
+    std::ifstream fEps(sFile.c_str(), ios::in | ios::binary);
+    if (!fEps)
+    {
+      cerr << "Error: Could not open EPS file " << sFile << "!" << endl;
+      return false;
+    }
+    sText.str("");
+    sText << fEps.rdbuf();
+    fEps.close();
+    sEps = sText.str();
+
+    // Replace the reference with the resource itself
+    string::size_type iInclude = sEps.find("%%IncludeResource: procset ");
+    string::size_type iNeeded = sEps.find("%%DocumentNeededResources: procset ");
+    if ((iInclude == string::npos) || (iNeeded == string::npos))
+    {
+      cerr << "Warning: " << sFile << " doesn't include a procset, skipped." << endl;
+      continue;
+    }
+    string::size_type iLineEnd = sEps.find('\n', iInclude);
+    if (iLineEnd == string::npos)
+      iLineEnd = sEps.size() - 1;
+    sEps.replace(iInclude, iLineEnd + 1 - iInclude, sResource);
+    sEps.replace(iNeeded, 26, "%%DocumentSuppliedResources:");
+    if (!writeOutputFile(sFile, sEps, false, 0))
+      return false;
+    iFiles++;
+  }
+  cerr << "Embedded the procset into " << iFiles << " files." << endl;
+  return true;
+}
+
+/*-------------------------------------------------------------- Preview */
+
+/** Number of bytes per line of the EPSI preview */
+const int ciEpsiBytes = 32;
+
+/** Compiles the EPSI preview section of the current raster image
+into sEpsiPreview, as 8 bit hex bitmap with 0 for white. Each row
+of the image starts a new line.
+*/
+void compileEpsiPreview()
+{
+  const char *pcHex = "0123456789ABCDEF";
+  int iLines = rcCanvas.Height * ((rcCanvas.Width + ciEpsiBytes - 1) / ciEpsiBytes);
+  char pcLine[2*ciEpsiBytes + 4];
+
+  sEpsiPreview.clear();
+  snprintf(pcLine, sizeof(pcLine), "%d %d 8 %d", rcCanvas.Width, rcCanvas.Height, iLines);
+  sEpsiPreview.append("%%BeginPreview: ");
+  sEpsiPreview.append(pcLine);
+  sEpsiPreview.append("\n");
+  for (int row = 0; row < rcCanvas.Height; row++)
+  {
+    const unsigned char *pucRow = &rcCanvas.Pixels[row*rcCanvas.Width];
+    for (int col = 0; col < rcCanvas.Width; col += ciEpsiBytes)
+    {
+      int iCount = min(ciEpsiBytes, rcCanvas.Width - col);
+      char *pcPos = pcLine;
+      *pcPos++ = '%';
+      *pcPos++ = ' ';
+      for (int i = 0; i < iCount; i++)
+      {
+        int c = 255 - pucRow[col + i];
+        *pcPos++ = pcHex[c >> 4];
+        *pcPos++ = pcHex[c & 15];
+      }
+      *pcPos++ = '\n';
+      sEpsiPreview.append(pcLine, pcPos - pcLine);
+    }
+  }
+  sEpsiPreview.append("%%EndPreview\n\n");
+}
+
+/** Writes the 32 bit value \a iValue to \a fOut, least
+significant byte first. */
+void writeLongLE(std::ostream &fOut, unsigned long iValue)
+{
+  writeGifWord(fOut, (int) (iValue & 0xffff));
+  writeGifWord(fOut, (int) ((iValue >> 16) & 0xffff));
+}
+
+/** Writes the TIFF entry \a iTag with the type \a iType (3 =
+short, 4 = long, 5 = rational) and the single value or offset
+\a iValue to \a fOut. */
+void writeTiffEntry(std::ostream &fOut, int iTag, int iType, unsigned long iValue)
+{
+  writeGifWord(fOut, iTag);
+  writeGifWord(fOut, iType);
+  writeLongLE(fOut, 1);
+  if (iType == 3)
+  {
+    writeGifWord(fOut, (int) iValue);
+    writeGifWord(fOut, 0);
+  }
+  else
+    writeLongLE(fOut, iValue);
+}
+
+/** Number of entries of the TIFF preview's directory */
+const int ciTiffEntries = 11;
+/** Size of the TIFF preview in front of the pixels, i.e. the
+header, the directory and the two resolutions */
+const int ciTiffHeader = 8 + 2 + 12*ciTiffEntries + 4 + 16;
+/** Size of the DOS EPS binary header */
+const int ciDosEpsHeader = 30;
+
+/** Writes the current raster image as uncompressed 8 bit gray
+TIFF image to \a fOut.
+@param fOut The output file
+*/
+void writeTiffPreview(std::ostream &fOut)
+{
+  unsigned long iPixels = rcCanvas.Pixels.size();
+  // Offset of the resolutions, behind the directory
+  unsigned long iResolution = 8 + 2 + 12*ciTiffEntries + 4;
+
+  fOut << "II";
+  writeGifWord(fOut, 42);
+  writeLongLE(fOut, 8);
+
+  // The directory, sorted by tags
+  writeGifWord(fOut, ciTiffEntries);
+  writeTiffEntry(fOut, 256, 4, rcCanvas.Width);       // ImageWidth
+  writeTiffEntry(fOut, 257, 4, rcCanvas.Height);      // ImageLength
+  writeTiffEntry(fOut, 258, 3, 8);                    // BitsPerSample
+  writeTiffEntry(fOut, 259, 3, 1);                    // No compression
+  writeTiffEntry(fOut, 262, 3, 1);                    // Black is zero
+  writeTiffEntry(fOut, 273, 4, ciTiffHeader);         // StripOffsets
+  writeTiffEntry(fOut, 278, 4, rcCanvas.Height);      // RowsPerStrip
+  writeTiffEntry(fOut, 279, 4, iPixels);              // StripByteCounts
+  writeTiffEntry(fOut, 282, 5, iResolution);          // XResolution
+  writeTiffEntry(fOut, 283, 5, iResolution + 8);      // YResolution
+  writeTiffEntry(fOut, 296, 3, 2);                    // Inches
+  writeLongLE(fOut, 0);
+
+  // Pixels per inch, as fraction with the denominator 7200
+  unsigned long iDpi = (unsigned long) floor(rcCanvas.PixelScale / fiFontInfo.ScaleFactor *
+                                             518400.0 + 0.5);
+  for (int i = 0; i < 2; i++)
+  {
+    writeLongLE(fOut, iDpi);
+    writeLongLE(fOut, 7200);
+  }
+
+  fOut.write((const char *) &rcCanvas.Pixels[0], iPixels);
+}
+
+/** Writes the EPS file with the Postscript code \a sEps and the
+current raster image as TIFF preview, behind a DOS EPS binary
+header, to \a fOut.
+@param fOut The output file
+@param sEps The Postscript code
+*/
+void writeDosEpsFile(std::ostream &fOut, const string &sEps)
+{
+  unsigned long iTiffSize = ciTiffHeader + rcCanvas.Pixels.size();
+
+  fOut.put((char) 0xc5); fOut.put((char) 0xd0);
+  fOut.put((char) 0xd3); fOut.put((char) 0xc6);
+  writeLongLE(fOut, ciDosEpsHeader);                  // Postscript
+  writeLongLE(fOut, sEps.size());
+  writeLongLE(fOut, 0);                               // No WMF
+  writeLongLE(fOut, 0);
+  writeLongLE(fOut, ciDosEpsHeader + sEps.size());    // TIFF
+  writeLongLE(fOut, iTiffSize);
+  writeGifWord(fOut, 0xffff);                         // No checksum
+
+  fOut.write(sEps.data(), sEps.size());
+  writeTiffPreview(fOut);
+}
+
+/** Buffer for the Postscript code of an EPS file with TIFF
+preview */
+output_buffer obPreviewBuffer;
+/** Stream that writes into obPreviewBuffer */
+std::ostream osPreviewStream(&obPreviewBuffer);
+
+/** Writes the current diagram as complete output file, i.e.
+as PGM image or as EPS file with header, symbols, board and
+trailer, to \a fOut.
+@param fOut The output file
+*/
+void writeDiagramFile(std::ostream &fOut)
+{
+  if (iOutputFormat == ofPgm)
+  {
+    // Update the image and write it
+    renderRasterDiagram();
+    writePgmImage(fOut);
+    return;
+  }
+
+  // Render the preview image
+  if (iPreview != pvNone)
+    renderRasterDiagram();
+  if (iPreview == pvEpsi)
+    compileEpsiPreview();
+
+  // The Postscript code precedes a TIFF preview, so it
+  // gets assembled first
+  std::ostream &fEps = (iPreview == pvTiff) ? osPreviewStream : fOut;
+  obPreviewBuffer.Data.clear();
+
+  // Write EPS header
+  writeEpsHeader(fEps);
+
+  // Export the pieces, or refer to the procset
+  if (sProcset.size() > 0)
+    includeProcset(fEps);
+  else
+    exportPieces(fEps);
+
+  // Write chess diagram
+  writeDiagram(fEps);
+  if (sProcset.size() > 0)
+    fEps << "end end" << endl;
+
+  // Write EPS trailer
+  writeEpsTrailer(fEps);
+
+  if (iPreview == pvTiff)
+    writeDosEpsFile(fOut, obPreviewBuffer.Data);
+}
+
+/** Returns an upper bound for the size of a file written by
+writeDiagramFile(), such that a buffer of this size never has
+to grow.
+*/
+string::size_type maxDiagramFileSize()
+{
+  // Room for the header, the trailer and the translations
+  string::size_type iSize = 4096 + sPrefix.size();
+
+  if (iOutputFormat == ofPgm)
+    return iSize + rcCanvas.Pixels.size();
+
+  // The preview, as hex lines or TIFF image
+  if (iPreview == pvEpsi)
+    iSize += 2*rcCanvas.Pixels.size() + 3*rcCanvas.Height*((rcCanvas.Width + ciEpsiBytes - 1) / ciEpsiBytes);
+  else if (iPreview == pvTiff)
+    iSize += ciDosEpsHeader + ciTiffHeader + rcCanvas.Pixels.size();
+
+  iSize += fiFontInfo.FontName.size() + fiFontInfo.FontAuthor.size() +
+           fiFontInfo.FontVersion.size() + fiFontInfo.FontDate.size();
+  for (vector<font_section>::const_iterator it = vFontSections.begin();
+       it != vFontSections.end(); ++it)
+    iSize += it->Name.size() + it->Body.size() + 16;
+  for (vector<string>::const_iterator it = vSharedSubpaths.begin();
+       it != vSharedSubpaths.end(); ++it)
+    iSize += it->size() + 24;
+  for (int i = 0; i < ciPieces; i++)
+    iSize += 2*plpLayeredPieces[i].Contour.size() + plpLayeredPieces[i].Inner.size() +
+             plpLayeredPieces[i].FillOp.size() + 512;
+  // The Type 3 font, with a glyph and a procedure for each symbol
+  if (bType3 == true)
+    iSize += 1024 + vFontSections.size() * 256;
+
+  return iSize + dtDiagram.Procedure.size() + dtDiagram.BufferSize;
+}
+
+/*--------------------------------------------------------------- Layers */
+
+/** Resolution for comparing a layered piece with the square
+symbols of the font, in pixels per square */
+const int ciLayerCheckSize = 64;
+/** Number of pixels, that may differ clearly between a layered
+piece and the square symbols of the font */
+const int ciLayerTolerance = 8;
+
+/** Returns the brightness of the pixel (\a x, \a y) of the tile
+\a gtTile, painted on white paper.
+*/
+int tileBrightness(const glyph_tile &gtTile, int x, int y)
+{
+  x -= gtTile.Left;
+  y -= gtTile.Top;
+  if ((x < 0) || (y < 0) || (x >= gtTile.Width) || (y >= gtTile.Height))
+    return 255;
+  int i = y*gtTile.Width + x;
+  return 255 - gtTile.Alpha[i] + gtTile.Value[i];
+}
+
+/** Checks whether the glyph outlines \a sA and \a sB look the
+same on a board square.
+@param sA The first outline
+@param sB The second outline
+@return ``true'' if the outlines look the same, ``false'' else
+*/
+bool sameGlyphs(const string &sA, const string &sB)
+{
+  double dScale = ciLayerCheckSize / fiFontInfo.SquareSize;
+  glyph_tile gtA, gtB;
+  renderGlyphBody(sA, dScale, gtA);
+  renderGlyphBody(sB, dScale, gtB);
+
+  int iDiffer = 0;
+  // Font coordinates point upwards, pixels downwards
+  for (int y = -ciLayerCheckSize; y < 0; y++)
+  {
+    for (int x = 0; x < ciLayerCheckSize; x++)
+    {
+      if (abs(tileBrightness(gtA, x, y) - tileBrightness(gtB, x, y)) > 64)
+        iDiffer++;
+    }
+  }
+
+  return (iDiffer <= ciLayerTolerance);
+}
+
+/** Checks whether the point \a ppPoint lies inside the closed
+polygon \a vPolygon.
+*/
+bool insidePolygon(const path_point &ppPoint, const vector<path_point> &vPolygon)
+{
+  bool bInside = false;
+  vector<path_point>::size_type j = vPolygon.size() - 1;
+  for (vector<path_point>::size_type i = 0; i < vPolygon.size(); j = i++)
+  {
+    const path_point &a = vPolygon[i];
+    const path_point &b = vPolygon[j];
+    if (((a.Y > ppPoint.Y) != (b.Y > ppPoint.Y)) &&
+        (ppPoint.X < (b.X - a.X) * (ppPoint.Y - a.Y) / (b.Y - a.Y) + a.X))
+      bInside = !bInside;
+  }
+  return bInside;
+}
+
+/** Splits the outline \a sBody of a piece on a white square
+into its outer contour and the remaining subpaths. Only simple
+outlines, i.e. a single filled path of absolute ``moveto'',
+``lineto'' and ``curveto'' commands, can be split.
+@param sBody The outline of the piece
+@param lpPiece The layered piece
+@return ``true'' if the outline could be split, ``false'' else
+*/
+bool splitPieceOutline(const string &sBody, layered_piece &lpPiece)
+{
+  vector<string> vTokens;
+  tokenizePostscript(sBody, vTokens);
+  vector<string>::size_type n = vTokens.size();
+  if ((n < 4) || (vTokens[0] != "gsave") || (vTokens[1] != "newpath") ||
+      ((vTokens[n-2] != "fill") && (vTokens[n-2] != "eofill")) ||
+      (vTokens[n-1] != "grestore"))
+    return false;
+
+  // Split the path into subpaths, one line per command
+  vector<string> vSubpaths;
+  string sLine;
+  for (vector<string>::size_type i = 2; i < n - 2; i++)
+  {
+    const string &t = vTokens[i];
+    char *pcEnd;
+    strtod(t.c_str(), &pcEnd);
+    if ((pcEnd != t.c_str()) && (*pcEnd == '\0'))
+    {
+      sLine += t + " ";
+      continue;
+    }
+    if (t == "moveto")
+      vSubpaths.push_back("");
+    else if ((t != "lineto") && (t != "curveto") && (t != "closepath"))
+      return false;
+    if (vSubpaths.empty())
+      return false;
+    vSubpaths.back() += sLine + t + "\n";
+    sLine = "";
+  }
+
+  // Flatten the subpaths
+  map<string, vector<string> > mProcs;
+  glyph_state gsState;
+  gsState.Current.X = gsState.Current.Y = 0.0;
+  gsState.Gray = 0.0;
+  vector<double> vStack;
+  vector<glyph_state> vSaved;
+  vector<glyph_fill> vFills;
+  interpretGlyph(vTokens, mProcs, gsState, vStack, vSaved, vFills,
+                 fiFontInfo.SquareSize / 256.0);
+  if ((vFills.size() != 1) || (vFills[0].Subpaths.size() != vSubpaths.size()))
+    return false;
+  const vector<vector<path_point> > &vPolygons = vFills[0].Subpaths;
+
+  // Subpaths that don't lie within another one form the outer contour
+  lpPiece.Contour = "";
+  lpPiece.Inner = "";
+  lpPiece.FillOp = vTokens[n-2];
+  for (vector<string>::size_type i = 0; i < vSubpaths.size(); i++)
+  {
+    int iDepth = 0;
+    for (vector<string>::size_type j = 0; j < vSubpaths.size(); j++)
+    {
+      if ((j != i) && insidePolygon(vPolygons[i][0], vPolygons[j]))
+        iDepth++;
+    }
+    if (iDepth == 0)
+      lpPiece.Contour += vSubpaths[i];
+    else
+      lpPiece.Inner += vSubpaths[i];
+  }
+
+  return (lpPiece.Contour.size() > 0);
+}
+
+/** Converts the current font for the layered font mode. Each
+piece gets separated from its square symbols, such that it can
+be drawn on top of the square background. The separated piece
+gets checked on the white square, where it has to look exactly
+like the symbol of the font, else the piece keeps its square
+symbols. On black squares the hatching of ``BS'' shows around the
+piece, which may be shifted slightly against the hatching of the
+font's symbols.
+
+Known difference: the ``*BS'' symbols of the shipped fonts were
+hatched separately from the plain ``BS'' square, so their hatching
+lines start at a different phase. A layered piece on a black
+square shows the phase of ``BS'' around it, which can't match the
+original symbol pixel by pixel. The black squares are therefore
+not checked here, and were only compared visually.
+*/
+void layerFont()
+{
+  const font_section *pfsBlack = findFontSection(0);
+  const font_section *pfsWhite = findFontSection(13);
+
+  for (int i = 0; i < ciPieces; i++)
+  {
+    layered_piece &lpPiece = plpLayeredPieces[i];
+    lpPiece.Layered = false;
+
+    const font_section *pfsPiece = findFontSection(14 + i);
+    if ((pfsBlack == 0) || (pfsPiece == 0) ||
+        (splitPieceOutline(pfsPiece->Body, lpPiece) == false))
+      continue;
+
+    // Check the piece on the white square only, the hatching of
+    // the black square symbols differs in its phase, see above
+    string sPiece = "gsave newpath " + lpPiece.Contour + "1 setgray fill grestore\n" +
+                    "gsave newpath " + lpPiece.Contour + lpPiece.Inner +
+                    lpPiece.FillOp + " grestore\n";
+    string sWhite = (pfsWhite == 0) ? string() : pfsWhite->Body;
+    if (sameGlyphs(sWhite + sPiece, pfsPiece->Body))
+      lpPiece.Layered = true;
+  }
+}
+
+/*-------------------------------------------------------------- Sharing */
+
+/** Maximum number of shared subpaths, such that their procedures
+still fit into the ``userdict'' of Level 1 interpreters */
+const int ciMaxSharedSubpaths = 100;
+
+/** Struct for a subpath within the outline of a symbol. */
+struct subpath_run
+{
+  /** Index of the font section */
+  int Section;
+  /** Offset of the subpath's first character in the outline */
+  string::size_type Start;
+  /** Offset behind the subpath's last character */
+  string::size_type End;
+  /** ID of the shared subpath */
+  int ID;
+  /** Sorts from the end of the outline to its start */
+  bool operator<(const subpath_run &sr) const
+  {
+    return Start > sr.Start;
+  }
+};
+
+/** Struct for a subpath that may be shared by several symbols. */
+struct subpath_candidate
+{
+  /** Text of the subpath, as found first */
+  string Text;
+  /** All occurrences of the subpath */
+  vector<subpath_run> Runs;
+  /** Number of bytes saved by sharing the subpath */
+  long Saving;
+};
+
+/** Returns ``true'' if the token \a sToken is a number, ``false'' else.
+*/
+bool isPostscriptNumber(const string &sToken)
+{
+  char *pcEnd;
+  strtod(sToken.c_str(), &pcEnd);
+  return ((pcEnd != sToken.c_str()) && (*pcEnd == '\0'));
+}
+
+/** Finds the subpaths in the outline of the font section
+\a iSection and adds them to \a mCandidates. A subpath runs from
+a ``moveto'' (with its operands) to the next ``closepath'', with only
+numbers and line or curve commands in between.
+@param iSection Index of the font section
+@param mCandidates The subpaths found so far, by their tokens
+*/
+void findSubpathRuns(int iSection, map<string, subpath_candidate> &mCandidates)
+{
+  const string &sBody = vFontSections[iSection].Body;
+  vector<string> vTokens;
+  vector<string::size_type> vOffsets;
+  tokenizePostscript(sBody, vTokens, &vOffsets);
+
+  vector<string>::size_type n = vTokens.size();
+  for (vector<string>::size_type i = 2; i < n; i++)
+  {
+    if ((vTokens[i] != "moveto") ||
+        !isPostscriptNumber(vTokens[i-2]) || !isPostscriptNumber(vTokens[i-1]))
+      continue;
+
+    vector<string>::size_type j = i + 1;
+    while ((j < n) &&
+           (isPostscriptNumber(vTokens[j]) ||
+            (vTokens[j] == "lineto") || (vTokens[j] == "curveto") ||
+            (vTokens[j] == "rlineto") || (vTokens[j] == "rcurveto")))
+      j++;
+    if ((j == n) || (vTokens[j] != "closepath"))
+      continue;
+
+    string sKey = vTokens[i-2];
+    for (vector<string>::size_type k = i - 1; k <= j; k++)
+      sKey += " " + vTokens[k];
+    subpath_run srRun;
+    srRun.Section = iSection;
+    srRun.Start = vOffsets[i-2];
+    srRun.End = vOffsets[j] + vTokens[j].size();
+    srRun.ID = -1;
+    subpath_candidate &scCandidate = mCandidates[sKey];
+    if (scCandidate.Runs.empty())
+      scCandidate.Text = sBody.substr(srRun.Start, srRun.End - srRun.Start);
+    scCandidate.Runs.push_back(srRun);
+    i = j;
+  }
+}
+
+/** Compares two subpath candidates by their savings, for sorting. */
+bool moreSaving(const subpath_candidate *pscA, const subpath_candidate *pscB)
+{
+  return pscA->Saving > pscB->Saving;
+}
+
+/** Returns the number of bytes, that the symbols of the current
+font need when all of them get exported.
+*/
+long symbolBytes()
+{
+  long iBytes = 0;
+  for (vector<font_section>::const_iterator it = vFontSections.begin();
+       it != vFontSections.end(); ++it)
+  {
+    if (it->ID >= 0)
+      iBytes += it->Name.size() + 15 + it->Body.size();
+  }
+  for (vector<string>::const_iterator it = vSharedSubpaths.begin();
+       it != vSharedSubpaths.end(); ++it)
+    iBytes += 16 + it->size();
+
+  return iBytes;
+}
+
+/** Finds the subpaths, that occur several times in the symbols
+of the current font, and replaces them by calls to shared
+procedures. The number of saved bytes gets reported to ``stderr'',
+if bShareReport is set.
+*/
+void shareSubpaths()
+{
+  long iBytesBefore = symbolBytes();
+
+  // Collect all subpaths
+  map<string, subpath_candidate> mCandidates;
+  for (vector<font_section>::size_type i = 0; i < vFontSections.size(); i++)
+  {
+    if (vFontSections[i].ID >= 0)
+      findSubpathRuns(i, mCandidates);
+  }
+
+  // Select the subpaths that save the most bytes
+  vector<subpath_candidate *> vSelected;
+  for (map<string, subpath_candidate>::iterator it = mCandidates.begin();
+       it != mCandidates.end(); ++it)
+  {
+    subpath_candidate &scCandidate = it->second;
+    if (scCandidate.Runs.size() < 2)
+      continue;
+    // Each occurrence gets replaced by a call like ``F2EP12'',
+    // the procedure gets defined once
+    long iText = scCandidate.Text.size();
+    scCandidate.Saving = scCandidate.Runs.size() * (iText - 6) - (iText + 16);
+    if (scCandidate.Saving > 0)
+      vSelected.push_back(&scCandidate);
+  }
+  sort(vSelected.begin(), vSelected.end(), moreSaving);
+  if ((int) vSelected.size() > ciMaxSharedSubpaths)
+    vSelected.resize(ciMaxSharedSubpaths);
+
+  // Replace the subpaths, from the end of each outline
+  vSharedSubpaths.clear();
+  vector<subpath_run> vRuns;
+  for (vector<subpath_candidate *>::size_type s = 0; s < vSelected.size(); s++)
+  {
+    vSharedSubpaths.push_back(vSelected[s]->Text);
+    for (vector<subpath_run>::iterator it = vSelected[s]->Runs.begin();
+         it != vSelected[s]->Runs.end(); ++it)
+    {
+      it->ID = s;
+      vRuns.push_back(*it);
+    }
+  }
+  sort(vRuns.begin(), vRuns.end());
+  for (vector<subpath_run>::iterator it = vRuns.begin(); it != vRuns.end(); ++it)
+  {
+    font_section &fsSection = vFontSections[it->Section];
+    ostringstream sCall;
+    sCall << "F2EP" << it->ID;
+    fsSection.Body.replace(it->Start, it->End - it->Start, sCall.str());
+    if (find(fsSection.Shared.begin(), fsSection.Shared.end(), it->ID) == fsSection.Shared.end())
+      fsSection.Shared.push_back(it->ID);
+  }
+
+  if (bShareReport == false)
+    return;
+  long iBytesAfter = symbolBytes();
+  cerr << fiFontInfo.FontName << ": " << vSharedSubpaths.size() << " shared subpaths, ";
+  cerr << (iBytesBefore - iBytesAfter) << " of " << iBytesBefore << " bytes saved" << endl;
+}
+
+/*--------------------------------------------------------------- Type 3 */
+
+/** Extends the bounding box \a pdBox (llx, lly, urx, ury) by the
+points of the outline \a sCode, which starts at the current point
+\a ppCurrent. Calls of shared subpaths get followed.
+@param sCode The outline
+@param pdBox The bounding box
+@param bEmpty Is ``true'' as long as the box has no points
+@param ppCurrent The current point
+@return ``false'' if the outline uses other operators than for
+constructing and filling paths, ``true'' else
+*/
+bool addOutlineBounds(const string &sCode, double *pdBox, bool &bEmpty,
+                      path_point &ppCurrent)
+{
+  vector<string> vTokens;
+  tokenizePostscript(sCode, vTokens);
+
+  // Operands of the next operator
+  double pdArgs[6];
+  int iArgs = 0;
+  // Start of the current subpath
+  path_point ppStart = ppCurrent;
+
+  for (vector<string>::const_iterator it = vTokens.begin(); it != vTokens.end(); ++it)
+  {
+    if (isPostscriptNumber(*it))
+    {
+      if (iArgs == 6)
+        return false;
+      pdArgs[iArgs++] = strtod(it->c_str(), 0);
+      continue;
+    }
+
+    // Number of operands and of points, and are they relative?
+    int iNeeded = 0;
+    bool bRelative = false;
+    if ((*it == "moveto") || (*it == "lineto"))
+      iNeeded = 2;
+    else if (*it == "curveto")
+      iNeeded = 6;
+    else if ((*it == "rmoveto") || (*it == "rlineto"))
+    {
+      iNeeded = 2;
+      bRelative = true;
+    }
+    else if (*it == "rcurveto")
+    {
+      iNeeded = 6;
+      bRelative = true;
+    }
+    else if (it->compare(0, 4, "F2EP") == 0)
+    {
+      // Call of a shared subpath
+      string::size_type iShared = atoi(it->c_str() + 4);
+      if ((iArgs != 0) || (iShared >= vSharedSubpaths.size()) ||
+          !addOutlineBounds(vSharedSubpaths[iShared], pdBox, bEmpty, ppCurrent))
+        return false;
+      continue;
+    }
+    else if (*it == "closepath")
+      ppCurrent = ppStart;
+    else if ((*it != "newpath") && (*it != "fill") && (*it != "eofill") &&
+             (*it != "gsave") && (*it != "grestore"))
+      return false;
+    if (iArgs != iNeeded)
+      return false;
+
+    path_point ppOrigin = ppCurrent;
+    for (int i = 0; i < iNeeded; i += 2)
+    {
+      ppCurrent.X = pdArgs[i];
+      ppCurrent.Y = pdArgs[i+1];
+      if (bRelative == true)
+      {
+        ppCurrent.X += ppOrigin.X;
+        ppCurrent.Y += ppOrigin.Y;
+      }
+      if (bEmpty || (ppCurrent.X < pdBox[0]))
+        pdBox[0] = ppCurrent.X;
+      if (bEmpty || (ppCurrent.Y < pdBox[1]))
+        pdBox[1] = ppCurrent.Y;
+      if (bEmpty || (ppCurrent.X > pdBox[2]))
+        pdBox[2] = ppCurrent.X;
+      if (bEmpty || (ppCurrent.Y > pdBox[3]))
+        pdBox[3] = ppCurrent.Y;
+      bEmpty = false;
+    }
+    if ((*it == "moveto") || (*it == "rmoveto"))
+      ppStart = ppCurrent;
+    iArgs = 0;
+  }
+
+  return (iArgs == 0);
+}
+
+/** Returns the start of the glyph procedure for the outline
+\a sOutline, i.e. the ``setcachedevice'' with its bounding box.
+The box contains all points of the outline, including the control
+points of the curves, so nothing gets clipped.
+@param sOutline The outline
+@return The start of the procedure, empty if the outline can't
+be a cached glyph
+*/
+string type3GlyphStart(const string &sOutline)
+{
+  double pdBox[4] = { 0.0, 0.0, 0.0, 0.0 };
+  bool bEmpty = true;
+  path_point ppCurrent = { 0.0, 0.0 };
+  if (!addOutlineBounds(sOutline, pdBox, bEmpty, ppCurrent))
+    return "";
+
+  // Round outwards, with a margin for the anti-aliasing
+  ostringstream sStart;
+  sStart << "0 0 ";
+  if (bEmpty == true)
+    sStart << "0 0 0 0";
+  else
+  {
+    sStart << (floor(pdBox[0]) - 1) << " " << (floor(pdBox[1]) - 1) << " ";
+    sStart << (ceil(pdBox[2]) + 1) << " " << (ceil(pdBox[3]) + 1);
+  }
+  sStart << " setcachedevice";
+  return sStart.str();
+}
+
+/** Adds the string \a s to the FNV-1a hash \a llHash. */
+void hashType3Glyph(unsigned long long &llHash, const string &s)
+{
+  for (string::size_type i = 0; i < s.size(); i++)
+  {
+    llHash ^= (unsigned char) s[i];
+    llHash *= 1099511628211ull;
+  }
+  // Separator
+  llHash ^= 0xff;
+  llHash *= 1099511628211ull;
+}
+
+/** Prepares the symbols of the current font, and the layered
+pieces, as glyphs of a Type 3 font (see exportType3Glyphs()).
+Symbols that don't consist of filled paths only stay plain
+procedures. The font gets a unique ID from the hash of all
+glyphs.
+*/
+void compileType3Glyphs()
+{
+  unsigned long long llHash = 14695981039346656037ull;
+  int iGlyphs = 0;
+
+  for (vector<font_section>::iterator it = vFontSections.begin();
+       it != vFontSections.end(); ++it)
+  {
+    if (it->ID < 0)
+      continue;
+    it->Glyph = type3GlyphStart(it->Body);
+    if (!it->Glyph.empty())
+      iGlyphs++;
+    hashType3Glyph(llHash, it->Name);
+    hashType3Glyph(llHash, it->Glyph);
+    hashType3Glyph(llHash, it->Body);
+  }
+
+  for (int i = 0; i < ciPieces; i++)
+  {
+    layered_piece &lp = plpLayeredPieces[i];
+    if (lp.Layered == false)
+      continue;
+    lp.ContourGlyph = type3GlyphStart(lp.Contour);
+    lp.PieceGlyph = type3GlyphStart(lp.Contour + lp.Inner);
+    if (lp.ContourGlyph.empty() || lp.PieceGlyph.empty())
+    {
+      lp.ContourGlyph = "";
+      lp.PieceGlyph = "";
+    }
+    else
+      iGlyphs++;
+    hashType3Glyph(llHash, lp.ContourGlyph);
+    hashType3Glyph(llHash, lp.Contour);
+    hashType3Glyph(llHash, lp.Inner);
+    hashType3Glyph(llHash, lp.FillOp);
+  }
+
+  for (vector<string>::const_iterator it = vSharedSubpaths.begin();
+       it != vSharedSubpaths.end(); ++it)
+    hashType3Glyph(llHash, *it);
+
+  // XUID elements are positive integers
+  piType3Xuid[0] = (unsigned int) (llHash >> 33);
+  piType3Xuid[1] = (unsigned int) (llHash & 0x7fffffff);
+
+  if (iGlyphs == 0)
+    cerr << "Warning: The symbols of " << fiFontInfo.FontName
+         << " can't be cached as Type 3 font!" << endl;
+}
+
+/*------------------------------------------------------- Level of detail */
+
+/** Maximum number of path segments, that get merged into one */
+const int ciLodMaxRun = 8;
+/** Number of points per curve, for measuring the error */
+const int ciLodCurvePoints = 8;
+
+/** Struct for a segment of a path, as ``lineto'' or ``curveto''. */
+struct lod_segment
+{
+  /** Is ``true'' for a curve, ``false'' for a line */
+  bool Curve;
+  /** Control points of a curve and the end point (in P[2]) */
+  path_point P[3];
+};
+
+/** Tolerance for simplifying the outlines, in points, 0.0 if
+they are used as they are */
+double dLodTolerance = 0.0;
+/** Simplified subpaths for the tolerance dLodCacheTolerance, by
+the text of their original subpath */
+map<string, string> mLodCache;
+/** Tolerance of the cached subpaths, in font units */
+double dLodCacheTolerance = 0.0;
+
+/** Returns the point at the parameter \a t of the cubic Bezier
+curve from \a p0 via \a p1 and \a p2 to \a p3.
+*/
+path_point bezierPoint(const path_point &p0, const path_point &p1,
+                       const path_point &p2, const path_point &p3, double t)
+{
+  double s = 1.0 - t;
+  path_point ppPoint;
+  ppPoint.X = s*s*s*p0.X + 3*s*s*t*p1.X + 3*s*t*t*p2.X + t*t*t*p3.X;
+  ppPoint.Y = s*s*s*p0.Y + 3*s*s*t*p1.Y + 3*s*t*t*p2.Y + t*t*t*p3.Y;
+  return ppPoint;
+}
+
+/** Adds the points of the segment \a lsSegment, which starts at
+\a ppStart, to the polyline \a vPoints. Curves get approximated by
+\a iPoints points.
+*/
+void flattenSegment(path_point ppStart, const lod_segment &lsSegment,
+                    int iPoints, vector<path_point> &vPoints)
+{
+  if (lsSegment.Curve == true)
+  {
+    for (int i = 1; i < iPoints; i++)
+      vPoints.push_back(bezierPoint(ppStart, lsSegment.P[0], lsSegment.P[1],
+                                    lsSegment.P[2], (double) i / iPoints));
+  }
+  vPoints.push_back(lsSegment.P[2]);
+}
+
+/** Returns the distance of the point \a p from the line segment
+from \a a to \a b.
+*/
+double segmentDistance(const path_point &p, const path_point &a, const path_point &b)
+{
+  double dx = b.X - a.X;
+  double dy = b.Y - a.Y;
+  double dLength = dx*dx + dy*dy;
+  double t = 0.0;
+  if (dLength > 0.0)
+    t = max(0.0, min(1.0, ((p.X - a.X)*dx + (p.Y - a.Y)*dy) / dLength));
+  return hypot(p.X - a.X - t*dx, p.Y - a.Y - t*dy);
+}
+
+/** Checks whether every point of the polyline \a vA lies within
+the distance \a dTolerance of the polyline \a vB.
+*/
+bool withinTolerance(const vector<path_point> &vA, const vector<path_point> &vB,
+                     double dTolerance)
+{
+  for (vector<path_point>::size_type i = 0; i < vA.size(); i++)
+  {
+    bool bNear = false;
+    for (vector<path_point>::size_type j = 1; (j < vB.size()) && !bNear; j++)
+      bNear = (segmentDistance(vA[i], vB[j-1], vB[j]) <= dTolerance);
+    if (bNear == false)
+      return false;
+  }
+  return true;
+}
+
+/** Returns the unit vector from \a a towards \a b, or (0, 0) if
+the points are the same.
+*/
+path_point unitVector(const path_point &a, const path_point &b)
+{
+  path_point ppUnit;
+  double dLength = hypot(b.X - a.X, b.Y - a.Y);
+  ppUnit.X = (dLength > 0.0) ? (b.X - a.X) / dLength : 0.0;
+  ppUnit.Y = (dLength > 0.0) ? (b.Y - a.Y) / dLength : 0.0;
+  return ppUnit;
+}
+
+/** Rounds \a d to \a iDecimals decimal places. */
+double roundLodNumber(double d, int iDecimals)
+{
+  double dFactor = pow(10.0, iDecimals);
+  return floor(d * dFactor + 0.5) / dFactor;
+}
+
+/** Returns \a d as Postscript number with at most \a iDecimals
+decimal places, without trailing zeros.
+*/
+string formatLodNumber(double d, int iDecimals)
+{
+  char pcNumber[32];
+  snprintf(pcNumber, sizeof(pcNumber), "%.*f", iDecimals, d);
+  string sNumber(pcNumber);
+  if (sNumber.find('.') != string::npos)
+  {
+    sNumber.erase(sNumber.find_last_not_of('0') + 1);
+    if (sNumber[sNumber.size() - 1] == '.')
+      sNumber.erase(sNumber.size() - 1);
+  }
+  if (sNumber == "-0")
+    sNumber = "0";
+  return sNumber;
+}
+
+/** Tries to replace the segments \a iFirst to \a iEnd - 1 of the
+subpath \a vSegments, which starts at \a ppStart, by a single line
+or curve, that deviates at most \a dTolerance from them. The curve
+keeps the directions at both ends, its inner control points get
+fitted to the original points by least squares (as in Schneider's
+algorithm) and rounded to \a iDecimals decimal places.
+@return ``true'' if the segments could be replaced, with the new
+segment in \a lsMerged, ``false'' else
+*/
+bool mergeLodSegments(const path_point &ppStart, const vector<lod_segment> &vSegments,
+                      int iFirst, int iEnd, double dTolerance, int iDecimals,
+                      lod_segment &lsMerged)
+{
+  // The original points
+  vector<path_point> vOriginal(1, ppStart);
+  for (int i = iFirst; i < iEnd; i++)
+    flattenSegment(vOriginal.back(), vSegments[i], ciLodCurvePoints, vOriginal);
+  const path_point &p0 = vOriginal.front();
+  const path_point &p3 = vOriginal.back();
+
+  lsMerged.P[2] = p3;
+
+  // A straight line?
+  vector<path_point> vMerged;
+  vMerged.push_back(p0);
+  vMerged.push_back(p3);
+  lsMerged.Curve = false;
+  if (withinTolerance(vOriginal, vMerged, dTolerance))
+    return true;
+
+  // Directions at both ends, from the first and last points that
+  // differ from the end points
+  path_point t1 = { 0.0, 0.0 };
+  path_point t2 = { 0.0, 0.0 };
+  vector<path_point>::size_type i;
+  for (i = 1; (i < vOriginal.size()) && (t1.X == 0.0) && (t1.Y == 0.0); i++)
+    t1 = unitVector(p0, vOriginal[i]);
+  for (i = vOriginal.size() - 1; (i > 0) && (t2.X == 0.0) && (t2.Y == 0.0); i--)
+    t2 = unitVector(p3, vOriginal[i - 1]);
+  if (vSegments[iFirst].Curve == true)
+  {
+    path_point t = unitVector(p0, vSegments[iFirst].P[0]);
+    if ((t.X != 0.0) || (t.Y != 0.0))
+      t1 = t;
+  }
+  if (vSegments[iEnd - 1].Curve == true)
+  {
+    path_point t = unitVector(p3, vSegments[iEnd - 1].P[1]);
+    if ((t.X != 0.0) || (t.Y != 0.0))
+      t2 = t;
+  }
+
+  // Parameters of the original points, by their chord length
+  vector<double> vParams(vOriginal.size(), 0.0);
+  for (i = 1; i < vOriginal.size(); i++)
+    vParams[i] = vParams[i-1] + hypot(vOriginal[i].X - vOriginal[i-1].X,
+                                      vOriginal[i].Y - vOriginal[i-1].Y);
+  double dLength = vParams.back();
+  if (dLength <= 0.0)
+    return false;
+
+  // Least squares fit of the distances of the control points
+  double c00 = 0.0, c01 = 0.0, c11 = 0.0, x0 = 0.0, x1 = 0.0;
+  for (i = 0; i < vOriginal.size(); i++)
+  {
+    double u = vParams[i] / dLength;
+    double s = 1.0 - u;
+    double b0 = s*s*s, b1 = 3*s*s*u, b2 = 3*s*u*u, b3 = u*u*u;
+    path_point a1 = { t1.X*b1, t1.Y*b1 };
+    path_point a2 = { t2.X*b2, t2.Y*b2 };
+    double dx = vOriginal[i].X - (p0.X*(b0 + b1) + p3.X*(b2 + b3));
+    double dy = vOriginal[i].Y - (p0.Y*(b0 + b1) + p3.Y*(b2 + b3));
+    c00 += a1.X*a1.X + a1.Y*a1.Y;
+    c01 += a1.X*a2.X + a1.Y*a2.Y;
+    c11 += a2.X*a2.X + a2.Y*a2.Y;
+    x0 += a1.X*dx + a1.Y*dy;
+    x1 += a2.X*dx + a2.Y*dy;
+  }
+  double dChord = hypot(p3.X - p0.X, p3.Y - p0.Y);
+  double dDet = c00*c11 - c01*c01;
+  double dAlpha1 = dChord / 3.0;
+  double dAlpha2 = dChord / 3.0;
+  if (fabs(dDet) > 1e-12)
+  {
+    dAlpha1 = (x0*c11 - x1*c01) / dDet;
+    dAlpha2 = (c00*x1 - c01*x0) / dDet;
+  }
+  if ((dAlpha1 <= 0.0) || (dAlpha2 <= 0.0))
+    return false;
+
+  lsMerged.Curve = true;
+  lsMerged.P[0].X = roundLodNumber(p0.X + t1.X*dAlpha1, iDecimals);
+  lsMerged.P[0].Y = roundLodNumber(p0.Y + t1.Y*dAlpha1, iDecimals);
+  lsMerged.P[1].X = roundLodNumber(p3.X + t2.X*dAlpha2, iDecimals);
+  lsMerged.P[1].Y = roundLodNumber(p3.Y + t2.Y*dAlpha2, iDecimals);
+
+  // Check the deviation in both directions
+  vMerged.resize(1);
+  flattenSegment(p0, lsMerged, 2*ciLodCurvePoints, vMerged);
+  return (withinTolerance(vOriginal, vMerged, dTolerance) &&
+          withinTolerance(vMerged, vOriginal, dTolerance));
+}
+
+/** Simplifies the subpath \a vSegments, which starts at \a ppStart,
+by merging runs of segments into single lines or curves.
+@return Text of the simplified segments
+*/
+string simplifyLodSubpath(const path_point &ppStart, const vector<lod_segment> &vSegments,
+                          double dTolerance, int iDecimals)
+{
+  string sText;
+  path_point ppCurrent = ppStart;
+  int n = (int) vSegments.size();
+  lod_segment lsMerged, lsBest;
+
+  for (int i = 0; i < n; )
+  {
+    // Find the longest run, that can be merged
+    int iBest = i + 1;
+    lsBest = vSegments[i];
+    for (int j = i + 1; (j <= n) && (j - i <= ciLodMaxRun); j++)
+    {
+      // A single line stays as it is
+      if ((j == i + 1) && (vSegments[i].Curve == false))
+        continue;
+      if (!mergeLodSegments(ppCurrent, vSegments, i, j, dTolerance, iDecimals, lsMerged))
+      {
+        if (j > i + 1)
+          break;
+        continue;
+      }
+      iBest = j;
+      lsBest = lsMerged;
+    }
+
+    sText += "\n";
+    for (int k = (lsBest.Curve == true) ? 0 : 2; k < 3; k++)
+      sText += formatLodNumber(lsBest.P[k].X, iDecimals) + " " +
+               formatLodNumber(lsBest.P[k].Y, iDecimals) + " ";
+    sText += (lsBest.Curve == true) ? "curveto" : "lineto";
+    ppCurrent = lsBest.P[2];
+    i = iBest;
+  }
+
+  return sText;
+}
+
+/** Simplifies the outline \a sBody of a symbol for the tolerance
+dLodTolerance. Each subpath of absolute ``moveto'', ``lineto'' and
+``curveto'' commands gets simplified, with its coordinates rounded
+as far as the tolerance allows, all other code stays as it is. A
+subpath keeps its original text, if the simplified one isn't
+shorter. The subpaths are cached, such that the same outline (e.g.
+of a piece on both square colors) gets simplified the same way.
+@param sBody The outline
+@param iSegments Gets increased by the number of segments
+@param iSimplified Gets increased by the number of segments left
+*/
+void simplifyOutline(string &sBody, long &iSegments, long &iSimplified)
+{
+  // Tolerance and number of decimal places in font units
+  double dTolerance = dLodTolerance / fiFontInfo.ScaleFactor;
+  int iDecimals = 0;
+  while ((iDecimals < 4) && (pow(10.0, -iDecimals) > dTolerance / 4.0))
+    iDecimals++;
+  // Rounding moves each point by at most this much, the rest of
+  // the tolerance (with a margin for measuring the deviation
+  // on flattened curves) is left for merging the segments
+  double dRounding = 0.5 * pow(10.0, -iDecimals) * sqrt(2.0);
+  double dMerge = 0.9 * dTolerance - dRounding;
+  if (dMerge <= 0.0)
+    return;
+
+  vector<string> vTokens;
+  vector<string::size_type> vOffsets;
+  tokenizePostscript(sBody, vTokens, &vOffsets);
+
+  // The subpaths, replaced from the end of the outline
+  vector<string::size_type> vStarts, vEnds;
+  vector<string> vTexts;
+  vector<string>::size_type n = vTokens.size();
+  for (vector<string>::size_type i = 2; i < n; i++)
+  {
+    if ((vTokens[i] != "moveto") ||
+        !isPostscriptNumber(vTokens[i-2]) || !isPostscriptNumber(vTokens[i-1]))
+      continue;
+
+    vector<string>::size_type iMove = i;
+    path_point ppStart;
+    ppStart.X = strtod(vTokens[i-2].c_str(), 0);
+    ppStart.Y = strtod(vTokens[i-1].c_str(), 0);
+    path_point ppCurrent = ppStart;
+    vector<lod_segment> vSegments;
+    vector<string>::size_type j = i + 1;
+    vector<string>::size_type iEnd = i;
+    while (true)
+    {
+      int iArgs = 0;
+      while ((j + iArgs < n) && (iArgs < 6) && isPostscriptNumber(vTokens[j + iArgs]))
+        iArgs++;
+      if (j + iArgs == n)
+        break;
+      const string &sOp = vTokens[j + iArgs];
+      lod_segment lsSegment;
+      if ((sOp == "lineto") && (iArgs == 2))
+        lsSegment.Curve = false;
+      else if ((sOp == "curveto") && (iArgs == 6))
+        lsSegment.Curve = true;
+      else
+        break;
+      for (int k = 0; k < iArgs/2; k++)
+      {
+        int p = (lsSegment.Curve == true) ? k : 2;
+        lsSegment.P[p].X = strtod(vTokens[j + 2*k].c_str(), 0);
+        lsSegment.P[p].Y = strtod(vTokens[j + 2*k + 1].c_str(), 0);
+      }
+      if (lsSegment.Curve == false)
+        lsSegment.P[0] = lsSegment.P[1] = ppCurrent;
+      ppCurrent = lsSegment.P[2];
+      vSegments.push_back(lsSegment);
+      iEnd = j + iArgs;
+      j = iEnd + 1;
+    }
+    i = iEnd;
+    if (vSegments.empty())
+      continue;
+
+    iSegments += vSegments.size();
+    // The subpath, from the ``moveto'' to its last segment
+    string::size_type iStart = vOffsets[iMove - 2];
+    string::size_type iStop = vOffsets[iEnd] + vTokens[iEnd].size();
+    string sOriginal = sBody.substr(iStart, iStop - iStart);
+
+    map<string, string>::iterator it = mLodCache.find(sOriginal);
+    if (it == mLodCache.end())
+    {
+      string sSimplified = formatLodNumber(ppStart.X, iDecimals) + " " +
+                           formatLodNumber(ppStart.Y, iDecimals) + " moveto" +
+                           simplifyLodSubpath(ppStart, vSegments, dMerge, iDecimals);
+      // Keep the original, if the simplified text isn't shorter
+      if (sSimplified.size() >= sOriginal.size())
+        sSimplified = sOriginal;
+      it = mLodCache.insert(make_pair(sOriginal, sSimplified)).first;
+    }
+    if (it->second == sOriginal)
+    {
+      iSimplified += vSegments.size();
+      continue;
+    }
+    iSimplified += count(it->second.begin(), it->second.end(), '\n');
+    vStarts.push_back(iStart);
+    vEnds.push_back(iStop);
+    vTexts.push_back(it->second);
+  }
+
+  for (vector<string>::size_type k = vTexts.size(); k > 0; k--)
+    sBody.replace(vStarts[k-1], vEnds[k-1] - vStarts[k-1], vTexts[k-1]);
+}
+
+/** Simplifies the outlines of all symbols of the current font for
+the tolerance dLodTolerance (see simplifyOutline()) and reports the
+reduction of segments and bytes to ``stderr''.
+*/
+void simplifyFont()
+{
+  // The cache is only valid for the same tolerance in font units
+  if (dLodCacheTolerance != dLodTolerance / fiFontInfo.ScaleFactor)
+  {
+    mLodCache.clear();
+    dLodCacheTolerance = dLodTolerance / fiFontInfo.ScaleFactor;
+  }
+
+  long iBytesBefore = symbolBytes();
+  long iSegments = 0;
+  long iSimplified = 0;
+  for (vector<font_section>::iterator it = vFontSections.begin();
+       it != vFontSections.end(); ++it)
+  {
+    if (it->ID >= 0)
+      simplifyOutline(it->Body, iSegments, iSimplified);
+  }
+
+  long iBytesAfter = symbolBytes();
+  cerr << fiFontInfo.FontName << ": " << iSimplified << " of " << iSegments;
+  cerr << " path segments and " << iBytesAfter << " of " << iBytesBefore;
+  cerr << " bytes left for a tolerance of " << dLodTolerance << " pt" << endl;
+}
+
+/*---------------------------------------------------------------- Input */
+
+/** Formats of the input, detected by their magic bytes */
+const int ifPlain = 0;
+const int ifGzip = 1;
+const int ifZstd = 2;
+
+/** Size of a block of decoded input */
+const size_t ciInputBlockSize = 1 << 20;
+/** Number of input blocks, the decoder runs at most this many
+blocks ahead of the rendering */
+const int ciInputBlocks = 4;
+
+/** A block of decoded input */
+struct input_block
+{
+  /** The decoded bytes */
+  char *Data;
+  /** Number of valid bytes in Data */
+  size_t Size;
+};
+
+/** State of the input reader, the decoder thread fills the
+blocks and the main loop takes its lines from them */
+struct input_reader
+{
+  /** Protects the queues, Done and Error */
+  mutex Lock;
+  /** Signals a filled block or the end of the input */
+  condition_variable Filled;
+  /** Signals a block that may get filled again */
+  condition_variable Drained;
+  /** The filled blocks, in input order */
+  deque<input_block *> Full;
+  /** The blocks that may get filled */
+  deque<input_block *> Free;
+  /** Is ``true'' when the decoder has reached the end of the input */
+  bool Done;
+  /** Error message of the decoder, empty if there was no error */
+  string Error;
+  /** Is ``true'' when the main loop needs no more input */
+  atomic<bool> Stop;
+#ifndef _WIN32
+  /** Pipe that wakes the decoder up when Stop gets set, while it
+  waits for more input */
+  int Wakeup[2];
+#endif
+  /** The decoder thread */
+  thread Decoder;
+  /** The block that the lines get taken from currently */
+  input_block *Current;
+  /** Offset of the next line in the Current block */
+  size_t Pos;
+  /** Start of a line that continues in the next block */
+  string Carry;
+} irInput;
+
+/** Returns the format of the input that starts with the \a iSize
+bytes at \a pcData.
+*/
+int inputFormat(const char *pcData, size_t iSize)
+{
+  const unsigned char *pcBytes = (const unsigned char *) pcData;
+  if ((iSize >= 2) && (pcBytes[0] == 0x1f) && (pcBytes[1] == 0x8b))
+    return ifGzip;
+  if ((iSize >= 4) && (pcBytes[0] == 0x28) && (pcBytes[1] == 0xb5) &&
+      (pcBytes[2] == 0x2f) && (pcBytes[3] == 0xfd))
+    return ifZstd;
+  return ifPlain;
+}
+
+/** Returns the next free input block, waits until the main loop
+has drained one.
+*/
+input_block *freeInputBlock()
+{
+  unique_lock<mutex> lock(irInput.Lock);
+  while (irInput.Free.empty())
+    irInput.Drained.wait(lock);
+  input_block *pibBlock = irInput.Free.front();
+  irInput.Free.pop_front();
+  return pibBlock;
+}
+
+/** Hands the filled block \a pibBlock over to the main loop.
+*/
+void queueInputBlock(input_block *pibBlock)
+{
+  {
+    unique_lock<mutex> lock(irInput.Lock);
+    irInput.Full.push_back(pibBlock);
+  }
+  irInput.Filled.notify_one();
+}
+
+/** Appends the next bytes of ``stdin'' to the block \a pibBlock,
+returns as soon as some bytes are available.
+@return ``false'' at the end of the input, ``true'' else
+*/
+bool readInputBlock(input_block *pibBlock)
+{
+  if (irInput.Stop == true)
+    return false;
+#ifdef _WIN32
+  long long iRead = fread(pibBlock->Data + pibBlock->Size, 1,
+                          ciInputBlockSize - pibBlock->Size, stdin);
+#else
+  // Don't block on a pipe, that never gets closed by its writer,
+  // when the main loop needs no more input
+  struct pollfd pfd[2];
+  pfd[0].fd = fileno(stdin);
+  pfd[0].events = POLLIN;
+  pfd[1].fd = irInput.Wakeup[0];
+  pfd[1].events = POLLIN;
+  while (poll(pfd, 2, -1) < 0)
+  {
+    if (errno != EINTR)
+      return false;
+  }
+  if ((pfd[1].revents != 0) || (irInput.Stop == true))
+    return false;
+  long long iRead = read(fileno(stdin), pibBlock->Data + pibBlock->Size,
+                         ciInputBlockSize - pibBlock->Size);
+#endif
+  if (iRead <= 0)
+    return false;
+  pibBlock->Size += iRead;
+  return true;
+}
+
+#ifdef F2E_HAVE_ZLIB
+/** Decompresses the gzip input, that starts with the raw bytes
+in \a pibRaw, into the input blocks. Concatenated gzip members
+are decompressed one after the other.
+@return ``true'' if the input could be decompressed, ``false'' else
+*/
+bool inflateInput(input_block *pibRaw)
+{
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 15 + 16) != Z_OK)
+    return false;
+
+  bool bMore = true;
+  bool bOk = true;
+  input_block *pibBlock = freeInputBlock();
+  zs.next_in = (Bytef *) pibRaw->Data;
+  zs.avail_in = pibRaw->Size;
+  while (bOk == true)
+  {
+    if ((zs.avail_in == 0) && (bMore == true))
+    {
+      // Hand the data over before waiting for more input
+      if (pibBlock->Size > 0)
+      {
+        queueInputBlock(pibBlock);
+        pibBlock = freeInputBlock();
+      }
+      pibRaw->Size = 0;
+      bMore = readInputBlock(pibRaw);
+      zs.next_in = (Bytef *) pibRaw->Data;
+      zs.avail_in = pibRaw->Size;
+    }
+    if ((zs.avail_in == 0) && (bMore == false))
+      break;
+
+    zs.next_out = (Bytef *) pibBlock->Data + pibBlock->Size;
+    zs.avail_out = ciInputBlockSize - pibBlock->Size;
+    int iResult = inflate(&zs, Z_NO_FLUSH);
+    pibBlock->Size = ciInputBlockSize - zs.avail_out;
+    if (iResult == Z_STREAM_END)
+    {
+      // Continue with the next member, if any
+      inflateReset(&zs);
+    }
+    else if ((iResult != Z_OK) && (iResult != Z_BUF_ERROR))
+      bOk = false;
+
+    if (pibBlock->Size == ciInputBlockSize)
+    {
+      queueInputBlock(pibBlock);
+      pibBlock = freeInputBlock();
+    }
+  }
+  // A member that is cut off counts as error, too
+  if ((bOk == true) && (zs.total_in != 0))
+    bOk = false;
+  inflateEnd(&zs);
+  queueInputBlock(pibBlock);
+  return bOk;
+}
+#endif
+
+#ifdef F2E_HAVE_ZSTD
+/** Decompresses the zstd input, that starts with the raw bytes
+in \a pibRaw, into the input blocks.
+@return ``true'' if the input could be decompressed, ``false'' else
+*/
+bool unzstdInput(input_block *pibRaw)
+{
+  ZSTD_DStream *pzsStream = ZSTD_createDStream();
+  if (pzsStream == 0)
+    return false;
+  ZSTD_initDStream(pzsStream);
+
+  bool bMore = true;
+  bool bOk = true;
+  size_t iHint = 1;
+  input_block *pibBlock = freeInputBlock();
+  ZSTD_inBuffer zsIn = { pibRaw->Data, pibRaw->Size, 0 };
+  while (bOk == true)
+  {
+    if ((zsIn.pos == zsIn.size) && (bMore == true))
+    {
+      // Hand the data over before waiting for more input
+      if (pibBlock->Size > 0)
+      {
+        queueInputBlock(pibBlock);
+        pibBlock = freeInputBlock();
+      }
+      pibRaw->Size = 0;
+      bMore = readInputBlock(pibRaw);
+      zsIn.size = pibRaw->Size;
+      zsIn.pos = 0;
+    }
+    if ((zsIn.pos == zsIn.size) && (bMore == false))
+      break;
+
+    ZSTD_outBuffer zsOut = { pibBlock->Data, ciInputBlockSize, pibBlock->Size };
+    iHint = ZSTD_decompressStream(pzsStream, &zsOut, &zsIn);
+    pibBlock->Size = zsOut.pos;
+    if (ZSTD_isError(iHint))
+      bOk = false;
+
+    if (pibBlock->Size == ciInputBlockSize)
+    {
+      queueInputBlock(pibBlock);
+      pibBlock = freeInputBlock();
+    }
+  }
+  // A frame that is cut off counts as error, too
+  if ((bOk == true) && (iHint != 0))
+    bOk = false;
+  ZSTD_freeDStream(pzsStream);
+  queueInputBlock(pibBlock);
+  return bOk;
+}
+#endif
+
+/** Main routine of the decoder thread, reads ``stdin'' and
+decompresses it if necessary, until the end of the input.
+*/
+void decoderThread()
+{
+  string sError;
+  input_block *pibBlock = freeInputBlock();
+  bool bMore = readInputBlock(pibBlock);
+  int iFormat = inputFormat(pibBlock->Data, pibBlock->Size);
+
+  if (iFormat == ifPlain)
+  {
+    // Pass plain input through
+    while (bMore == true)
+    {
+      queueInputBlock(pibBlock);
+      pibBlock = freeInputBlock();
+      bMore = readInputBlock(pibBlock);
+    }
+    queueInputBlock(pibBlock);
+  }
+  else
+  {
+    // The first block keeps the compressed input, it gets
+    // replaced by a new one for the decompressed data
+    input_block ibRaw = *pibBlock;
+    pibBlock->Data = new char[ciInputBlockSize];
+    pibBlock->Size = 0;
+    {
+      unique_lock<mutex> lock(irInput.Lock);
+      irInput.Free.push_front(pibBlock);
+    }
+
+    if (iFormat == ifGzip)
+    {
+#ifdef F2E_HAVE_ZLIB
+      if (inflateInput(&ibRaw) == false)
+        sError = "Corrupt gzip input";
+#else
+      sError = "Reading gzip input requires zlib";
+#endif
+    }
+    else
+    {
+#ifdef F2E_HAVE_ZSTD
+      if (unzstdInput(&ibRaw) == false)
+        sError = "Corrupt zstd input";
+#else
+      sError = "Reading zstd input requires libzstd";
+#endif
+    }
+    delete [] ibRaw.Data;
+  }
+
+  // Input that wasn't needed doesn't count as cut off
+  if (irInput.Stop == true)
+    sError.clear();
+  {
+    unique_lock<mutex> lock(irInput.Lock);
+    irInput.Error = sError;
+    irInput.Done = true;
+  }
+  irInput.Filled.notify_one();
+}
+
+/** Starts the decoder thread for ``stdin'', with \a iBlocks input
+blocks.
+*/
+void startInput(int iBlocks)
+{
+  irInput.Done = false;
+  irInput.Stop = false;
+  irInput.Current = 0;
+  irInput.Pos = 0;
+#ifndef _WIN32
+  if (pipe(irInput.Wakeup) != 0)
+    irInput.Wakeup[0] = irInput.Wakeup[1] = -1;
+#endif
+  for (int i = 0; i < iBlocks; i++)
+  {
+    input_block *pibBlock = new input_block;
+    pibBlock->Data = new char[ciInputBlockSize];
+    pibBlock->Size = 0;
+    irInput.Free.push_back(pibBlock);
+  }
+  irInput.Decoder = thread(decoderThread);
+}
+
+/** Waits for the next filled input block and makes it the
+current one, the previous block is handed back to the decoder.
+@return ``false'' at the end of the input, ``true'' else
+*/
+bool nextInputBlock()
+{
+  unique_lock<mutex> lock(irInput.Lock);
+  if (irInput.Current != 0)
+  {
+    irInput.Current->Size = 0;
+    irInput.Free.push_back(irInput.Current);
+    irInput.Current = 0;
+    irInput.Drained.notify_one();
+  }
+  while (irInput.Full.empty() && !irInput.Done)
+    irInput.Filled.wait(lock);
+  if (irInput.Full.empty())
+    return false;
+  irInput.Current = irInput.Full.front();
+  irInput.Full.pop_front();
+  irInput.Pos = 0;
+  return true;
+}
+
+/** Reads the next line of the input, without its newline. The
+line points right into the input block, only a line that spans
+two blocks gets copied. Like ``getline'', a last line without
+newline is not returned.
+@param pcLine Gets set to the start of the line
+@param iLength Gets set to the length of the line
+@return ``false'' at the end of the input, ``true'' else
+*/
+bool readInputLine(const char *&pcLine, string::size_type &iLength)
+{
+  irInput.Carry.clear();
+  while (true)
+  {
+    if (irInput.Current != 0)
+    {
+      const char *pcStart = irInput.Current->Data + irInput.Pos;
+      size_t iLeft = irInput.Current->Size - irInput.Pos;
+      const char *pcNewline = (const char *) memchr(pcStart, '\n', iLeft);
+      if (pcNewline != 0)
+      {
+        irInput.Pos += (pcNewline - pcStart) + 1;
+        if (irInput.Carry.empty())
+        {
+          pcLine = pcStart;
+          iLength = pcNewline - pcStart;
+        }
+        else
+        {
+          irInput.Carry.append(pcStart, pcNewline - pcStart);
+          pcLine = irInput.Carry.data();
+          iLength = irInput.Carry.size();
+        }
+        return true;
+      }
+      irInput.Carry.append(pcStart, iLeft);
+    }
+    if (nextInputBlock() == false)
+      return false;
+  }
+}
+
+/** Waits for the decoder thread and frees the input blocks.
+@return ``true'' if the input could be decoded, ``false'' else
+*/
+bool finishInput()
+{
+  // Skip the rest of the input, without reading it
+  irInput.Stop = true;
+#ifndef _WIN32
+  if (irInput.Wakeup[1] >= 0)
+  {
+    char cWakeup = 0;
+    while ((write(irInput.Wakeup[1], &cWakeup, 1) < 0) && (errno == EINTR))
+      ;
+  }
+#endif
+  while (nextInputBlock() == true)
+    ;
+  irInput.Decoder.join();
+#ifndef _WIN32
+  if (irInput.Wakeup[0] >= 0)
+  {
+    close(irInput.Wakeup[0]);
+    close(irInput.Wakeup[1]);
+  }
+#endif
+  while (!irInput.Free.empty())
+  {
+    delete [] irInput.Free.front()->Data;
+    delete irInput.Free.front();
+    irInput.Free.pop_front();
+  }
+  if (!irInput.Error.empty())
+  {
+    cerr << "Error: " << irInput.Error << "!" << endl;
+    return false;
+  }
+  return true;
+}
+
+/*------------------------------------------------------------- Sharding */
+
+/** Is ``true'' if the shard is given as byte range of the input,
+``false'' if it's given by the line numbers */
+bool bShardByBytes = false;
+/** Offset of the next input line, for byte range shards */
+long long llShardNext = 0;
+/** Offset behind the shard, for byte range shards */
+long long llShardEnd = 0;
+
+/** Returns the offset of the first line that starts at or
+behind the offset \a llOffset in the input \a pcInput of the
+size \a llSize.
+*/
+long long snapToLine(const char *pcInput, long long llSize, long long llOffset)
+{
+  if (llOffset <= 0)
+    return 0;
+  if (llOffset >= llSize)
+    return llSize;
+  if (pcInput[llOffset - 1] == '\n')
+    return llOffset;
+  const char *pcNewline = (const char *) memchr(pcInput + llOffset, '\n', llSize - llOffset);
+  if (pcNewline == 0)
+    return llSize;
+  return (pcNewline - pcInput) + 1;
+}
+
+/** Prepares reading the share of the input for this process. If
+the input is a regular file, the shard is the iShard-th of iShards
+equal byte ranges, snapped to line boundaries, and reading starts
+at its first line. Else, the shard consists of every iShards-th
+line. In both cases lineNumber counts the lines of the whole
+input, such that the shards need no coordination.
+*/
+void startShard()
+{
+#ifndef _WIN32
+  struct stat stInput;
+  if ((fstat(fileno(stdin), &stInput) != 0) || !S_ISREG(stInput.st_mode) ||
+      (stInput.st_size == 0))
+    return;
+  long long llSize = stInput.st_size;
+  void *pInput = mmap(0, llSize, PROT_READ, MAP_PRIVATE, fileno(stdin), 0);
+  if (pInput == MAP_FAILED)
+    return;
+  const char *pcInput = (const char *) pInput;
+  // Compressed input can only be split by lines
+  if (inputFormat(pcInput, llSize) != ifPlain)
+  {
+    munmap(pInput, llSize);
+    return;
+  }
+
+  long long llStart = snapToLine(pcInput, llSize, llSize * (iShard - 1) / iShards);
+  llShardEnd = snapToLine(pcInput, llSize, llSize * iShard / iShards);
+
+  // Count the lines of the previous shards
+  const char *pcPos = pcInput;
+  const char *pcEnd = pcInput + llStart;
+  while ((pcPos = (const char *) memchr(pcPos, '\n', pcEnd - pcPos)) != 0)
+  {
+    lineNumber++;
+    pcPos++;
+  }
+  munmap(pInput, llSize);
+
+  if (fseek(stdin, llStart, SEEK_SET) != 0)
+  {
+    lineNumber = 0;
+    return;
+  }
+  llShardNext = llStart;
+  bShardByBytes = true;
+#endif
+}
+
+/** Checks whether the input line with the length \a iLength
+and the number lineNumber belongs to the shard of this process.
+@param iLength Length of the input line
+@param bEnd Gets set to ``true'' if the shard is finished
+@return ``true'' if the line belongs to the shard, ``false'' else
+*/
+bool lineInShard(string::size_type iLength, bool &bEnd)
+{
+  bEnd = false;
+  if (bShardByBytes == true)
+  {
+    if (llShardNext >= llShardEnd)
+    {
+      bEnd = true;
+      return false;
+    }
+    llShardNext += iLength + 1;
+    return true;
+  }
+
+  return ((lineNumber - 1) % iShards == (unsigned int) (iShard - 1));
+}
+
+/*----------------------------------------------------------- Validation */
+
+/** Struct that keeps a line that failed the validation. */
+struct validate_reject
+{
+  /** Number of the line, within its block or the input */
+  unsigned long long Line;
+  /** Class of the FEN string */
+  int Error;
+  /** The line */
+  string Text;
+};
+
+/** Struct that keeps the result of validating a block of the
+input. Only the lines between the first and the last newline
+of the block are checked, the text around them gets joined with
+the neighboring blocks by the main thread. */
+struct validate_result
+{
+  /** Number of newlines in the block */
+  unsigned long long Newlines;
+  /** Text before the first newline, the whole block if it has none */
+  string Head;
+  /** Text behind the last newline */
+  string Tail;
+  /** Number of empty lines */
+  unsigned long long Empty;
+  /** Number of lines per class */
+  unsigned long long Counts[ciFenErrors];
+  /** Number of lines that the renderer can draw */
+  unsigned long long Drawable;
+  /** The lines that failed, numbered from 1 behind the first newline */
+  vector<validate_reject> Rejects;
+};
+
+/** State of the validation threads, they hand their results
+over to the main thread by the number of the block */
+struct validate_state
+{
+  /** Protects Results and Finished */
+  mutex Lock;
+  /** Signals a new result or a finished thread */
+  condition_variable Ready;
+  /** Results of the blocks, that the main thread hasn't merged yet */
+  map<unsigned long long, validate_result *> Results;
+  /** Number of the next block that gets taken from the input */
+  unsigned long long NextBlock;
+  /** Number of threads that have finished */
+  unsigned int Finished;
+} vsValidate;
+
+/** Is ``true'' if the input lines only get validated, ``false'' else */
+bool bValidate = false;
+/** Name of the file for the lines that fail the validation, empty
+if they aren't written */
+string sRejectsFile = "";
+
+/** Validates the line \a pcLine with the length \a iLength and adds
+it to the result \a vrResult, as line \a iLine.
+*/
+void validateLine(const char *pcLine, string::size_type iLength,
+                  unsigned long long iLine, validate_result &vrResult)
+{
+  // Lines of DOS text files end with a carriage return
+  if ((iLength > 0) && (pcLine[iLength - 1] == '\r'))
+    iLength--;
+
+  // Empty lines get skipped, like for rendering
+  if (iLength == 0)
+  {
+    vrResult.Empty++;
+    return;
+  }
+
+  int iError = checkFENString(pcLine, iLength);
+  vrResult.Counts[iError]++;
+  char pcSquares[64];
+  if (expandFENSquares(pcLine, iLength, pcSquares) == true)
+    vrResult.Drawable++;
+  if ((iError != feValid) && (sRejectsFile.size() > 0))
+  {
+    vrResult.Rejects.push_back(validate_reject());
+    vrResult.Rejects.back().Line = iLine;
+    vrResult.Rejects.back().Error = iError;
+    vrResult.Rejects.back().Text.assign(pcLine, iLength);
+  }
+}
+
+/** Main routine of a validation thread, takes the input blocks
+as they get filled and validates their lines, until the end of
+the input.
+*/
+void validateThread()
+{
+  while (true)
+  {
+    // Take the next block
+    input_block *pibBlock;
+    unsigned long long iBlock;
+    {
+      unique_lock<mutex> lock(irInput.Lock);
+      while (irInput.Full.empty() && !irInput.Done)
+        irInput.Filled.wait(lock);
+      if (irInput.Full.empty())
+        break;
+      pibBlock = irInput.Full.front();
+      irInput.Full.pop_front();
+      iBlock = vsValidate.NextBlock++;
+    }
+
+    long long llStart = traceClock();
+    validate_result *pvrResult = new validate_result;
+    pvrResult->Newlines = 0;
+    pvrResult->Empty = 0;
+    pvrResult->Drawable = 0;
+    for (int i = 0; i < ciFenErrors; i++)
+      pvrResult->Counts[i] = 0;
+
+    const char *pcPos = pibBlock->Data;
+    const char *pcEnd = pibBlock->Data + pibBlock->Size;
+    const char *pcNewline = (const char *) memchr(pcPos, '\n', pcEnd - pcPos);
+    if (pcNewline == 0)
+      pvrResult->Head.assign(pcPos, pcEnd - pcPos);
+    else
+    {
+      pvrResult->Head.assign(pcPos, pcNewline - pcPos);
+      pvrResult->Newlines++;
+      pcPos = pcNewline + 1;
+      while ((pcNewline = (const char *) memchr(pcPos, '\n', pcEnd - pcPos)) != 0)
+      {
+        validateLine(pcPos, pcNewline - pcPos, pvrResult->Newlines, *pvrResult);
+        pvrResult->Newlines++;
+        pcPos = pcNewline + 1;
+      }
+      pvrResult->Tail.assign(pcPos, pcEnd - pcPos);
+    }
+    traceSpan("FEN validate", 0, llStart);
+
+    // Hand the block back to the decoder...
+    {
+      unique_lock<mutex> lock(irInput.Lock);
+      pibBlock->Size = 0;
+      irInput.Free.push_back(pibBlock);
+    }
+    irInput.Drained.notify_one();
+    //...and the result to the main thread
+    {
+      unique_lock<mutex> lock(vsValidate.Lock);
+      vsValidate.Results[iBlock] = pvrResult;
+    }
+    vsValidate.Ready.notify_one();
+  }
+
+  // Wake up the other threads for the end of the input
+  irInput.Filled.notify_all();
+  {
+    unique_lock<mutex> lock(vsValidate.Lock);
+    vsValidate.Finished++;
+  }
+  vsValidate.Ready.notify_one();
+}
+
+/** Validates all lines of the input on several threads, and
+reports the number of lines per class on ``stdout''. The lines
+that fail get written to the file sRejectsFile, if it's given.
+@return ``true'' if the input could be read, ``false'' else
+*/
+bool validateInput()
+{
+  std::ofstream fRejects;
+  if (sRejectsFile.size() > 0)
+  {
+    fRejects.open(sRejectsFile.c_str());
+    if (!fRejects)
+    {
+      cerr << "Error: Could not open output file " << sRejectsFile << "!" << endl;
+      return false;
+    }
+  }
+
+  // Keep all threads busy, with a few blocks in reserve
+  unsigned int iThreads = thread::hardware_concurrency();
+  if (iThreads < 2)
+    iThreads = 2;
+  vsValidate.NextBlock = 0;
+  vsValidate.Finished = 0;
+  startInput(2*iThreads + 2);
+  vector<thread> vThreads;
+  for (unsigned int i = 0; i < iThreads; i++)
+    vThreads.push_back(thread(validateThread));
+
+  // Totals, and the lines that span two blocks
+  validate_result vrTotal;
+  vrTotal.Newlines = 0;
+  vrTotal.Empty = 0;
+  vrTotal.Drawable = 0;
+  for (int i = 0; i < ciFenErrors; i++)
+    vrTotal.Counts[i] = 0;
+  string sCarry;
+
+  // Merge the results in the order of the input
+  for (unsigned long long iBlock = 0; ; iBlock++)
+  {
+    validate_result *pvrResult = 0;
+    {
+      unique_lock<mutex> lock(vsValidate.Lock);
+      while ((vsValidate.Results.count(iBlock) == 0) &&
+             (vsValidate.Finished < iThreads))
+        vsValidate.Ready.wait(lock);
+      if (vsValidate.Results.count(iBlock) == 0)
+        break;
+      pvrResult = vsValidate.Results[iBlock];
+      vsValidate.Results.erase(iBlock);
+    }
+
+    sCarry += pvrResult->Head;
+    if (pvrResult->Newlines > 0)
+    {
+      // The line that ends in this block
+      vrTotal.Rejects.clear();
+      validateLine(sCarry.data(), sCarry.size(), vrTotal.Newlines + 1, vrTotal);
+      sCarry = pvrResult->Tail;
+
+      for (int i = 0; i < ciFenErrors; i++)
+        vrTotal.Counts[i] += pvrResult->Counts[i];
+      vrTotal.Empty += pvrResult->Empty;
+      vrTotal.Drawable += pvrResult->Drawable;
+      // No flushing after each line, there may be millions
+      vector<validate_reject>::iterator it;
+      for (it = vrTotal.Rejects.begin(); it != vrTotal.Rejects.end(); ++it)
+        fRejects << it->Line << "\t" << pcFenErrors[it->Error] << "\t" << it->Text << '\n';
+      for (it = pvrResult->Rejects.begin(); it != pvrResult->Rejects.end(); ++it)
+      {
+        fRejects << (vrTotal.Newlines + 1 + it->Line) << "\t" << pcFenErrors[it->Error];
+        fRejects << "\t" << it->Text << '\n';
+      }
+      vrTotal.Newlines += pvrResult->Newlines;
+    }
+    delete pvrResult;
+  }
+
+  for (vector<thread>::iterator it = vThreads.begin(); it != vThreads.end(); ++it)
+    it->join();
+  if (!finishInput())
+    return false;
+
+  // Report the classes
+  unsigned long long iLines = vrTotal.Newlines - vrTotal.Empty;
+  cout << vrTotal.Counts[feValid] << " of " << iLines << " FEN strings valid, ";
+  cout << vrTotal.Empty << " empty lines" << endl;
+  for (int i = 1; i < ciFenErrors; i++)
+    cout << vrTotal.Counts[i] << "\t" << pcFenErrors[i] << endl;
+  cout << vrTotal.Drawable << " FEN strings can be drawn" << endl;
+
+  if (fRejects.is_open())
+  {
+    fRejects.close();
+    if (!fRejects)
+    {
+      cerr << "Error: Could not write output file " << sRejectsFile << "!" << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+/*---------------------------------------------------------------- Watch */
+
+/** Prepares the current font for the output, depending on the
+selected options: computes its layout, converts its symbols for
+the layered, shared and Type 3 modes and precompiles the diagram.
+*/
+void prepareFont()
+{
+  // Compute bounding box, translation and scaling factor
+  computeFontLayout();
+
+  // Initialize frame export...
+  selectFrameSymbols();
+
+  // Simplify the outlines for the size of the diagrams
+  if (dLodTolerance > 0.0)
+    simplifyFont();
+
+  // Separate the pieces from the square backgrounds
+  if (bLayered == true)
+    layerFont();
+
+  // Render the tiles of the raster images and previews, from
+  // the outlines as they are before sharing their subpaths
+  if ((iOutputFormat != ofEps) || (iPreview != pvNone))
+    computeRasterLayout(dRasterDpi);
+  if ((iOutputFormat == ofEps) && (iPreview != pvNone))
+  {
+    for (int i = 26; i < ciFontSymbols; i++)
+    {
+      if (pbSymbolExport[i] == true)
+        renderGlyphTile(i, rcCanvas.PixelScale, rcCanvas.Tiles[i]);
+    }
+  }
+
+  // Share the common subpaths of the symbols
+  if ((bShareSubpaths == true) && (iOutputFormat == ofEps))
+    shareSubpaths();
+
+  // Turn the symbols into glyphs of a Type 3 font
+  if ((bType3 == true) && (iOutputFormat == ofEps))
+    compileType3Glyphs();
+
+  // Precompile the fixed parts of the diagram
+  compileDiagramTemplate();
+}
+
+#ifdef __linux__
+/** Struct that keeps a diagram of the watched input file, as
+its output file was written last. */
+struct watched_diagram
+{
+  /** The input line */
+  string Line;
+  /** The decoded board */
+  int Board[64];
+};
+
+/** Diagrams of the watched input file, in the order of their
+file numbers */
+vector<watched_diagram> vWatchedDiagrams;
+/** Contents of the watched input file */
+string sWatchText;
+
+/** Reads the watched input file into sWatchText.
+@return ``true'' if the file could be read, ``false'' else
+*/
+bool readWatchFile()
+{
+  int iFd = open(sWatchFile.c_str(), O_RDONLY);
+  if (iFd < 0)
+    return false;
+
+  sWatchText.clear();
+  char pcBuffer[65536];
+  long long iRead;
+  while ((iRead = read(iFd, pcBuffer, sizeof(pcBuffer))) > 0)
+    sWatchText.append(pcBuffer, iRead);
+  close(iFd);
+
+  return (iRead == 0);
+}
+
+/** Updates the output files for the current version of the
+watched input file. Its lines get compared to the diagrams of the
+previous version, with the same file number: only the boards that
+were added or changed get written, and the files of removed
+diagrams get deleted.
+@param bAll ``true'' if all files have to be written, e.g. for
+a new font
+@param iDiagrams Gets set to the number of diagrams
+@return The number of written files, -1 on errors
+*/
+int updateWatchedDiagrams(bool bAll, vector<watched_diagram>::size_type &iDiagrams)
+{
+  const char *pcExtension = (iOutputFormat == ofPgm) ? ".pgm" : ".eps";
+  int iWritten = 0;
+
+  iDiagrams = 0;
+  if (!readWatchFile())
+  {
+    cerr << "Error: Could not read input file " << sWatchFile << "!" << endl;
+    return -1;
+  }
+
+  lineNumber = 0;
+  string::size_type iPos = 0;
+  while (iPos < sWatchText.size())
+  {
+    // Like ``getline'', a last line without newline is not read
+    const char *pcLine = sWatchText.data() + iPos;
+    const char *pcNewline = (const char *) memchr(pcLine, '\n', sWatchText.size() - iPos);
+    if (pcNewline == 0)
+      break;
+    string::size_type iLength = pcNewline - pcLine;
+    iPos += iLength + 1;
+    lineNumber++;
+
+    // Skip empty lines...
+    if (iLength == 0)
+      continue;
+
+    //...and unchanged ones, they keep their diagram
+    if ((bAll == false) && (iDiagrams < vWatchedDiagrams.size()) &&
+        (vWatchedDiagrams[iDiagrams].Line.compare(0, string::npos, pcLine, iLength) == 0))
+    {
+      iDiagrams++;
+      continue;
+    }
+
+    if (expandFENString(pcLine, iLength) == false)
+      continue;
+
+    // Compare the board with the previous diagram of this number
+    bool bChanged = bAll;
+    if (iDiagrams == vWatchedDiagrams.size())
+    {
+      vWatchedDiagrams.push_back(watched_diagram());
+      bChanged = true;
+    }
+    watched_diagram &wdDiagram = vWatchedDiagrams[iDiagrams++];
+    wdDiagram.Line.assign(pcLine, iLength);
+    if ((bChanged == false) &&
+        (memcmp(wdDiagram.Board, piCurrentBoard, sizeof(piCurrentBoard)) == 0))
+      continue;
+    memcpy(wdDiagram.Board, piCurrentBoard, sizeof(piCurrentBoard));
+
+    fileNumber = iDiagrams;
+    makeOutFileName(pcExtension);
+    obFileBuffer.Data.clear();
+    writeDiagramFile(osFileStream);
+    if (writeOutputFile(sOutFile, obFileBuffer.Data,
+                        binaryOutput(), lineNumber) == false)
+    {
+      // Write everything again next time
+      vWatchedDiagrams.clear();
+      return -1;
+    }
+    iWritten++;
+  }
+
+  // Delete the files of the removed diagrams
+  for (fileNumber = iDiagrams + 1; fileNumber <= vWatchedDiagrams.size(); fileNumber++)
+  {
+    makeOutFileName(pcExtension);
+    remove(sOutFile.c_str());
+  }
+  vWatchedDiagrams.resize(iDiagrams);
+
+  return iWritten;
+}
+
+/** Splits the path \a sPath into its directory \a sDir and the
+file name \a sName.
+*/
+void splitWatchPath(const string &sPath, string &sDir, string &sName)
+{
+  string::size_type iSlash = sPath.find_last_of('/');
+  if (iSlash == string::npos)
+  {
+    sDir = ".";
+    sName = sPath;
+    return;
+  }
+  sDir = (iSlash == 0) ? string("/") : sPath.substr(0, iSlash);
+  sName = sPath.substr(iSlash + 1);
+}
+#endif
+
+/** Writes the diagrams of the watched input file and keeps them
+up to date, until the process gets interrupted. Whenever the input
+file gets saved, only its added and changed diagrams get written
+again. When the font file changes, the font gets reloaded and all
+diagrams are written. The directories of both files get watched
+with ``inotify'', because editors often replace a file instead of
+writing to it.
+@return ``false'' if the files can't be watched, ``true'' else
+*/
+bool watchInput()
+{
+#ifdef __linux__
+  string sInputDir, sInputName, sFontDir, sFontName;
+  splitWatchPath(sWatchFile, sInputDir, sInputName);
+  splitWatchPath(sFontFile, sFontDir, sFontName);
+
+  int iNotify = inotify_init1(IN_CLOEXEC);
+  if (iNotify < 0)
+  {
+    cerr << "Error: Could not start watching the input!" << endl;
+    return false;
+  }
+  int iInputWatch = inotify_add_watch(iNotify, sInputDir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+  int iFontWatch = inotify_add_watch(iNotify, sFontDir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (iInputWatch < 0)
+  {
+    cerr << "Error: Could not watch the directory " << sInputDir << "!" << endl;
+    close(iNotify);
+    return false;
+  }
+  if (iFontWatch < 0)
+  {
+    cerr << "Error: Could not watch the directory " << sFontDir << "!" << endl;
+    close(iNotify);
+    return false;
+  }
+
+  // Is the current font complete?
+  bool bFontOk = true;
+  bool bAll = true;
+  // Buffer for the events
+  char pcEvents[16384] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  while (true)
+  {
+    chrono::steady_clock::time_point tpStart = chrono::steady_clock::now();
+    if (bFontOk == true)
+    {
+      vector<watched_diagram>::size_type iDiagrams;
+      int iWritten = updateWatchedDiagrams(bAll, iDiagrams);
+      if (iWritten >= 0)
+      {
+        double dMilliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() -
+                                                               tpStart).count();
+        cerr << sWatchFile << ": " << iWritten << " of " << iDiagrams;
+        cerr << " diagrams written in " << dMilliseconds << " ms" << endl;
+      }
+    }
+
+    // Wait for the next change, and collect the events that follow
+    // right away, an editor may save in several steps
+    bool bInput = false;
+    bool bFont = false;
+    while ((bInput == false) && (bFont == false))
+    {
+      int iTimeout = -1;
+      while (true)
+      {
+        struct pollfd pfd;
+        pfd.fd = iNotify;
+        pfd.events = POLLIN;
+        int iReady = poll(&pfd, 1, iTimeout);
+        if ((iReady < 0) && (errno == EINTR))
+          continue;
+        long long iRead = (iReady > 0) ? read(iNotify, pcEvents, sizeof(pcEvents)) : 0;
+        if ((iRead <= 0) && (iTimeout < 0))
+        {
+          cerr << "Error: Could not watch the input any longer!" << endl;
+          close(iNotify);
+          return false;
+        }
+        if (iRead <= 0)
+          break;
+        for (char *pcPos = pcEvents; pcPos < pcEvents + iRead; )
+        {
+          const struct inotify_event *pieEvent = (const struct inotify_event *) pcPos;
+          pcPos += sizeof(struct inotify_event) + pieEvent->len;
+          // Lost events, so check both files
+          if ((pieEvent->mask & IN_Q_OVERFLOW) != 0)
+            bInput = bFont = true;
+          if (pieEvent->len == 0)
+            continue;
+          if ((pieEvent->wd == iInputWatch) && (sInputName == pieEvent->name))
+            bInput = true;
+          if ((pieEvent->wd == iFontWatch) && (sFontName == pieEvent->name))
+            bFont = true;
+        }
+        iTimeout = 0;
+      }
+    }
+
+    bAll = false;
+    if (bFont == true)
+    {
+      // Reload the font and write all diagrams
+      bFontOk = loadFont();
+      if (bFontOk == true)
+        prepareFont();
+      bAll = true;
+    }
+  }
+#else
+  cerr << "Error: Watching the input needs ``inotify'', i.e. Linux!" << endl;
+  return false;
+#endif
+}
+
+/*------------------------------------------------------------- Variants */
+
+/** Struct that keeps an output variant, i.e. the settings and the
+prepared font of one of several diagrams written for each input
+line. While the variant gets written, its state is swapped with the
+global one (see swapVariant()). */
+struct output_variant
+{
+  /** Prefix of the output files */
+  string Prefix;
+  /** Name of the font definition file */
+  string FontFile;
+  /** Is ``true'' if the board is displayed reverse */
+  bool Reverse;
+  /** Is ``true'' if the board has a notation */
+  bool Notation;
+  /** Output format, ofEps or ofPgm */
+  int Format;
+  /** The prepared font */
+  font_info FontInfo;
+  vector<font_section> FontSections;
+  vector<string> SharedSubpaths;
+  layered_piece LayeredPieces[ciPieces];
+  unsigned int Type3Xuid[2];
+  /** Export flags of the frame symbols */
+  bool FrameExport[ciFontSymbols];
+  /** The precompiled diagram */
+  diagram_template Diagram;
+  /** The canvas, for raster images */
+  raster_canvas Canvas;
+  /** Buffer size for a single diagram file */
+  string::size_type FileSize;
+};
+
+/** Specifications of the output variants, as given on the command
+line */
+vector<string> vVariantSpecs;
+/** The output variants */
+vector<output_variant> vVariants;
+
+/** Swaps the settings and the prepared font of the variant
+\a ovVariant with the global ones, which selects the variant for
+the output. A second call swaps them back.
+*/
+void swapVariant(output_variant &ovVariant)
+{
+  // The canvas is only used for raster images
+  if ((iOutputFormat != ofEps) || (ovVariant.Format != ofEps) || (iPreview != pvNone))
+    swap(rcCanvas, ovVariant.Canvas);
+  sPrefix.swap(ovVariant.Prefix);
+  sFontFile.swap(ovVariant.FontFile);
+  swap(bReverse, ovVariant.Reverse);
+  swap(bNotation, ovVariant.Notation);
+  swap(iOutputFormat, ovVariant.Format);
+  swap(fiFontInfo, ovVariant.FontInfo);
+  vFontSections.swap(ovVariant.FontSections);
+  vSharedSubpaths.swap(ovVariant.SharedSubpaths);
+  swap_ranges(plpLayeredPieces, plpLayeredPieces + ciPieces, ovVariant.LayeredPieces);
+  swap_ranges(piType3Xuid, piType3Xuid + 2, ovVariant.Type3Xuid);
+  swap_ranges(pbSymbolExport + 26, pbSymbolExport + ciFontSymbols, ovVariant.FrameExport + 26);
+  swap(dtDiagram, ovVariant.Diagram);
+}
+
+/** Parses the specification \a sSpec of an output variant, i.e.
+``[<options>:]<prefix>'' with the comma separated options ``r''
+(reverse), ``n'' (no notation), ``eps'', ``pgm'' and ``f=<file>''
+(font file), into \a ovVariant. Settings that aren't given are
+taken from the command line.
+@return ``true'' if the specification is valid, ``false'' else
+*/
+bool parseVariant(const string &sSpec, output_variant &ovVariant)
+{
+  ovVariant.Prefix = sSpec;
+  ovVariant.FontFile = "";
+  ovVariant.Reverse = bReverse;
+  ovVariant.Notation = bNotation;
+  ovVariant.Format = iOutputFormat;
+
+  string::size_type iColon = sSpec.find(':');
+  if (iColon == string::npos)
+    return (sSpec.size() > 0);
+  ovVariant.Prefix = sSpec.substr(iColon + 1);
+
+  string::size_type iPos = 0;
+  while (iPos < iColon)
+  {
+    string::size_type iComma = sSpec.find(',', iPos);
+    if ((iComma == string::npos) || (iComma > iColon))
+      iComma = iColon;
+    string sOption = sSpec.substr(iPos, iComma - iPos);
+    iPos = iComma + 1;
+
+    if (sOption == "r")
+      ovVariant.Reverse = true;
+    else if (sOption == "n")
+      ovVariant.Notation = false;
+    else if (sOption == "eps")
+      ovVariant.Format = ofEps;
+    else if (sOption == "pgm")
+      ovVariant.Format = ofPgm;
+    else if ((sOption.compare(0, 2, "f=") == 0) && (sOption.size() > 2))
+      ovVariant.FontFile = sOption.substr(2);
+    else
+      return false;
+  }
+
+  return (ovVariant.Prefix.size() > 0);
+}
+
+/** Prepares the output variants of vVariantSpecs. Each font file
+gets read only once, the variants prepare their own copies of it.
+@return ``true'' if all variants could be prepared, ``false'' else
+*/
+bool setupVariants()
+{
+  // The fonts read so far, by their file names
+  map<string, pair<font_info, vector<font_section> > > mFonts;
+  // The font of the command line
+  string sDefaultFont = sFontFile;
+  bool bDefaultGiven = bFontFileGiven;
+
+  // Parse all variants, before the settings get changed
+  vVariants.resize(vVariantSpecs.size());
+  for (vector<string>::size_type i = 0; i < vVariantSpecs.size(); i++)
+  {
+    if (!parseVariant(vVariantSpecs[i], vVariants[i]))
+    {
+      cerr << "Error: Wrong variant " << vVariantSpecs[i];
+      cerr << ", use [<options>:]<prefix> with the options r, n, eps, pgm, f=<file>!" << endl;
+      return false;
+    }
+  }
+
+  for (vector<output_variant>::size_type i = 0; i < vVariants.size(); i++)
+  {
+    output_variant &ovVariant = vVariants[i];
+
+    // Select the settings of the variant
+    sPrefix = ovVariant.Prefix;
+    bReverse = ovVariant.Reverse;
+    bNotation = ovVariant.Notation;
+    iOutputFormat = ovVariant.Format;
+    sFontFile = sDefaultFont;
+    bFontFileGiven = bDefaultGiven;
+    if (ovVariant.FontFile.size() > 0)
+    {
+      sFontFile = ovVariant.FontFile;
+      bFontFileGiven = true;
+    }
+
+    // Read the font, or copy it
+    map<string, pair<font_info, vector<font_section> > >::iterator it = mFonts.find(sFontFile);
+    if (it != mFonts.end())
+    {
+      fiFontInfo = it->second.first;
+      vFontSections = it->second.second;
+    }
+    else
+    {
+      fiFontInfo = font_info();
+      if (!loadFont())
+        return false;
+      mFonts[sFontFile] = make_pair(fiFontInfo, vFontSections);
+    }
+    vSharedSubpaths.clear();
+    for (int p = 0; p < ciPieces; p++)
+      plpLayeredPieces[p] = layered_piece();
+
+    prepareFont();
+    ovVariant.FileSize = maxDiagramFileSize();
+    swapVariant(ovVariant);
+  }
+
+  // Boards get decoded in the normal orientation
+  bReverse = false;
+  return true;
+}
+
+/** Writes the current board in all output variants, each into
+a file of its own with the number of the board.
+@return ``false'' if a file couldn't be written, ``true'' else
+*/
+bool writeVariants()
+{
+  // The decoded board, in the normal orientation
+  int piBoard[64];
+  memcpy(piBoard, piCurrentBoard, sizeof(piBoard));
+
+  // Shards number their files by the input line
+  if (iShards > 0)
+    fileNumber = lineNumber;
+  else
+    fileNumber++;
+
+  for (vector<output_variant>::iterator it = vVariants.begin(); it != vVariants.end(); ++it)
+  {
+    swapVariant(*it);
+    for (int i = 0; i < 64; i++)
+      piCurrentBoard[i] = (bReverse == true) ? piBoard[63 - i] : piBoard[i];
+    makeOutFileName((iOutputFormat == ofPgm) ? ".pgm" : ".eps");
+
+    // Write the diagram into the reused buffer
+    obFileBuffer.Data.clear();
+    obFileBuffer.Data.reserve(it->FileSize);
+    writeDiagramFile(osFileStream);
+
+    bool bOk;
+    if (bAsyncOutput == true)
+      bOk = submitOutputFile(sOutFile, obFileBuffer.Data);
+    else
+      bOk = writeOutputFile(sOutFile, obFileBuffer.Data,
+                            binaryOutput(), lineNumber);
+    swapVariant(*it);
+    if (bOk == false)
+      return false;
+  }
 
-  fOut << "restore" << endl << endl;
+  return true;
 }
 
 /** Display the ``usage message''.
@@ -1083,9 +8070,64 @@ void usage()
   cerr << "                    but creates a single file for each FEN string." << endl;
   cerr << "                    File names start with <prefix> followed by a unique number." << endl;
   cerr << "-r                  Displays the boards reverse." << endl;
+  cerr << "--pgm               Writes PGM raster images instead of EPS diagrams." << endl;
+  cerr << "--gif <file_name>   Writes all diagrams as animated GIF image to <file_name>," << endl;
+  cerr << "                    each frame only updates the changed squares." << endl;
+  cerr << "--dpi <number>      Resolution for raster images, in pixels per inch (default: 72)." << endl;
+  cerr << "--procset <name>    Defines the symbols once, as procset <name> in the file <name>.ps" << endl;
+  cerr << "                    next to the diagrams of ``-p'', that only refer to it." << endl;
+  cerr << "--embed-procset <file>  Embeds the procset <file> into the EPS files named on" << endl;
+  cerr << "                    `stdin', such that each one can be used on its own." << endl;
+  cerr << "--store <file>      Appends all diagrams to the single file <file>, with an index" << endl;
+  cerr << "                    by input line." << endl;
+  cerr << "--extract <file> <line>  Writes the diagram of input line <line> from the store" << endl;
+  cerr << "                    <file> to `stdout'." << endl;
+  cerr << "--dedup             Renders repeated positions only once, their files of ``-p''" << endl;
+  cerr << "                    get hardlinked to the first one, ``stdout'' gets a copy." << endl;
+  cerr << "--dedup-table <n>   Number of positions --dedup remembers (default: 65536, on" << endl;
+  cerr << "                    `stdout' as many diagrams as fit into 32 MB)." << endl;
+  cerr << "--no-splice         Copies the diagrams into a pipe on `stdout', instead of" << endl;
+  cerr << "                    handing the symbols over by reference (vmsplice)." << endl;
+  cerr << "--validate          Only checks the FEN strings, on all cores, and reports the" << endl;
+  cerr << "                    number of lines per error class to `stdout'." << endl;
+  cerr << "--rejects <file>    Writes the lines that fail --validate to <file>." << endl;
+  cerr << "--preview <type>    Adds a preview to the EPS diagrams, rendered at --dpi:" << endl;
+  cerr << "                    ``epsi'' (hex bitmap) or ``tiff'' (DOS EPS binary header," << endl;
+  cerr << "                    a single diagram on `stdout')." << endl;
+  cerr << "--delay <number>    Display time of a GIF frame, in 1/100 seconds (default: 100)." << endl;
+  cerr << "--variant <spec>    Writes each diagram in the variant <spec> = [<options>:]<prefix>," << endl;
+  cerr << "                    options r, n, eps, pgm, f=<font file>; can be given several times." << endl;
+  cerr << "--grid <R>x<C>      Places R rows of C diagrams each on a single page, with" << endl;
+  cerr << "                    all symbols defined only once (``-p'': one EPS per page)." << endl;
+  cerr << "--captions          Writes the EPD ``id'' below each diagram of a grid page." << endl;
+  cerr << "--async             Writes the files of ``-p'' in batches, in the background." << endl;
+  cerr << "--fanout            Spreads the files of ``-p'' over hashed subdirectories," << endl;
+  cerr << "                    like diag/00/17/dg1234.eps for ``-p diag/dg''." << endl;
+  cerr << "--catalogue <dir>   Writes a catalogue of all fonts in the directory <dir>." << endl;
+  cerr << "--trace <file>      Records the time of each processing step, as Chrome trace" << endl;
+  cerr << "                    (for Perfetto or chrome://tracing) to <file>." << endl;
+  cerr << "--layered           Draws the pieces on top of the square backgrounds," << endl;
+  cerr << "                    each piece outline gets defined only once." << endl;
+  cerr << "--share-subpaths    Reports the bytes saved by defining subpaths, that several" << endl;
+  cerr << "                    symbols have in common, only once (done by default)." << endl;
+  cerr << "--no-share-subpaths Writes the outlines of the symbols as they are." << endl;
+  cerr << "--lod <points>      Simplifies the outlines of the symbols, such that they deviate" << endl;
+  cerr << "                    at most <points> from the original in the diagram." << endl;
+  cerr << "--type3             Defines the symbols as glyphs of a Type 3 font, so that" << endl;
+  cerr << "                    the interpreter renders each one only once per size." << endl;
+  cerr << "--compact           Writes each board as string of 64 letters, that a procedure" << endl;
+  cerr << "                    of the prolog draws." << endl;
+  cerr << "--framed            Writes each diagram to `stdout' as frame with the header line" << endl;
+  cerr << "                    ``<line> <status> <length>'', invalid lines as ``error'' frame." << endl;
+  cerr << "--watch <file>      Reads the FEN strings from <file> instead of `stdin' and" << endl;
+  cerr << "                    updates the files of ``-p'' whenever <file> or the font changes." << endl;
+  cerr << "--shard <i>/<N>     Handles only the i-th of N parts of the input, the files" << endl;
+  cerr << "                    of ``-p'' get numbered by their input line." << endl;
+  cerr << "--font-header       Writes the font as C++ header for the built-in font to `stdout'." << endl;
   cerr << endl << "Examples:" << endl;
   cerr << "fen2eps -r < a.fen > a.eps" << endl;
-  cerr << "fen2eps -n -p diag -f fed/alpha.fed < a.fen" << endl << endl;
+  cerr << "fen2eps -n -p diag -f fed/alpha.fed < a.fen" << endl;
+  cerr << "fen2eps -p diag < many.epd.gz   (gzip/zstd input gets detected)" << endl << endl;
 }
 
 
@@ -1098,8 +8140,9 @@ void usage()
 */
 int main(int argc, char **argv)
 {
-  // The current input line
-  string inputLine;
+  // The current input line, and its length
+  const char *pcLine;
+  string::size_type iLength;
   // Counter
   int i;
 
@@ -1122,6 +8165,7 @@ int main(int argc, char **argv)
         break;
       i++;
       sFontFile = argv[i];
+      bFontFileGiven = true;
     }
     if (strcmp(argv[i],"-n") == 0)
     {
@@ -1146,134 +8190,686 @@ int main(int argc, char **argv)
       usage();
       return 0;
     }
+    if (strcmp(argv[i],"--font-header") == 0)
+    {
+      bFontHeader = true;
+    }
+    if (strcmp(argv[i],"--shard") == 0)
+    {
+      // Last argument?
+      if (i + 1 == argc)
+        break;
+      i++;
+      if ((sscanf(argv[i], "%d/%d", &iShard, &iShards) != 2) ||
+          (iShards < 1) || (iShard < 1) || (iShard > iShards))
+      {
+        cerr << "Error: Wrong shard " << argv[i] << ", use <i>/<N> with 1 <= i <= N!" << endl;
+        return(1);
+      }
+    }
+    if (strcmp(argv[i],"--grid") == 0)
+    {
+      // Last argument?
+      if (i + 1 == argc)
+        break;
+      i++;
+      if ((sscanf(argv[i], "%dx%d", &iGridRows, &iGridColumns) != 2) ||
+          (iGridRows < 1) || (iGridColumns < 1))
+      {
+        cerr << "Error: Wrong grid size " << argv[i] << ", use <rows>x<columns>!" << endl;
+        return(1);
+      }
+    }
+    if (strcmp(argv[i],"--catalogue") == 0)
+    {
+      if (i + 1 == argc)
+        break;
+      i++;
+      sCatalogueDir = argv[i];
+    }
+    if (strcmp(argv[i],"--trace") == 0)
+    {
+      if (i + 1 == argc)
+        break;
+      i++;
+      sTraceFile = argv[i];
+      bTrace = true;
+    }
+    if (strcmp(argv[i],"--variant") == 0)
+    {
+      // Last argument?
+      if (i + 1 == argc)
+        break;
+      i++;
+      vVariantSpecs.push_back(argv[i]);
+    }
+    if (strcmp(argv[i],"--lod") == 0)
+    {
+      // Last argument?
+      if (i + 1 == argc)
+        break;
+      i++;
+      dLodTolerance = atof(argv[i]);
+      if (dLodTolerance <= 0.0)
+      {
+        cerr << "Error: Wrong tolerance " << argv[i] << ", use a number of points > 0!" << endl;
+        return(1);
+      }
+    }
+    if (strcmp(argv[i],"--framed") == 0)
+    {
+      bFramed = true;
+    }
+    if (strcmp(argv[i],"--watch") == 0)
+    {
+      if (i + 1 == argc)
+        break;
+      i++;
+      sWatchFile = argv[i];
+    }
+    if (strcmp(argv[i],"--share-subpaths") == 0)
+    {
+      bShareSubpaths = true;
+      bShareReport = true;
+    }
+    if (strcmp(argv[i],"--no-share-subpaths") == 0)
+    {
+      bShareSubpaths = false;
+    }
+    if (strcmp(argv[i],"--type3") == 0)
+    {
+      bType3 = true;
+    }
+    if (strcmp(argv[i],"--compact") == 0)
+    {
+      bCompact = true;
+    }
+    if (strcmp(argv[i],"--layered") == 0)
+    {
+      bLayered = true;
+    }
+    if (strcmp(argv[i],"--async") == 0)
+    {
+      bAsyncOutput = true;
+    }
+    if (strcmp(argv[i],"--fanout") == 0)
+    {
+      bFanout = true;
+    }
+    if (strcmp(argv[i],"--captions") == 0)
+    {
+      bCaptions = true;
+    }
+    if (strcmp(argv[i],"--pgm") == 0)
+    {
+      iOutputFormat = ofPgm;
+    }
+    if (strcmp(argv[i],"--gif") == 0)
+    {
+      // Last argument?
+      if (i + 1 == argc)
+        break;
+      i++;
+      sGifFile = argv[i];
+      iOutputFormat = ofGif;
+    }
+    if (strcmp(argv[i],"--dpi") == 0)
+    {
+      // Last argument?
+      if (i + 1 == argc)
+        break;
+      i++;
+      dRasterDpi = atof(argv[i]);
+      if (dRasterDpi <= 0.0)
+        dRasterDpi = 72.0;
+    }
+    if (strcmp(argv[i],"--procset") == 0)
+    {
+      // Last argument?
+      if (i + 1 == argc)
+        break;
+      i++;
+      sProcset = argv[i];
+      if ((sProcset.size() == 0) ||
+          (sProcset.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.") != string::npos))
+      {
+        cerr << "Error: Wrong procset name " << argv[i] << ", use letters, digits, ``-'', ``_'' and ``.''!" << endl;
+        return(1);
+      }
+    }
+    if (strcmp(argv[i],"--embed-procset") == 0)
+    {
+      // Last argument?
+      if (i + 1 == argc)
+        break;
+      i++;
+      sEmbedProcset = argv[i];
+    }
+    if (strcmp(argv[i],"--store") == 0)
+    {
+      // Last argument?
+      if (i + 1 == argc)
+        break;
+      i++;
+      sStoreFile = argv[i];
+    }
+    if (strcmp(argv[i],"--extract") == 0)
+    {
+      // Last two arguments?
+      if (i + 2 >= argc)
+        break;
+      i++;
+      sExtractStore = argv[i];
+      i++;
+      llExtractLine = strtoull(argv[i], 0, 10);
+    }
+    if (strcmp(argv[i],"--dedup") == 0)
+    {
+      bDedup = true;
+    }
+    if (strcmp(argv[i],"--dedup-table") == 0)
+    {
+      // Last argument?
+      if (i + 1 == argc)
+        break;
+      i++;
+      if (atoi(argv[i]) < 1)
+      {
+        cerr << "Error: Wrong table size " << argv[i] << ", use a number of entries > 0!" << endl;
+        return(1);
+      }
+      iDedupTableSize = atoi(argv[i]);
+    }
+    if (strcmp(argv[i],"--no-splice") == 0)
+    {
+      bSpliceAllowed = false;
+    }
+    if (strcmp(argv[i],"--validate") == 0)
+    {
+      bValidate = true;
+    }
+    if (strcmp(argv[i],"--rejects") == 0)
+    {
+      // Last argument?
+      if (i + 1 == argc)
+        break;
+      i++;
+      sRejectsFile = argv[i];
+    }
+    if (strcmp(argv[i],"--preview") == 0)
+    {
+      // Last argument?
+      if (i + 1 == argc)
+        break;
+      i++;
+      if (strcmp(argv[i],"epsi") == 0)
+        iPreview = pvEpsi;
+      else if (strcmp(argv[i],"tiff") == 0)
+        iPreview = pvTiff;
+      else
+      {
+        cerr << "Error: Unknown preview " << argv[i] << ", use epsi or tiff!" << endl;
+        return(1);
+      }
+    }
+    if (strcmp(argv[i],"--delay") == 0)
+    {
+      // Last argument?
+      if (i + 1 == argc)
+        break;
+      i++;
+      iGifDelay = atoi(argv[i]);
+    }
   } 
 
-  // Open font definition file
-  // Try to open the file
-  std::ifstream *fFont = new std::ifstream(sFontFile.c_str());
-  if (!(*fFont))
+  // Register the main thread first, and write the trace once at exit
+  if (bTrace == true)
   {
-    cerr << "Error: Could not open font definition file " << sFontFile << "!" << endl;
+    traceThreadBuffer();
+    atexit(writeTrace);
+  }
+
+  // Write the font catalogue only?
+  if (sCatalogueDir.size() > 0)
+  {
+    if (!writeCatalogue(cout, sCatalogueDir))
+      return(1);
+    return(0);
+  }
+
+  // Extract a single diagram from a store only?
+  if (sExtractStore.size() > 0)
+  {
+#ifdef _WIN32
+    cerr << "Error: Stores aren't supported on Windows!" << endl;
     return(1);
+#else
+    if (!extractDiagram())
+      return(1);
+    return(0);
+#endif
   }
 
-  // Check file header...
-  if (!checkFileHeader((*fFont)))
+  // Embed the procset into the files of a previous call only?
+  if (sEmbedProcset.size() > 0)
   {
-    cerr << "Error: Wrong file header in Postscript font definition file " << sFontFile << "!" << endl;
+    if (!embedProcset(sEmbedProcset))
+      return(1);
+    return(0);
+  }
+
+  // Validate the input only, without the font
+  if (bValidate == true)
+  {
+    if ((iShards > 0) || (sWatchFile.size() > 0))
+    {
+      cerr << "Error: The validation can't be combined with shards or --watch!" << endl;
+      return(1);
+    }
+    if (!validateInput())
+      return(1);
+    return(0);
+  }
+  if (sRejectsFile.size() > 0)
+  {
+    cerr << "Error: --rejects needs --validate!" << endl;
+    return(1);
+  }
+
+  // Previews are only for single EPS diagrams
+  if ((iPreview != pvNone) && ((iGridRows > 0) || (iOutputFormat == ofGif)))
+  {
+    cerr << "Error: Previews can't be added to grid pages or GIF animations!" << endl;
     return(1);
   }
 
-  // Read font infos from *.fed file...
-  readFontInfos((*fFont));
-  fFont->close();
-  // Delete ifstream, for now...
-  delete fFont;
+  // Load the font
+  long long llStart = traceClock();
+  if (!loadFont())
+    return(1);
+  traceSpan("font load", 0, llStart);
 
-  // Initialize frame export...
-  for (i = 26; i < 34; i++)
-    pbSymbolExport[i] = true;
-  // Do we export with notation?
-  if (bNotation == true)
+  // Write the font as built-in font only?
+  if (bFontHeader == true)
   {
-    // Yes, so kick out the simple left and bottom frame...
-    pbSymbolExport[27] = false;
-    pbSymbolExport[29] = false;
-    //...and include the frames with notation
-    for (i = 34; i < 50; i++)
-      pbSymbolExport[i] = true;
+    writeFontHeader(cout);
+    return(0);
   }
-  else
+
+  // Prepare the font for the output
+  prepareFont();
+
+  // Write the symbols of all diagrams to the procset file
+  if (sProcset.size() > 0)
   {
-    // No, so set frames with notation to ``false''...
-    for (i = 34; i < 50; i++)
-      pbSymbolExport[i] = false;
+    if ((bPrefixExport == false) || (vVariantSpecs.size() > 0) || (iGridRows > 0) ||
+        (iOutputFormat != ofEps) || (bType3 == true) || (sWatchFile.size() > 0))
+    {
+      cerr << "Error: A procset needs ``-p'' and EPS diagrams, without variants, grid pages, --type3 or --watch!" << endl;
+      return(1);
+    }
+    if (!writeProcsetFile())
+      return(1);
+  }
+
+  // Append all diagrams to a single store
+  if (sStoreFile.size() > 0)
+  {
+#ifdef _WIN32
+    cerr << "Error: Stores aren't supported on Windows!" << endl;
+    return(1);
+#else
+    if ((bPrefixExport == true) || (vVariantSpecs.size() > 0) || (iGridRows > 0) ||
+        (iOutputFormat == ofGif) || (bFramed == true) || (bDedup == true) ||
+        (sWatchFile.size() > 0))
+    {
+      cerr << "Error: A store can't be combined with ``-p'', variants, grid pages, GIF animation, frames, --dedup or --watch!" << endl;
+      return(1);
+    }
+    if (!openStore())
+      return(1);
+#endif
+  }
+
+  // Render repeated positions only once
+  if (bDedup == true)
+  {
+    if ((vVariantSpecs.size() > 0) || (iGridRows > 0) || (iOutputFormat == ofGif) ||
+        (sWatchFile.size() > 0))
+    {
+      cerr << "Error: --dedup can't be combined with variants, grid pages, GIF animation or --watch!" << endl;
+      return(1);
+    }
+    setupDedup(maxDiagramFileSize());
+  }
+
+  // Write several variants of each diagram
+  if (vVariantSpecs.size() > 0)
+  {
+    if ((bPrefixExport == true) || (iGridRows > 0) || (iOutputFormat == ofGif) ||
+        (bFramed == true) || (bFanout == true) || (sWatchFile.size() > 0))
+    {
+      cerr << "Error: Variants can't be combined with ``-p'', grid pages, GIF animation, frames, --fanout or --watch!" << endl;
+      return(1);
+    }
+    if (!setupVariants())
+      return(1);
+    bPrefixExport = true;
+  }
+
+  // Keep the diagrams up to date, until we get interrupted
+  if (sWatchFile.size() > 0)
+  {
+    if ((bPrefixExport == false) || (iGridRows > 0) ||
+        (iOutputFormat == ofGif) || (iShards > 0))
+    {
+      cerr << "Error: Watching the input needs ``-p'', without grid pages, GIF animation or shards!" << endl;
+      return(1);
+    }
+    if (!watchInput())
+      return(1);
+    return(0);
+  }
+
+  // The animated GIF image
+  std::ofstream fGif;
+
+  // Grid pages are always EPS
+  if ((iGridRows > 0) && (iOutputFormat != ofEps))
+  {
+    cerr << "Error: Grid pages can't be written as raster images!" << endl;
+    return(1);
   }
+  // Start the grid with the frames
+  for (i = 0; i < ciFontSymbols; i++)
+    pbGridExport[i] = pbSymbolExport[i];
+  // Caption of the current board
+  string sCaption;
 
-  // The output file
-  std::ofstream *fOut;
+  // Prepare the raster output
+  if (iOutputFormat == ofGif)
+  {
+    fGif.open(sGifFile.c_str(), ios::out | ios::binary);
+    if (!fGif)
+    {
+      cerr << "Error: Could not open output file " << sGifFile << "!" << endl;
+      return(1);
+    }
+    writeGifHeader(fGif);
+  }
+
+  // Frames are written to ``stdout'', one for each diagram
+  if ((bFramed == true) &&
+      ((bPrefixExport == true) || (iGridRows > 0) || (iOutputFormat == ofGif)))
+  {
+    cerr << "Error: Frames can't be written with ``-p'', as grid pages or GIF animation!" << endl;
+    return(1);
+  }
+
+  // Select the share of the input
+  if (iShards > 0)
+  {
+    if ((iGridRows > 0) || (iOutputFormat == ofGif))
+    {
+      cerr << "Error: Shards can't be written as grid pages or GIF animation!" << endl;
+      return(1);
+    }
+    startShard();
+  }
+
+  // Start the background writer
+  if ((bAsyncOutput == true) && ((bPrefixExport == false) || (iGridRows > 0)))
+    bAsyncOutput = false;
+  if (bAsyncOutput == true)
+    startAsyncOutput();
+
+#ifdef __linux__
+  // Splice the diagrams into a pipe on ``stdout''
+  struct stat stStdout;
+  if ((bSpliceAllowed == true) && (bDedup == false) && (bPrefixExport == false) &&
+      (sStoreFile.size() == 0) &&
+      (iGridRows == 0) && (iOutputFormat == ofEps) && (iPreview != pvTiff) &&
+      (fstat(1, &stStdout) == 0) && S_ISFIFO(stStdout.st_mode))
+  {
+    bSpliceOutput = true;
+    compileExportCache();
+  }
+#endif
+
+  // Buffer size for a single diagram file
+  string::size_type iFileSize = maxDiagramFileSize();
+#ifdef F2E_COUNT_ALLOCATIONS
+  // Number of diagrams that may allocate, until the buffers have
+  // grown: the first diagram or grid page, and the buffers of all
+  // files that the asynchronous writer may keep
+  int iWarmup = (iGridRows > 0) ? iGridRows*iGridColumns : 1;
+  if (bAsyncOutput == true)
+    iWarmup += ciMaxQueuedJobs + wpWriterPool.Threads.size();
+  // Number of diagrams so far
+  int iDiagrams = 0;
+  // Number of diagrams that needed allocations after the warmup
+  int iAllocatingDiagrams = 0;
+#endif
 
-  // Read from cin until EOF encountered...
-  getline(cin, inputLine);
-  while (!cin.eof())
+  // DOS EPS files can't follow each other in a stream, so with a
+  // TIFF preview ``stdout'' only takes a single diagram (frames and
+  // stores keep the diagrams apart)
+  bool bSingleDiagram = (iPreview == pvTiff) && (bPrefixExport == false) &&
+                        (bFramed == false) && (sStoreFile.size() == 0) &&
+                        (vVariants.size() == 0);
+  // Number of diagrams so far, for bSingleDiagram
+  unsigned long long llStreamDiagrams = 0;
+
+  // Read from stdin until EOF encountered...
+  startInput(ciInputBlocks);
+  while (readInputLine(pcLine, iLength) == true)
   {
     lineNumber++;
+    F2E_PROBE2(line_read, lineNumber, iLength);
+#ifdef F2E_COUNT_ALLOCATIONS
+    long long llLineAllocations = llAllocations;
+#endif
+
+    // Skip the lines of other shards...
+    bool bOwnLine = true;
+    if (iShards > 0)
+    {
+      bool bShardEnd;
+      bOwnLine = lineInShard(iLength, bShardEnd);
+      if (bShardEnd == true)
+        break;
+    }
 
     // Skip empty lines...
-    if (inputLine.size() != 0)
+    if ((bOwnLine == true) && (iLength != 0))
     {
-      if (expandFENString(inputLine) == true)
+      if (iGridRows > 0)
+        readEpdId(pcLine, iLength, sCaption);
+      llStart = traceClock();
+      bool bValid = expandFENString(pcLine, iLength);
+      F2E_PROBE2(fen_decode, lineNumber, (int) bValid);
+      traceSpan("FEN decode", lineNumber, llStart);
+      if ((bValid == true) && (bSingleDiagram == true) && (++llStreamDiagrams > 1))
+      {
+        cerr << "Error: Only a single diagram with TIFF preview can be written to `stdout', use ``-p''!" << endl;
+        bOutputError = true;
+        break;
+      }
+      if (bValid == true)
       {
-        if (bPrefixExport == false)
+        if (iGridRows > 0)
+        {
+          // Add the board to the current page
+          addGridCell(sCaption);
+          if ((iGridCells == iGridRows*iGridColumns) &&
+              (finishGridPage() == false))
+            break;
+        }
+        else if (iOutputFormat == ofGif)
+        {
+          // Update the image and add it as frame
+          renderRasterDiagram();
+          writeGifFrame(fGif, iGifDelay);
+        }
+        else if (vVariants.size() > 0)
+        {
+          // Write all variants of the diagram
+          if (writeVariants() == false)
+            break;
+        }
+#ifdef __linux__
+        else if (bSpliceOutput == true)
         {
-          // Write EPS header
-          writeEpsHeader(cout);
-
-          // Export the pieces...
-          fFont = new std::ifstream(sFontFile.c_str());
-          // Skip ``FontInfo'' section
-          skipSection((*fFont), "FontInfo"); 
-          exportPieces(cout, (*fFont));
-          fFont->close();
-          // Delete ifstream
-          delete fFont;
-
-          // Write chess diagram
-          writeDiagram(cout);
-        
-          // Write EPS trailer
-          writeEpsTrailer(cout);
+          // Splice the diagram into the pipe on ``stdout''
+          obFileBuffer.Data.clear();
+          obFileBuffer.Data.reserve(iFileSize);
+          writeDiagramFile(osFileStream);
+          if (writeSplicedDiagram(bFramed, lineNumber) == false)
+            break;
+        }
+#endif
+#ifndef _WIN32
+        else if (sStoreFile.size() > 0)
+        {
+          // Append the diagram to the store
+          obFileBuffer.Data.clear();
+          obFileBuffer.Data.reserve(iFileSize);
+          writeDiagramFile(osFileStream);
+          if (storeDiagram(lineNumber, obFileBuffer.Data) == false)
+            break;
+        }
+#endif
+        else if ((bDedup == true) && (bPrefixExport == false))
+        {
+          // Write the diagram of a repeated position again, as it was
+          const char *pcData;
+          string::size_type iSize;
+          if (findDuplicate() == true)
+          {
+            llDedupRepeated++;
+            pcData = dedupSlot();
+            iSize = pdeDedupEntry->Size;
+          }
+          else
+          {
+            obFileBuffer.Data.clear();
+            obFileBuffer.Data.reserve(iFileSize);
+            writeDiagramFile(osFileStream);
+            rememberDiagram(&obFileBuffer.Data);
+            pcData = obFileBuffer.Data.data();
+            iSize = obFileBuffer.Data.size();
+          }
+          if (bFramed == true)
+            writeFrame(cout, lineNumber, "ok", pcData, iSize);
+          else
+            cout.write(pcData, iSize);
+        }
+        else if (bFramed == true)
+        {
+          // Write the diagram as frame to ``stdout''
+          obFileBuffer.Data.clear();
+          obFileBuffer.Data.reserve(iFileSize);
+          writeDiagramFile(osFileStream);
+          writeFrame(cout, lineNumber, "ok", obFileBuffer.Data.data(),
+                     obFileBuffer.Data.size());
+        }
+        else if (bPrefixExport == false)
+        {
+          // Write the diagram to ``stdout''
+          writeDiagramFile(cout);
         }
         else
         {
-          fileNumber++;
-          sFileNumber = "";
-          // Open new file
-          ostringstream fN(sFileNumber);
-          fN << fileNumber;
-          sFileNumber = fN.str();
-          sOutFile = sPrefix + sFileNumber + ".eps";
-          // The output file
-          fOut = new std::ofstream(sOutFile.c_str());
-          
-          if (!(*fOut))
+          // Shards number their files by the input line
+          if (iShards > 0)
+            fileNumber = lineNumber;
+          else
+            fileNumber++;
+          const char *sExtension = (iOutputFormat == ofPgm) ? ".pgm" : ".eps";
+          makeOutFileName(sExtension);
+
+          // A repeated position gets linked to its first file
+          if ((bDedup == false) || (linkOutputFile(sExtension) == false))
           {
-            cerr << "Error: Could not open output file " << sOutFile << "!" << endl;
-            delete fOut;
-            break; 
+            // Write the diagram into the reused buffer
+            obFileBuffer.Data.clear();
+            obFileBuffer.Data.reserve(iFileSize);
+            writeDiagramFile(osFileStream);
+
+            if (bAsyncOutput == true)
+            {
+              // Hand the diagram over to the writer
+              if (submitOutputFile(sOutFile, obFileBuffer.Data) == false)
+                break;
+            }
+            else
+            {
+              // Write the file
+              if (writeOutputFile(sOutFile, obFileBuffer.Data,
+                                  binaryOutput(), lineNumber) == false)
+                break;
+            }
           }
+        }
 
-          // Write EPS header
-          writeEpsHeader((*fOut));
-
-          // Export the pieces...
-          fFont = new std::ifstream(sFontFile.c_str());
-          // Skip ``FontInfo'' section
-          skipSection((*fFont), "FontInfo"); 
-          exportPieces((*fOut), (*fFont));
-          fFont->close();
-          // Delete ifstream
-          delete fFont;
-
-          // Write chess diagram
-          writeDiagram((*fOut));
-        
-          // Write EPS trailer
-          writeEpsTrailer((*fOut));
-          
-          // Close file
-          (*fOut).close();
-
-          // Delete ofstream
-          delete fOut;
+#ifdef F2E_COUNT_ALLOCATIONS
+        if ((++iDiagrams > iWarmup) && (llAllocations != llLineAllocations))
+        {
+          cerr << "Error: Line " << lineNumber << " needed ";
+          cerr << (llAllocations - llLineAllocations) << " allocations!" << endl;
+          iAllocatingDiagrams++;
         }
+#endif
+      }
+      else if (bFramed == true)
+      {
+        // Report the invalid line, instead of skipping it
+        static const char pcInvalid[] = "Invalid FEN string";
+        writeFrame(cout, lineNumber, "error", pcInvalid, sizeof(pcInvalid) - 1);
       }
     }
+  }
+
+  // Wait for the decoder
+  bool bInputOk = finishInput();
+
+  if (bDedup == true)
+    reportDedup();
+
+#ifndef _WIN32
+  // Append the index, with an entry for each input line
+  if ((sStoreFile.size() > 0) && (finishStore(lineNumber) == false))
+    return(1);
+#endif
+
+#ifdef F2E_COUNT_ALLOCATIONS
+  cerr << iAllocatingDiagrams << " of " << iDiagrams;
+  cerr << " diagrams needed allocations after the warmup." << endl;
+  if (iAllocatingDiagrams > 0)
+    bInputOk = false;
+#endif
 
-    // Read next line
-    getline(cin, inputLine);
+  if (iGridRows > 0)
+  {
+    // Write the last page and, for ``stdout'', the trailer
+    finishGridPage();
+    if (bPrefixExport == false)
+      writeGridTrailer(cout);
+  }
+
+  if (iOutputFormat == ofGif)
+  {
+    writeGifTrailer(fGif);
+    fGif.close();
   }
 
+  // Wait for the background writer
+  if ((bAsyncOutput == true) && (finishAsyncOutput() == false))
+    return(1);
+
+  if ((bInputOk == false) || (bOutputError == true))
+    return(1);
+
   return(0);
 }
 
@@ -0,0 +1,184 @@
+/* Fen2eps - A program for converting a FEN (Forsyth Edwards Notation)
+*            string to an EPS (Encapsulated Postscript) file.
+* Copyright (C) 2003-2010 by Dirk Baechle (dl9obn@darc.de)
+*
+* http://fen2eps.sourceforge.net
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU General Public License
+* as published by the Free Software Foundation; either version 2
+* of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public
+* License along with this program; if not, write to the
+*
+* Free Software Foundation, Inc.
+* 675 Mass Ave
+* Cambridge
+* MA 02139
+* USA
+*
+*/
+
+/**
+\file fen2eps_store.h
+\author Dirk Baechle
+\version 1.2
+\brief Reader for the diagram stores of ``fen2eps --store''.
+
+A store keeps all diagrams of a run in a single file:
+
+- a header of 32 bytes: the magic ``F2ESTORE'', the version and
+  the format of the diagrams (4 bytes each), the number of index
+  entries and the offset of the index (8 bytes each),
+- the diagrams, one after the other,
+- the index, with an entry of 16 bytes for each input line: the
+  offset and the length of its diagram (8 bytes each, length 0
+  for a line without diagram).
+
+All numbers are little endian. The reader maps the file into
+memory, so a diagram is found with a single lookup and returned
+without copying it. Plain C, such that other languages can use
+it too.
+*/
+
+#ifndef FEN2EPS_STORE_H
+#define FEN2EPS_STORE_H
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/** Magic bytes at the start of a store */
+#define F2E_STORE_MAGIC "F2ESTORE"
+/** Version of the store format */
+#define F2E_STORE_VERSION 1
+/** Size of the header, in bytes */
+#define F2E_STORE_HEADER_SIZE 32
+/** Size of an index entry, in bytes */
+#define F2E_STORE_ENTRY_SIZE 16
+
+/** Formats of the diagrams */
+#define F2E_STORE_EPS 0
+#define F2E_STORE_PGM 1
+#define F2E_STORE_DOS_EPS 2
+
+/** Struct that keeps an opened store. */
+struct f2e_store
+{
+  /** The mapped file */
+  const unsigned char *Data;
+  /** Size of the file */
+  size_t Size;
+  /** Format of the diagrams, see F2E_STORE_EPS */
+  unsigned int Format;
+  /** Number of index entries, i.e. the last input line */
+  unsigned long long Entries;
+  /** The index */
+  const unsigned char *Index;
+};
+
+/** Returns the little endian number of \a iBytes bytes at \a p.
+@param p Start of the number
+@param iBytes Number of bytes
+@return The number
+*/
+static inline unsigned long long f2eStoreNumber(const unsigned char *p, int iBytes)
+{
+  unsigned long long llValue = 0;
+  int i;
+  for (i = iBytes - 1; i >= 0; i--)
+    llValue = (llValue << 8) | p[i];
+  return llValue;
+}
+
+/** Opens the store \a pcFile and maps it into memory.
+@param psStore The store
+@param pcFile Name of the file
+@return 0 if the store could be opened, -1 else (also for a store
+that wasn't finished)
+*/
+static inline int f2eOpenStore(struct f2e_store *psStore, const char *pcFile)
+{
+  struct stat stFile;
+  void *pData;
+  unsigned long long llIndex;
+  int iFd = open(pcFile, O_RDONLY);
+
+  psStore->Data = 0;
+  if (iFd < 0)
+    return -1;
+  if ((fstat(iFd, &stFile) != 0) || (stFile.st_size < F2E_STORE_HEADER_SIZE))
+  {
+    close(iFd);
+    return -1;
+  }
+  pData = mmap(0, stFile.st_size, PROT_READ, MAP_SHARED, iFd, 0);
+  close(iFd);
+  if (pData == MAP_FAILED)
+    return -1;
+
+  psStore->Data = (const unsigned char *) pData;
+  psStore->Size = stFile.st_size;
+  psStore->Format = (unsigned int) f2eStoreNumber(psStore->Data + 12, 4);
+  psStore->Entries = f2eStoreNumber(psStore->Data + 16, 8);
+  llIndex = f2eStoreNumber(psStore->Data + 24, 8);
+  if ((memcmp(psStore->Data, F2E_STORE_MAGIC, 8) != 0) ||
+      (f2eStoreNumber(psStore->Data + 8, 4) != F2E_STORE_VERSION) ||
+      (llIndex < F2E_STORE_HEADER_SIZE) || (llIndex > psStore->Size) ||
+      (psStore->Entries > (psStore->Size - llIndex) / F2E_STORE_ENTRY_SIZE))
+  {
+    munmap(pData, psStore->Size);
+    psStore->Data = 0;
+    return -1;
+  }
+  psStore->Index = psStore->Data + llIndex;
+  return 0;
+}
+
+/** Looks up the diagram of the input line \a llLine in the store.
+@param psStore The store
+@param llLine Number of the input line, starting at 1
+@param ppData Receives the start of the diagram, in the mapped file
+@param piSize Receives the size of the diagram
+@return 1 if the line has a diagram, 0 else
+*/
+static inline int f2eStoreDiagram(const struct f2e_store *psStore, unsigned long long llLine,
+                                  const char **ppData, size_t *piSize)
+{
+  const unsigned char *pEntry;
+  unsigned long long llOffset, llSize;
+
+  if ((llLine < 1) || (llLine > psStore->Entries))
+    return 0;
+  pEntry = psStore->Index + (llLine - 1) * F2E_STORE_ENTRY_SIZE;
+  llOffset = f2eStoreNumber(pEntry, 8);
+  llSize = f2eStoreNumber(pEntry + 8, 8);
+  if ((llSize == 0) || (llOffset > psStore->Size) || (llSize > psStore->Size - llOffset))
+    return 0;
+  *ppData = (const char *) (psStore->Data + llOffset);
+  *piSize = (size_t) llSize;
+  return 1;
+}
+
+/** Closes the store \a psStore, the diagrams returned by
+f2eStoreDiagram() get invalid.
+@param psStore The store
+*/
+static inline void f2eCloseStore(struct f2e_store *psStore)
+{
+  if (psStore->Data != 0)
+    munmap((void *) psStore->Data, psStore->Size);
+  psStore->Data = 0;
+}
+
+#endif